@@ -0,0 +1,855 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "common.h"
+#include "pack.h"
+#include "bitmap.h"
+
+/*
+ * Reachability bitmaps, as written by GPL git with repack -b. A .bitmap
+ * stores, for a selection of commits, the set of objects reachable from
+ * the commit as a bitmap over pack positions. Questions such as "what is
+ * reachable from X but not from Y" then become bitmap operations, only the
+ * commits between X and the nearest stored bitmaps need to be walked.
+ *
+ * On disk each bitmap is EWAH compressed: a sequence of run length words,
+ * each followed by the literal words it announces. Bit 0 of a run length
+ * word is the bit the run repeats, bits 1-32 the number of repeated words
+ * and bits 33-63 the number of literal words that follow.
+ */
+
+static uint32_t
+bitmap_get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+static uint64_t
+bitmap_get_be64(const unsigned char *p)
+{
+	return ((uint64_t)bitmap_get_be32(p) << 32 | bitmap_get_be32(p + 4));
+}
+
+static void
+bitmap_put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+bitmap_put_be64(unsigned char *p, uint64_t v)
+{
+	bitmap_put_be32(p, v >> 32);
+	bitmap_put_be32(p + 4, v & 0xffffffff);
+}
+
+struct bitmap *
+bitmap_new(void)
+{
+	return (calloc(1, sizeof(struct bitmap)));
+}
+
+void
+bitmap_free(struct bitmap *bitmap)
+{
+	if (bitmap == NULL)
+		return;
+	free(bitmap->words);
+	free(bitmap);
+}
+
+/* Makes at least nwords words valid, the new ones cleared */
+static void
+bitmap_grow(struct bitmap *bitmap, size_t nwords)
+{
+	size_t alloc;
+
+	if (nwords <= bitmap->nwords)
+		return;
+
+	alloc = bitmap->nwords * 2;
+	if (alloc < nwords)
+		alloc = nwords;
+	bitmap->words = realloc(bitmap->words, sizeof(uint64_t) * alloc);
+	memset(bitmap->words + bitmap->nwords, 0,
+	    sizeof(uint64_t) * (alloc - bitmap->nwords));
+	bitmap->nwords = alloc;
+}
+
+void
+bitmap_set(struct bitmap *bitmap, size_t pos)
+{
+	bitmap_grow(bitmap, pos / 64 + 1);
+	bitmap->words[pos / 64] |= (uint64_t)1 << (pos % 64);
+}
+
+bool
+bitmap_get(struct bitmap *bitmap, size_t pos)
+{
+	if (pos / 64 >= bitmap->nwords)
+		return (false);
+	return ((bitmap->words[pos / 64] & ((uint64_t)1 << (pos % 64))) != 0);
+}
+
+void
+bitmap_or(struct bitmap *dst, struct bitmap *src)
+{
+	size_t n;
+
+	bitmap_grow(dst, src->nwords);
+	for (n = 0; n < src->nwords; n++)
+		dst->words[n] |= src->words[n];
+}
+
+static void
+bitmap_xor(struct bitmap *dst, struct bitmap *src)
+{
+	size_t n;
+
+	bitmap_grow(dst, src->nwords);
+	for (n = 0; n < src->nwords; n++)
+		dst->words[n] ^= src->words[n];
+}
+
+void
+bitmap_and_not(struct bitmap *dst, struct bitmap *src)
+{
+	size_t n;
+
+	for (n = 0; n < dst->nwords && n < src->nwords; n++)
+		dst->words[n] &= ~src->words[n];
+}
+
+size_t
+bitmap_popcount(struct bitmap *bitmap)
+{
+	size_t count, n;
+
+	count = 0;
+	for (n = 0; n < bitmap->nwords; n++)
+		count += __builtin_popcountll(bitmap->words[n]);
+
+	return (count);
+}
+
+/*
+ * Decodes the EWAH bitmap at buf into bitmap, which must be empty.
+ * Returns the number of bytes it takes, or -1 if it is truncated.
+ */
+ssize_t
+ewah_read(unsigned char *buf, size_t left, struct bitmap *bitmap)
+{
+	unsigned char *words;
+	uint64_t rlw, runlen, nlit;
+	uint64_t nwords, i, pos, n;
+
+	if (left < 8)
+		return (-1);
+	nwords = bitmap_get_be32(buf + 4);
+	if (left < 12 + nwords * 8)
+		return (-1);
+	words = buf + 8;
+
+	i = pos = 0;
+	while (i < nwords) {
+		rlw = bitmap_get_be64(words + i * 8);
+		i++;
+		runlen = (rlw >> 1) & 0xffffffff;
+		nlit = rlw >> 33;
+		if (i + nlit > nwords)
+			return (-1);
+
+		bitmap_grow(bitmap, pos + runlen + nlit);
+		if (rlw & 1)
+			memset(bitmap->words + pos, 0xff,
+			    sizeof(uint64_t) * runlen);
+		pos += runlen;
+		for (n = 0; n < nlit; n++, pos++, i++)
+			bitmap->words[pos] = bitmap_get_be64(words + i * 8);
+	}
+
+	return (12 + nwords * 8);
+}
+
+/* Returns the size of the EWAH bitmap at buf, or -1 if it is truncated */
+static ssize_t
+ewah_size(unsigned char *buf, size_t left)
+{
+	uint64_t nwords;
+
+	if (left < 8)
+		return (-1);
+	nwords = bitmap_get_be32(buf + 4);
+	if (left < 12 + nwords * 8)
+		return (-1);
+
+	return (12 + nwords * 8);
+}
+
+/* Compresses bitmap with EWAH and writes it */
+void
+ewah_write(int fd, struct bitmap *bitmap, SHA1_CTX *ctx)
+{
+	unsigned char *out;
+	uint64_t runlen, nlit, run;
+	size_t n, i, nout, rlwpos;
+
+	n = bitmap->nwords;
+	while (n > 0 && bitmap->words[n-1] == 0)
+		n--;
+
+	/* At worst every literal word needs its own run length word */
+	out = malloc(12 + (2 * n + 1) * 8);
+	i = nout = rlwpos = 0;
+	do {
+		rlwpos = nout++;
+		runlen = nlit = 0;
+		run = 0;
+		if (i < n && (bitmap->words[i] == 0 ||
+		    bitmap->words[i] == ~(uint64_t)0)) {
+			run = bitmap->words[i];
+			while (i < n && bitmap->words[i] == run &&
+			    runlen < 0xffffffff) {
+				runlen++;
+				i++;
+			}
+		}
+		while (i < n && bitmap->words[i] != 0 &&
+		    bitmap->words[i] != ~(uint64_t)0 && nlit < 0x7fffffff) {
+			bitmap_put_be64(out + 8 + nout * 8, bitmap->words[i]);
+			nout++;
+			nlit++;
+			i++;
+		}
+		bitmap_put_be64(out + 8 + rlwpos * 8,
+		    (run & 1) | runlen << 1 | nlit << 33);
+	} while (i < n);
+
+	bitmap_put_be32(out, n * 64);
+	bitmap_put_be32(out + 4, nout);
+	bitmap_put_be32(out + 8 + nout * 8, rlwpos);
+	sha_write(fd, out, 12 + nout * 8, ctx);
+
+	free(out);
+}
+
+static int
+bitmap_entry_cmp(const void *a, const void *b)
+{
+	const struct bitmap_entry *x = *(struct bitmap_entry * const *)a;
+	const struct bitmap_entry *y = *(struct bitmap_entry * const *)b;
+	return (x->idxpos < y->idxpos ? -1 : x->idxpos > y->idxpos);
+}
+
+/* Returns the stored bitmap of the commit at idx position idxpos, if any */
+static struct bitmap_entry *
+bitmap_find_entry(struct pack_bitmap *pb, uint32_t idxpos)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = pb->nentries;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pb->lookup[mid]->idxpos == idxpos)
+			return (pb->lookup[mid]);
+		else if (pb->lookup[mid]->idxpos < idxpos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (NULL);
+}
+
+/* Decodes a stored bitmap, applying the bitmap it is xor'ed against */
+static struct bitmap *
+bitmap_entry_get(struct pack_bitmap *pb, struct bitmap_entry *entry)
+{
+	struct bitmap_entry *base;
+
+	if (entry->bitmap != NULL)
+		return (entry->bitmap);
+
+	entry->bitmap = bitmap_new();
+	ewah_read(entry->ewah, pb->map + pb->size - 20 - entry->ewah,
+	    entry->bitmap);
+	if (entry->xoroffset) {
+		base = entry - entry->xoroffset;
+		bitmap_xor(entry->bitmap, bitmap_entry_get(pb, base));
+	}
+
+	return (entry->bitmap);
+}
+
+/* Builds the idx to pack position table from the reverse index */
+static void
+bitmap_load_positions(struct pack_bitmap *pb)
+{
+	struct fan *fans;
+	int n;
+
+	fans = (struct fan *)(pb->packfile->idxmap + 8);
+	pb->nobjects = ntohl(fans->count[255]);
+
+	pack_rev_load(pb->packfile);
+	pb->idxtorev = malloc(sizeof(int) * pb->nobjects);
+	for (n = 0; n < pb->nobjects; n++)
+		pb->idxtorev[ntohl(pb->packfile->revindex[n])] = n;
+}
+
+/* Returns the pack position of a binary SHA, or -1 if not in the pack */
+static int
+bitmap_sha_pos(struct pack_bitmap *pb, uint8_t *sha_bin)
+{
+	int idxpos;
+
+	idxpos = pack_find_sha_position(sha_bin, pb->packfile->idxmap);
+	if (idxpos == -1)
+		return (-1);
+
+	return (pb->idxtorev[idxpos]);
+}
+
+/*
+ * Finds the .bitmap in objects/pack and loads it with its pack. Returns
+ * NULL if there is none or it cannot be used.
+ */
+struct pack_bitmap *
+bitmap_open(void)
+{
+	DIR *d;
+	struct dirent *dir;
+	struct pack_bitmap *pb;
+	struct stat sb;
+	char packdir[PATH_MAX], path[PATH_MAX];
+	unsigned char *p, *end;
+	ssize_t used;
+	char *file_ext;
+	int fd, n;
+
+	snprintf(packdir, sizeof(packdir), "%s/objects/pack", dotgitpath);
+	d = opendir(packdir);
+	if (d == NULL)
+		return (NULL);
+
+	path[0] = '\0';
+	while ((dir = readdir(d)) != NULL) {
+		file_ext = strrchr(dir->d_name, '.');
+		if (file_ext && !strncmp(file_ext, ".bitmap", 8)) {
+			snprintf(path, sizeof(path), "%s/%s", packdir,
+			    dir->d_name);
+			break;
+		}
+	}
+	closedir(d);
+	if (path[0] == '\0')
+		return (NULL);
+
+	pb = calloc(1, sizeof(struct pack_bitmap));
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &sb) == -1 ||
+	    sb.st_size < BITMAP_HEADER_SIZE + 20) {
+		if (fd != -1)
+			close(fd);
+		free(pb);
+		return (NULL);
+	}
+	pb->size = sb.st_size;
+	pb->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pb->map == MAP_FAILED) {
+		free(pb);
+		return (NULL);
+	}
+
+	/* The pack has the same name with .idx */
+	strlcpy(strrchr(path, '.'), ".idx", 5);
+	pb->packfile = pack_registry_get(path);
+	if (pb->packfile == NULL)
+		goto bad;
+
+	if (memcmp(pb->map, BITMAP_SIGNATURE, 4) ||
+	    bitmap_get_be32(pb->map + 4) >> 16 != BITMAP_VERSION ||
+	    (bitmap_get_be32(pb->map + 4) & BITMAP_OPT_FULL_DAG) == 0 ||
+	    memcmp(pb->map + 12, pb->packfile->idxmap +
+	    pb->packfile->idxsize - 40, 20))
+		goto bad;
+
+	bitmap_load_positions(pb);
+
+	p = pb->map + BITMAP_HEADER_SIZE;
+	end = pb->map + pb->size - 20;
+	for (n = 0; n < 4; n++) {
+		used = ewah_read(p, end - p, &pb->types[n]);
+		if (used == -1)
+			goto bad;
+		p += used;
+	}
+
+	pb->nentries = bitmap_get_be32(pb->map + 8);
+	pb->entries = calloc(pb->nentries, sizeof(struct bitmap_entry));
+	pb->lookup = malloc(sizeof(struct bitmap_entry *) * pb->nentries);
+	for (n = 0; n < pb->nentries; n++) {
+		if (end - p < 6)
+			goto bad;
+		pb->entries[n].idxpos = bitmap_get_be32(p);
+		pb->entries[n].xoroffset = p[4];
+		pb->entries[n].flags = p[5];
+		pb->entries[n].ewah = p + 6;
+		if (pb->entries[n].idxpos >= pb->nobjects ||
+		    pb->entries[n].xoroffset > n)
+			goto bad;
+		used = ewah_size(p + 6, end - p - 6);
+		if (used == -1)
+			goto bad;
+		p += 6 + used;
+		pb->lookup[n] = &pb->entries[n];
+	}
+	qsort(pb->lookup, pb->nentries, sizeof(struct bitmap_entry *),
+	    bitmap_entry_cmp);
+
+	return (pb);
+
+bad:
+	strlcpy(strrchr(path, '.'), ".bitmap", 8);
+	fprintf(stderr, "warning: ignoring invalid %s\n", path);
+	bitmap_close(pb);
+	return (NULL);
+}
+
+void
+bitmap_close(struct pack_bitmap *pb)
+{
+	int n;
+
+	if (pb == NULL)
+		return;
+	for (n = 0; n < pb->nentries; n++)
+		bitmap_free(pb->entries[n].bitmap);
+	for (n = 0; n < 4; n++)
+		free(pb->types[n].words);
+	free(pb->entries);
+	free(pb->lookup);
+	free(pb->idxtorev);
+	if (pb->map != NULL)
+		munmap(pb->map, pb->size);
+	free(pb);
+}
+
+/* Reads the object at pack position pos, without the loose header */
+static unsigned char *
+bitmap_read_object(struct pack_bitmap *pb, int pos, unsigned long *size)
+{
+	struct decompressed_object object;
+	struct objectinfo objectinfo;
+	off_t offset;
+
+	bzero(&objectinfo, sizeof(struct objectinfo));
+	offset = pack_position_offset(pb->packfile->idxmap,
+	    ntohl(pb->packfile->revindex[pos]));
+	if (pack_object_header(pb->packfile, offset, &objectinfo, NULL)) {
+		free(objectinfo.deltas);
+		return (NULL);
+	}
+
+	pack_buffer_cb(pb->packfile, &objectinfo, &object);
+	*size = object.size;
+	return (object.data);
+}
+
+struct bitmap_stack {
+	int		*pos;
+	int		 npos;
+	int		 maxpos;
+};
+
+static int
+bitmap_push_sha(struct pack_bitmap *pb, struct bitmap_stack *stack,
+    uint8_t *sha_bin)
+{
+	int pos;
+
+	pos = bitmap_sha_pos(pb, sha_bin);
+	if (pos == -1)
+		return (-1);
+
+	if (stack->npos == stack->maxpos) {
+		stack->maxpos = stack->maxpos ? stack->maxpos * 2 : 256;
+		stack->pos = realloc(stack->pos, sizeof(int) * stack->maxpos);
+	}
+	stack->pos[stack->npos++] = pos;
+
+	return (0);
+}
+
+/* Pushes the SHA in a line such as "tree <sha>" at p, if it is one */
+static int
+bitmap_push_line(struct pack_bitmap *pb, struct bitmap_stack *stack,
+    char *p, char *end, const char *field)
+{
+	uint8_t sha_bin[20];
+	size_t len;
+
+	len = strlen(field);
+	if (end - p < len + HASH_SIZE || memcmp(p, field, len))
+		return (1);
+
+	sha_str_to_bin_network(p + len, sha_bin);
+	return (bitmap_push_sha(pb, stack, sha_bin));
+}
+
+/*
+ * Sets in result every object reachable from the object at pack position
+ * pos. Commits with a stored bitmap are not walked, their bitmap is or'ed
+ * in. The object types come from pb->types, tree entries are classified
+ * by their mode and gitlinks are skipped. Returns -1 if a reachable object
+ * is not in the pack.
+ */
+static int
+bitmap_walk(struct pack_bitmap *pb, struct bitmap *result, int pos)
+{
+	struct bitmap_stack stack;
+	struct bitmap_entry *entry;
+	unsigned char *data, *p, *end;
+	unsigned long size;
+	uint32_t idxpos;
+	int ret = 0;
+
+	bzero(&stack, sizeof(struct bitmap_stack));
+	stack.pos = malloc(sizeof(int) * 256);
+	stack.maxpos = 256;
+	stack.pos[stack.npos++] = pos;
+
+	while (stack.npos > 0 && ret == 0) {
+		pos = stack.pos[--stack.npos];
+		if (bitmap_get(result, pos))
+			continue;
+
+		if (bitmap_get(&pb->types[OBJ_BLOB - 1], pos)) {
+			bitmap_set(result, pos);
+			continue;
+		}
+
+		idxpos = ntohl(pb->packfile->revindex[pos]);
+		if (bitmap_get(&pb->types[OBJ_COMMIT - 1], pos)) {
+			entry = bitmap_find_entry(pb, idxpos);
+			if (entry != NULL) {
+				bitmap_or(result, bitmap_entry_get(pb, entry));
+				continue;
+			}
+		}
+
+		bitmap_set(result, pos);
+		data = bitmap_read_object(pb, pos, &size);
+		if (data == NULL) {
+			ret = -1;
+			break;
+		}
+		p = data;
+		end = data + size;
+
+		if (bitmap_get(&pb->types[OBJ_TREE - 1], pos)) {
+			/* Entries are "<mode> <name>\0<20 byte sha>" */
+			while (p < end && ret == 0) {
+				bool gitlink = !strncmp((char *)p, "160000", 6);
+				p = memchr(p, '\0', end - p);
+				if (p == NULL || end - p < 21)
+					break;
+				if (!gitlink)
+					ret = bitmap_push_sha(pb, &stack, p + 1);
+				p += 21;
+			}
+		}
+		else if (bitmap_get(&pb->types[OBJ_COMMIT - 1], pos)) {
+			ret = bitmap_push_line(pb, &stack, (char *)p,
+			    (char *)end, "tree ");
+			p = memchr(p, '\n', end - p);
+			while (p != NULL && ret == 0 && ++p < end &&
+			    (ret = bitmap_push_line(pb, &stack, (char *)p,
+			    (char *)end, "parent ")) == 0)
+				p = memchr(p, '\n', end - p);
+			if (ret == 1)
+				ret = 0;
+		}
+		else if (bitmap_get(&pb->types[OBJ_TAG - 1], pos)) {
+			ret = bitmap_push_line(pb, &stack, (char *)p,
+			    (char *)end, "object ");
+		}
+
+		free(data);
+	}
+
+	free(stack.pos);
+	return (ret ? -1 : 0);
+}
+
+/*
+ * Returns the set of objects reachable from the tips, NULL if some object
+ * is not in the bitmapped pack, in which case the caller must walk.
+ */
+struct bitmap *
+bitmap_reachable(struct pack_bitmap *pb, uint8_t (*tips)[20], int ntips)
+{
+	struct bitmap *result;
+	int n, pos;
+
+	result = bitmap_new();
+	for (n = 0; n < ntips; n++) {
+		pos = bitmap_sha_pos(pb, tips[n]);
+		if (pos == -1 || bitmap_walk(pb, result, pos)) {
+			bitmap_free(result);
+			return (NULL);
+		}
+	}
+
+	return (result);
+}
+
+/* Returns the number of objects of type set in bitmap */
+size_t
+bitmap_count_type(struct pack_bitmap *pb, struct bitmap *bitmap, int type)
+{
+	struct bitmap *typemap;
+	size_t count, n;
+
+	typemap = &pb->types[type - 1];
+	count = 0;
+	for (n = 0; n < bitmap->nwords && n < typemap->nwords; n++)
+		count += __builtin_popcountll(bitmap->words[n] &
+		    typemap->words[n]);
+
+	return (count);
+}
+
+/* Calls handler with the SHA of every object of type set in bitmap */
+void
+bitmap_each(struct pack_bitmap *pb, struct bitmap *bitmap, int type,
+    bitmap_handler handler, void *arg)
+{
+	struct bitmap *typemap;
+	unsigned char *sha;
+	uint64_t word;
+	size_t n;
+	int pos;
+
+	typemap = &pb->types[type - 1];
+	for (n = 0; n < bitmap->nwords && n < typemap->nwords; n++) {
+		word = bitmap->words[n] & typemap->words[n];
+		while (word) {
+			pos = n * 64 + __builtin_ctzll(word);
+			word &= word - 1;
+			sha = pb->packfile->idxmap + 8 + sizeof(struct fan) +
+			    ntohl(pb->packfile->revindex[pos]) *
+			    sizeof(struct entry);
+			handler(sha, type, arg);
+		}
+	}
+}
+
+/*
+ * Writes the .bitmap of packfile, which must contain every object
+ * reachable from the tips. Bitmaps are stored for each tip and for every
+ * BITMAP_SELECT_INTERVAL commits of the history, computed oldest first so
+ * that each walk stops at the bitmaps already built. Returns 0 on success.
+ */
+int
+bitmap_write(struct packfile *packfile, uint8_t (*tips)[20], int ntips)
+{
+	struct pack_bitmap *pb;
+	struct objectinfo objectinfo;
+	struct bitmap_stack commits;
+	struct bitmap_entry *entry;
+	struct bitmap seen;
+	struct bitmap *tipmap;
+	unsigned char hdr[BITMAP_HEADER_SIZE];
+	unsigned char digest[20];
+	unsigned char *data, *p, *end;
+	uint8_t sha_bin[20];
+	unsigned long size;
+	char path[PATH_MAX], lockpath[PATH_MAX];
+	off_t offset;
+	SHA1_CTX ctx;
+	int fd, n, x, pos, ret;
+
+	pb = calloc(1, sizeof(struct pack_bitmap));
+	pb->packfile = packfile;
+	bitmap_load_positions(pb);
+
+	/* The type of every object, read from the pack headers */
+	for (pos = 0; pos < pb->nobjects; pos++) {
+		bzero(&objectinfo, sizeof(struct objectinfo));
+		offset = pack_position_offset(packfile->idxmap,
+		    ntohl(packfile->revindex[pos]));
+		if (pack_object_header(packfile, offset, &objectinfo, NULL) ||
+		    objectinfo.ftype < OBJ_COMMIT ||
+		    objectinfo.ftype > OBJ_TAG) {
+			free(objectinfo.deltas);
+			bitmap_close(pb);
+			return (-1);
+		}
+		free(objectinfo.deltas);
+		bitmap_set(&pb->types[objectinfo.ftype - 1], pos);
+	}
+
+	/* List the commits, newest first, peeling tags */
+	bzero(&commits, sizeof(struct bitmap_stack));
+	bzero(&seen, sizeof(struct bitmap));
+	tipmap = bitmap_new();
+	for (n = 0; n < ntips; n++) {
+		pos = bitmap_sha_pos(pb, tips[n]);
+		while (pos != -1 && bitmap_get(&pb->types[OBJ_TAG - 1], pos)) {
+			data = bitmap_read_object(pb, pos, &size);
+			if (data == NULL || size < 7 + HASH_SIZE)
+				goto fail;
+			sha_str_to_bin_network((char *)data + 7, sha_bin);
+			free(data);
+			pos = bitmap_sha_pos(pb, sha_bin);
+		}
+		if (pos == -1)
+			goto fail;
+		if (bitmap_get(&pb->types[OBJ_COMMIT - 1], pos) &&
+		    !bitmap_get(&seen, pos)) {
+			bitmap_set(&seen, pos);
+			bitmap_set(tipmap, pos);
+			if (commits.npos == commits.maxpos) {
+				commits.maxpos = commits.maxpos ?
+				    commits.maxpos * 2 : 256;
+				commits.pos = realloc(commits.pos,
+				    sizeof(int) * commits.maxpos);
+			}
+			commits.pos[commits.npos++] = pos;
+		}
+	}
+	for (x = 0; x < commits.npos; x++) {
+		data = bitmap_read_object(pb, commits.pos[x], &size);
+		if (data == NULL)
+			goto fail;
+		p = memchr(data, '\n', size);
+		end = data + size;
+		while (p != NULL && ++p < end && end - p >= 7 + HASH_SIZE &&
+		    !memcmp(p, "parent ", 7)) {
+			n = commits.npos;
+			if (bitmap_push_line(pb, &commits, (char *)p,
+			    (char *)end, "parent ")) {
+				free(data);
+				goto fail;
+			}
+			if (bitmap_get(&seen, commits.pos[n]))
+				commits.npos--;
+			else
+				bitmap_set(&seen, commits.pos[n]);
+			p = memchr(p, '\n', end - p);
+		}
+		free(data);
+	}
+
+	/* Build the selected bitmaps from the oldest commit up */
+	pb->entries = calloc(commits.npos, sizeof(struct bitmap_entry));
+	pb->lookup = malloc(sizeof(struct bitmap_entry *) * commits.npos);
+	for (x = commits.npos - 1; x >= 0; x--) {
+		pos = commits.pos[x];
+		if (x % BITMAP_SELECT_INTERVAL && !bitmap_get(tipmap, pos))
+			continue;
+
+		entry = &pb->entries[pb->nentries];
+		entry->idxpos = ntohl(packfile->revindex[pos]);
+		entry->bitmap = bitmap_new();
+		if (bitmap_walk(pb, entry->bitmap, pos)) {
+			bitmap_free(entry->bitmap);
+			goto fail;
+		}
+
+		/* Keep the lookup sorted for the walks that follow */
+		for (n = pb->nentries; n > 0 &&
+		    pb->lookup[n-1]->idxpos > entry->idxpos; n--)
+			pb->lookup[n] = pb->lookup[n-1];
+		pb->lookup[n] = entry;
+		pb->nentries++;
+	}
+
+	snprintf(path, sizeof(path), "%s", packfile->path);
+	strlcpy(path+strlen(path)-5, ".bitmap", 8);
+	snprintf(lockpath, sizeof(lockpath), "%s.lock", path);
+	fd = open(lockpath, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+	if (fd == -1) {
+		fprintf(stderr, "error: unable to create '%s'\n", lockpath);
+		goto fail;
+	}
+
+	SHA1_Init(&ctx);
+	memcpy(hdr, BITMAP_SIGNATURE, 4);
+	bitmap_put_be32(hdr + 4, BITMAP_VERSION << 16 | BITMAP_OPT_FULL_DAG);
+	bitmap_put_be32(hdr + 8, pb->nentries);
+	memcpy(hdr + 12, packfile->idxmap + packfile->idxsize - 40, 20);
+	sha_write(fd, hdr, BITMAP_HEADER_SIZE, &ctx);
+	for (n = 0; n < 4; n++)
+		ewah_write(fd, &pb->types[n], &ctx);
+	for (n = 0; n < pb->nentries; n++) {
+		/* No xor compression, each bitmap stands alone */
+		bitmap_put_be32(hdr, pb->entries[n].idxpos);
+		hdr[4] = 0;
+		hdr[5] = 0;
+		sha_write(fd, hdr, 6, &ctx);
+		ewah_write(fd, pb->entries[n].bitmap, &ctx);
+	}
+	SHA1_Final(digest, &ctx);
+	write(fd, digest, 20);
+	close(fd);
+
+	ret = rename(lockpath, path);
+	if (ret == -1)
+		unlink(lockpath);
+
+	free(commits.pos);
+	free(seen.words);
+	bitmap_free(tipmap);
+	bitmap_close(pb);
+	return (ret);
+
+fail:
+	free(commits.pos);
+	free(seen.words);
+	bitmap_free(tipmap);
+	bitmap_close(pb);
+	return (-1);
+}
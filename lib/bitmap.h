@@ -0,0 +1,100 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "pack.h"
+
+/* Header source Documentation/technical/bitmap-format.txt */
+
+#define BITMAP_SIGNATURE	"BITM"
+#define BITMAP_VERSION		1
+#define BITMAP_HEADER_SIZE	32
+#define BITMAP_OPT_FULL_DAG	0x0001
+#define BITMAP_OPT_HASH_CACHE	0x0004
+
+/* Commits are selected for a stored bitmap at this spacing, and all tips */
+#define BITMAP_SELECT_INTERVAL	100
+
+/*
+ * An uncompressed bitmap. Bit n is the object at position n in pack order,
+ * which is the order of the pack's reverse index. Words past nwords are 0.
+ */
+struct bitmap {
+	uint64_t	*words;
+	size_t		 nwords;
+};
+
+struct bitmap_entry {
+	uint32_t	 idxpos;		// Of the commit in the .idx
+	uint8_t		 xoroffset;
+	uint8_t		 flags;
+	unsigned char	*ewah;			// In the map, NULL if built
+	struct bitmap	*bitmap;		// Decoded on first use
+};
+
+/*
+ * The .bitmap of a pack. types[] has the objects of each type, in the
+ * order OBJ_COMMIT, OBJ_TREE, OBJ_BLOB, OBJ_TAG. lookup has the entries
+ * sorted by idxpos.
+ */
+struct pack_bitmap {
+	struct packfile	*packfile;
+	unsigned char	*map;
+	off_t		 size;
+	int		 nobjects;
+	int		*idxtorev;		// idx position to pack position
+	struct bitmap	 types[4];
+	struct bitmap_entry *entries;
+	struct bitmap_entry **lookup;
+	int		 nentries;
+};
+
+typedef void	 bitmap_handler(uint8_t *sha_bin, int type, void *arg);
+
+struct bitmap	*bitmap_new(void);
+void		 bitmap_free(struct bitmap *bitmap);
+void		 bitmap_set(struct bitmap *bitmap, size_t pos);
+bool		 bitmap_get(struct bitmap *bitmap, size_t pos);
+void		 bitmap_or(struct bitmap *dst, struct bitmap *src);
+void		 bitmap_and_not(struct bitmap *dst, struct bitmap *src);
+size_t		 bitmap_popcount(struct bitmap *bitmap);
+ssize_t		 ewah_read(unsigned char *buf, size_t left, struct bitmap *bitmap);
+void		 ewah_write(int fd, struct bitmap *bitmap, SHA1_CTX *ctx);
+struct pack_bitmap *bitmap_open(void);
+void		 bitmap_close(struct pack_bitmap *pb);
+struct bitmap	*bitmap_reachable(struct pack_bitmap *pb, uint8_t (*tips)[20], int ntips);
+size_t		 bitmap_count_type(struct pack_bitmap *pb, struct bitmap *bitmap, int type);
+void		 bitmap_each(struct pack_bitmap *pb, struct bitmap *bitmap, int type,
+		     bitmap_handler handler, void *arg);
+int		 bitmap_write(struct packfile *packfile, uint8_t (*tips)[20], int ntips);
+
+#endif
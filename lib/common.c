@@ -63,50 +63,290 @@ const char *object_name[] = {
 };
 
 /*
- * Description: Recovers a tree object and iterates through it. It will also
- * identify the object type.
- * Arguments: 1) treesha is a char[HASH_SIZE]
- * 2) tree_handler is what the function should do with the resultant data
+ * Probing the store for the object of every tree entry checks that it
+ * has the type the entry's mode says. It is on in debug builds.
+ */
+#ifdef NDEBUG
+bool tree_verify = true;
+#else
+bool tree_verify = false;
+#endif
+
+/*
+ * Returns the type of the object a tree entry with this mode names: a tree
+ * for a directory, a commit for a gitlink (a submodule, whose commit is in
+ * another repository) and a blob otherwise.
+ */
+int
+tree_entry_type(unsigned int mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFDIR:
+		return (OBJ_TREE);
+	case S_IFGITLINK:
+		return (OBJ_COMMIT);
+	default:
+		return (OBJ_BLOB);
+	}
+}
+
+/*
+ * Starts iterating over the entries of a tree object. The iterator takes
+ * over tree->data, tree_iter_finish frees it.
  */
 void
-iterate_tree(struct decompressed_object *decompressed_object, tree_handler tree_handler, void *args)
+tree_iter_init(struct tree_iter *iter, struct decompressed_object *tree)
+{
+	iter->data = tree->data;
+	iter->size = tree->size;
+	iter->offset = 0;
+	iter->entries = NULL;
+	iter->nentries = 0;
+}
+
+/* Reads the tree object sha and starts iterating over it */
+void
+tree_iter_read(struct tree_iter *iter, uint8_t *sha)
+{
+	struct decompressed_object tree;
+	char shastr[HASH_SIZE+1];
+	int type;
+
+	tree.data = object_read(sha, &type, &tree.size);
+	if (type != OBJ_TREE) {
+		sha_bin_to_str(sha, shastr);
+		shastr[HASH_SIZE] = '\0';
+		fprintf(stderr, "fatal: ogit: %s is not a tree\n", shastr);
+		exit(128);
+	}
+	tree_iter_init(iter, &tree);
+}
+
+/* Parses the entry at offset into entry, returns the offset of the next */
+static unsigned long
+tree_iter_parse(struct tree_iter *iter, unsigned long offset,
+    struct tree_entry *entry)
+{
+	unsigned char *p, *nul, *end;
+
+	p = iter->data + offset;
+	end = iter->data + iter->size;
+	entry->mode = 0;
+	while (p < end && *p >= '0' && *p <= '7')
+		entry->mode = entry->mode * 8 + *p++ - '0';
+	if (p == iter->data + offset || p == end || *p != ' ')
+		goto corrupt;
+
+	entry->name = (char *)++p;
+	nul = memchr(p, '\0', end - p);
+	if (nul == NULL || end - nul - 1 < 20)
+		goto corrupt;
+	entry->namelen = nul - p;
+	entry->sha = nul + 1;
+	entry->type = tree_entry_type(entry->mode);
+
+	return (entry->sha + 20 - iter->data);
+corrupt:
+	fprintf(stderr, "fatal: ogit: corrupt tree object\n");
+	exit(128);
+}
+
+/*
+ * Checks that the object of a tree entry has the type its mode says, see
+ * tree_verify. Gitlinks name objects of another repository.
+ */
+static void
+tree_iter_verify(struct tree_entry *entry)
+{
+	char shastr[HASH_SIZE+1];
+	unsigned long size;
+	int type;
+
+	if (entry->type == OBJ_COMMIT)
+		return;
+
+	sha_bin_to_str(entry->sha, shastr);
+	shastr[HASH_SIZE] = '\0';
+	if (object_info(entry->sha, &type, &size)) {
+		fprintf(stderr, "fatal: ogit: Cannot retrieve %s\n", shastr);
+		exit(128);
+	}
+	if (type != entry->type) {
+		fprintf(stderr, "fatal: ogit: %s is a %s, its tree entry %s "
+		    "has mode %o\n", shastr, object_name[type], entry->name,
+		    entry->mode);
+		exit(128);
+	}
+}
+
+/*
+ * Moves to the next entry of the tree. Its name and binary sha point into
+ * the tree's buffer, nothing is copied, and its type comes from its mode,
+ * see tree_entry_type. Returns false past the last entry. The caller may
+ * stop at any entry.
+ */
+bool
+tree_iter_next(struct tree_iter *iter, struct tree_entry *entry)
+{
+	if (iter->offset >= iter->size)
+		return (false);
+
+	iter->offset = tree_iter_parse(iter, iter->offset, entry);
+	if (tree_verify)
+		tree_iter_verify(entry);
+	return (true);
+}
+
+/*
+ * Compares a tree entry to a name the way git sorts trees: a tree sorts as
+ * if its name ended with a '/'.
+ */
+static int
+tree_name_cmp(struct tree_entry *entry, const char *name, size_t namelen,
+    bool dir)
+{
+	size_t len;
+	int c1, c2, cmp;
+
+	len = (entry->namelen < namelen) ? entry->namelen : namelen;
+	cmp = memcmp(entry->name, name, len);
+	if (cmp != 0)
+		return (cmp);
+
+	c1 = (len < entry->namelen) ? (unsigned char)entry->name[len] :
+	    (entry->type == OBJ_TREE) ? '/' : '\0';
+	c2 = (len < namelen) ? (unsigned char)name[len] : dir ? '/' : '\0';
+	return (c1 - c2);
+}
+
+/* Binary searches the indexed entries for name, as a tree if dir is set */
+static bool
+tree_iter_search(struct tree_iter *iter, const char *name, size_t namelen,
+    bool dir, struct tree_entry *entry)
 {
-	long offset = 0;
-	long space;
-	uint8_t *shabin;
-	char shastr[HASH_SIZE+1], mode[7];
-	char *filename;
-	uint8_t type;
-
-	while(offset<decompressed_object->size) {
-		/* Get the file mode */
-		strlcpy(mode, (char *)decompressed_object->data+offset, 7);
-		if (mode[5] != ' ')
-			space = 6;
+	int lo, hi, mid, cmp;
+
+	lo = 0;
+	hi = iter->nentries;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		tree_iter_parse(iter, iter->entries[mid], entry);
+		cmp = tree_name_cmp(entry, name, namelen, dir);
+		if (cmp == 0)
+			return (true);
+		if (cmp < 0)
+			lo = mid + 1;
 		else
-			space = 5;
-		offset = offset + space;
-		mode[space] = '\0';
+			hi = mid;
+	}
+	return (false);
+}
+
+/*
+ * Finds the entry called name in the tree, which git keeps sorted. The
+ * first lookup notes where each entry starts, after which each one is a
+ * binary search. A name sorts differently for a tree than for a blob, so
+ * both places are tried. Returns false if there is no such entry. The
+ * position of tree_iter_next is not changed.
+ */
+bool
+tree_iter_find(struct tree_iter *iter, const char *name, size_t namelen,
+    struct tree_entry *entry)
+{
+	unsigned long offset;
+	int max;
+
+	if (iter->entries == NULL) {
+		max = 16;
+		iter->entries = malloc(sizeof(unsigned long) * max);
+		for (offset = 0; offset < iter->size;
+		    offset = tree_iter_parse(iter, offset, entry)) {
+			if (iter->nentries == max) {
+				max *= 2;
+				iter->entries = realloc(iter->entries,
+				    sizeof(unsigned long) * max);
+			}
+			iter->entries[iter->nentries++] = offset;
+		}
+	}
+
+	if (!tree_iter_search(iter, name, namelen, false, entry) &&
+	    !tree_iter_search(iter, name, namelen, true, entry))
+		return (false);
+	if (tree_verify)
+		tree_iter_verify(entry);
+	return (true);
+}
 
-		filename = (char *)decompressed_object->data+offset+1;
-		offset = offset + strlen((char *)decompressed_object->data+offset) + 1;
+/* Frees the tree and what the iterator allocated */
+void
+tree_iter_finish(struct tree_iter *iter)
+{
+	free(iter->data);
+	free(iter->entries);
+	iter->data = NULL;
+	iter->entries = NULL;
+}
 
-		/* Get the SHA, convert it to a string */
-		shabin = decompressed_object->data + offset;
-		sha_bin_to_str(shabin, shastr);
+/*
+ * Reads the type and size of an object from its headers alone, without
+ * inflating its content. Returns 0, or -1 if the object does not exist.
+ */
+int
+object_info(uint8_t *sha, int *type, unsigned long *size)
+{
+	struct packfile *packfile;
+	char shastr[HASH_SIZE+1];
+	off_t offset;
+
+	if (loose_object_info(sha, type, size) == 0)
+		return (0);
+
+	packfile = pack_registry_lookup(sha, &offset);
+	if (packfile == NULL)
+		return (-1);
+	if (pack_object_info(packfile, offset, type, size)) {
+		sha_bin_to_str(sha, shastr);
 		shastr[HASH_SIZE] = '\0';
+		fprintf(stderr, "fatal: ogit: Cannot retrieve %s, delta base "
+		    "is missing from %s\n", shastr, packfile->path);
+		exit(128);
+	}
+
+	return (0);
+}
 
-		/* Determine the type */
-		CONTENT_HANDLER(shastr, get_type_loose_cb, get_type_pack_cb, &type);
+static void
+object_read_pack_cb(struct packfile *packfile, struct objectinfo *objectinfo,
+    void *pargs)
+{
+	struct loosearg *loosearg = pargs;
 
-		if (tree_handler)
-			tree_handler(mode, type, shastr, filename, args);
+	loosearg->type = objectinfo->ftype;
+	pack_buffer_cb(packfile, objectinfo, &loosearg->decompressed_object);
+}
+
+/*
+ * Reads a whole object from the loose store or a pack. The returned buffer
+ * has no loose header, its type is stored in *type. Exits if the object
+ * does not exist.
+ */
+unsigned char *
+object_read(uint8_t *sha, int *type, unsigned long *size)
+{
+	struct loosearg loosearg;
+	struct decompressed_object object;
 
-		/* Skip over the binary sha */
-		offset = offset + 20;
+	if (loose_read(sha, type, &object) == 0) {
+		*size = object.size;
+		return (object.data);
 	}
 
-	free(decompressed_object->data);
+	bzero(&loosearg, sizeof(struct loosearg));
+	pack_content_handler(sha, object_read_pack_cb, &loosearg);
+	*type = loosearg.type;
+	*size = loosearg.decompressed_object.size;
+	return (loosearg.decompressed_object.data);
 }
 
 int
@@ -167,54 +407,43 @@ update_branch_pointer(char repodir, char *ref, char *sha)
 void
 sha_bin_to_str(uint8_t *bin, char *str)
 {
+	static const char hex[] = "0123456789abcdef";
 	int x;
-	for(x=0;x<HASH_SIZE/2;x++) {
-		str[(x*2)] = bin[x] >> 4;
-		str[(x*2)+1] = bin[x] & 0x0f;
-	}
 
-	for(x=0;x<HASH_SIZE;x++)
-		if (str[x] <= 9)
-			str[x] = str[x] + '0';
-		else
-			str[x] = str[x] + 87;
+	for (x = 0; x < HASH_SIZE/2; x++) {
+		str[x*2] = hex[bin[x] >> 4];
+		str[x*2+1] = hex[bin[x] & 0x0f];
+	}
 }
 
+/* The value of each hex digit, -1 for anything else */
+static const int8_t hexval[256] = {
+	[0 ... 255] = -1,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
 /*
- * Description: Convert a binary format to a string
- * Arguments: 1) char[HASH_SIZE] source, 2) Pointer to SHA output
+ * Description: Converts a SHA string to binary format
+ * Arguments: 1) char[HASH_SIZE] source, 2) Pointer to the uint8_t[20]
  * which stores the output binary hash
+ * Returns 0, or -1 if str has a character that is not a hex digit
  */
-void
-sha_str_to_bin(char *str, uint8_t *bin)
-{
-	for(int x=0;x<HASH_SIZE;x=x+2) {
-		if (str[x] >= '0' && str[x] <= '9')
-			bin[x/2] = (str[x] - '0') & 0x0f;
-		else if (str[x] >= 'a' && str[x] <= 'f')
-			bin[x/2] = (str[x] - 'a' + 10) & 0x0f;
-
-		if (str[x+1] >= '0' && str[x+1] <= '9')
-			bin[x/2] |= (str[x+1] - '0') << 4;
-		else if (str[x+1] >= 'a' && str[x+1] <= 'f')
-			bin[x/2] |= (str[x+1] - 'a' + 10) << 4;
-	}
-}
-
-void
+int
 sha_str_to_bin_network(char *str, uint8_t *bin)
 {
-	for(int x=0;x<HASH_SIZE;x=x+2) {
-		if (str[x] >= '0' && str[x] <= '9')
-			bin[x/2] = ((str[x] - '0') << 4) & 0xf0;
-		else if (str[x] >= 'a' && str[x] <= 'f')
-			bin[x/2] = ((str[x] - 'a' + 10) << 4) & 0xf0;
-
-		if (str[x+1] >= '0' && str[x+1] <= '9')
-			bin[x/2] |= (str[x+1] - '0') & 0x0f;
-		else if (str[x+1] >= 'a' && str[x+1] <= 'f')
-			bin[x/2] |= (str[x+1] - 'a' + 10) & 0x0f;
+	int x, hi, lo;
+
+	for (x = 0; x < HASH_SIZE/2; x++) {
+		hi = hexval[(unsigned char)str[x*2]];
+		lo = hexval[(unsigned char)str[x*2+1]];
+		if ((hi | lo) < 0)
+			return (-1);
+		bin[x] = (hi << 4) | lo;
 	}
+	return (0);
 }
 
 /* Description: Returns number of digits in integer */
@@ -254,13 +483,13 @@ parse_commitcontent(struct commitcontent *commitcontent, char *header, long len)
 		/* Single line */
 		if (type == COMMITCONTENT_BLANK && token[0] != ' ') {
 			if (!strncmp(token, "tree ", 5)) {
-				strlcpy(commitcontent->treesha, token + 5, HASH_SIZE+1);
+				sha_str_to_bin_network(token + 5, commitcontent->treesha);
 			}
 			else if (!strncmp(token, "parent ", 7)) {
 				commitcontent->parent = realloc(commitcontent->parent,
-				    sizeof(char *) * (commitcontent->numparent+1));
-				commitcontent->parent[commitcontent->numparent] = malloc(HASH_SIZE+1);
-				strlcpy(commitcontent->parent[commitcontent->numparent], token+7, HASH_SIZE+1);
+				    sizeof(*commitcontent->parent) * (commitcontent->numparent+1));
+				sha_str_to_bin_network(token + 7,
+				    commitcontent->parent[commitcontent->numparent]);
 				commitcontent->numparent++;
 			}
 			else if (!strncmp(token, "author ", 7)) {
@@ -329,11 +558,8 @@ free_commitcontent(struct commitcontent *commitcontent)
 	if (commitcontent->committer_name)
 		free(commitcontent->committer_tz);
 
-	if (commitcontent->parent) {
-		for(int x=0;x>commitcontent->numparent;x++)
-			free(commitcontent->parent[x]);
+	if (commitcontent->parent)
 		free(commitcontent->parent);
-	}
 
 	if (commitcontent->message) {
 		for(int x=0;x>commitcontent->lines;x++)
@@ -28,24 +28,13 @@
 #define __COMMON_H__
 
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #define EXIT_SUCCESS		0	/* Success */
 #define EXIT_INVALID_COMMAND	129	/* Invalid command */
 
-/* Portability */
-#if defined(__FreeBSD__)
-#include <sha.h>
-#elif defined(__OpenBSD__)
-#include <sha1.h>
-
-#define SHA1_End(x, y)	SHA1End(x, y)
-#define SHA1_Final(x, y) SHA1Final(x, y)
-#define SHA1_Init(x)	SHA1Init(x)
-#define SHA1_Update(x, y, z) SHA1Update(x, y, z)
-#else
-#error "Unsure what to do for inclusion of sha1 bits in this environment"
-#endif
+#include "sha1.h"
 
 /* From Documentation/technical/pack-format.txt */
 #define OBJ_NONE		0
@@ -60,6 +49,9 @@
 
 #define HASH_SIZE	40
 
+/* The mode of a gitlink tree entry, a directory that is also a symlink */
+#define S_IFGITLINK	0160000
+
 /*
  * Used to recover a full object in a single buffer
  * not processed incrementally
@@ -80,8 +72,8 @@ struct decompressed_object {
 
 /* Data structure used to parse commit messages */
 struct commitcontent {
-	char		 *commitsha;
-	char		  treesha[HASH_SIZE+1];
+	uint8_t		 *commitsha;		// Binary, set by the caller
+	uint8_t		  treesha[20];		// Binary
 
 	char		 *author_name;
 	char		 *author_email;
@@ -93,7 +85,7 @@ struct commitcontent {
 	time_t		  committer_time;
 	char		 *committer_tz;
 
-	char		**parent;
+	uint8_t		(*parent)[20];		// Binary
 	int		  numparent;
 	char		 *gpgsig;
 
@@ -114,11 +106,6 @@ extern const char *object_name[];
 // XXX This may need to be migrated to a generic "object.h" or the like
 #include "loose.h"
 #include "pack.h"
-#define ITERATE_TREE(treesha, tree_handler, args) {					\
-	struct decompressed_object decompressed_object;					\
-	CONTENT_HANDLER(treesha, buffer_cb, pack_buffer_cb, &decompressed_object);	\
-	iterate_tree(&decompressed_object, tree_handler, args);				\
-} while(0)
 
 
 #ifndef nitems
@@ -127,16 +114,43 @@ extern const char *object_name[];
 
 #define BIT(nr)		(1 << (nr))
 
-typedef void		tree_handler(char *, uint8_t, char *, char *, void *);
+/*
+ * An entry of a tree object, see tree_iter_next. name and sha point into
+ * the tree's buffer, name is NUL terminated there.
+ */
+struct tree_entry {
+	unsigned int	 mode;
+	int		 type;		// See tree_entry_type
+	const char	*name;
+	size_t		 namelen;
+	uint8_t		*sha;		// Binary
+};
+
+/* Walks the entries of a tree object in order */
+struct tree_iter {
+	unsigned char	*data;
+	unsigned long	 size;
+	unsigned long	 offset;	// Of the next entry
+	unsigned long	*entries;	// Offset of each entry, see tree_iter_find
+	int		 nentries;
+};
 
 extern char		repodir[PATH_MAX];
 extern char		dotgitpath[PATH_MAX];
+extern bool		tree_verify;
 int			git_repository_path();
 
-void			iterate_tree(struct decompressed_object *decompressed_object, tree_handler tree_handler, void *args);
+int			object_info(uint8_t *sha, int *type, unsigned long *size);
+unsigned char		*object_read(uint8_t *sha, int *type, unsigned long *size);
+int			tree_entry_type(unsigned int mode);
+void			tree_iter_init(struct tree_iter *iter, struct decompressed_object *tree);
+void			tree_iter_read(struct tree_iter *iter, uint8_t *sha);
+bool			tree_iter_next(struct tree_iter *iter, struct tree_entry *entry);
+bool			tree_iter_find(struct tree_iter *iter, const char *name, size_t namelen,
+			    struct tree_entry *entry);
+void			tree_iter_finish(struct tree_iter *iter);
 void			sha_bin_to_str(uint8_t *bin, char *str);
-void			sha_str_to_bin(char *str, uint8_t *bin);
-void			sha_str_to_bin_network(char *str, uint8_t *bin);
+int			sha_str_to_bin_network(char *str, uint8_t *bin);
 int			count_digits(int check);
 void			parse_commitcontent(struct commitcontent *commitcontent, char *header,
 			    long len);
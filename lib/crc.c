@@ -0,0 +1,237 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <zlib.h>
+#include "crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC_X86
+#elif defined(__aarch64__) && (defined(__linux__) || defined(__FreeBSD__))
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <asm/hwcap.h>
+#endif
+#define CRC_ARM
+#endif
+
+/*
+ * A CRC function continues crc over len bytes of buf, pre and post
+ * conditioned like zlib's crc32. The portable one is zlib's, the others
+ * are only picked if the CPU reports the instructions they need.
+ */
+typedef uint32_t crc_fn(uint32_t crc, const unsigned char *buf, size_t len);
+
+static crc_fn		*crc_func;
+static const char	*crc_name;
+static pthread_once_t	 crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+crc_portable(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	return (crc32_z(crc, buf, len));
+}
+
+#ifdef CRC_X86
+/*
+ * Folds 64 bytes at a time into four 128 bit accumulators with carry-less
+ * multiplies by x^(4*128+32) and x^(4*128-32), then folds those into one,
+ * down to 64 bits and Barrett reduces what is left to the CRC. This is the
+ * method of Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction". len is a multiple of 16, at least 64, and crc
+ * is not conditioned.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+crc_pclmul_fold(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+#define CRC_FOLD(x, k, y) do {						\
+	x5 = _mm_clmulepi64_si128(x, k, 0x00);				\
+	x = _mm_clmulepi64_si128(x, k, 0x11);				\
+	x = _mm_xor_si128(_mm_xor_si128(x, x5), y);			\
+} while (0)
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x6 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+		x7 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+		x8 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+		x0 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+		CRC_FOLD(x1, k1k2, x6);
+		CRC_FOLD(x2, k1k2, x7);
+		CRC_FOLD(x3, k1k2, x8);
+		CRC_FOLD(x4, k1k2, x0);
+		buf += 64;
+		len -= 64;
+	}
+
+	CRC_FOLD(x1, k3k4, x2);
+	CRC_FOLD(x1, k3k4, x3);
+	CRC_FOLD(x1, k3k4, x4);
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)buf);
+		CRC_FOLD(x1, k3k4, x2);
+		buf += 16;
+		len -= 16;
+	}
+#undef CRC_FOLD
+
+	/* 128 bits to 64 */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 */
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (_mm_extract_epi32(x1, 1));
+}
+
+static uint32_t
+crc_pclmul(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	size_t n;
+
+	if (len < 64)
+		return (crc32_z(crc, buf, len));
+	n = len & ~(size_t)15;
+	crc = ~crc_pclmul_fold(~crc, buf, n);
+	return (crc32_z(crc, buf + n, len - n));
+}
+
+static bool
+crc_cpu_has_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return (false);
+	return ((ecx & bit_PCLMUL) != 0 && (ecx & bit_SSE4_1) != 0);
+}
+#endif
+
+#ifdef CRC_ARM
+#if defined(__clang__)
+#define CRC_ARM_TARGET	__attribute__((target("crc")))
+#else
+#define CRC_ARM_TARGET	__attribute__((target("+crc")))
+#endif
+
+/* The ARMv8 CRC32 instructions are for this polynomial, 8 bytes a time */
+CRC_ARM_TARGET
+static uint32_t
+crc_armv8(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	uint64_t word;
+
+	crc = ~crc;
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		crc = __crc32b(crc, *buf++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&word, buf, 8);
+		crc = __crc32d(crc, word);
+		buf += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = __crc32b(crc, *buf++);
+	return (~crc);
+}
+
+static bool
+crc_cpu_has_arm(void)
+{
+	unsigned long hwcap = 0;
+
+#if defined(__linux__)
+	hwcap = getauxval(AT_HWCAP);
+#else
+	if (elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap)) != 0)
+		return (false);
+#endif
+	return ((hwcap & HWCAP_CRC32) != 0);
+}
+#endif
+
+static void
+crc_select(void)
+{
+	crc_func = crc_portable;
+	crc_name = "portable";
+#ifdef CRC_X86
+	if (crc_cpu_has_pclmul()) {
+		crc_func = crc_pclmul;
+		crc_name = "pclmul";
+	}
+#endif
+#ifdef CRC_ARM
+	if (crc_cpu_has_arm()) {
+		crc_func = crc_armv8;
+		crc_name = "armv8";
+	}
+#endif
+}
+
+/* Returns the name of the CRC function in use */
+const char *
+crc_backend(void)
+{
+	pthread_once(&crc_once, crc_select);
+	return (crc_name);
+}
+
+uint32_t
+crc_update(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc_select);
+	return (crc_func(crc, buf, len));
+}
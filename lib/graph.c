@@ -0,0 +1,683 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "common.h"
+#include "pack.h"
+#include "graph.h"
+
+/*
+ * The commit-graph holds the tree, parents, date and generation of every
+ * commit in a mapped, SHA sorted table, so commit walks can follow parents
+ * without inflating and parsing each commit. Parents are stored as
+ * positions in the same table.
+ */
+
+static uint32_t
+graph_get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+static uint64_t
+graph_get_be64(const unsigned char *p)
+{
+	return ((uint64_t)graph_get_be32(p) << 32 | graph_get_be32(p + 4));
+}
+
+static void
+graph_put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+graph_put_be64(unsigned char *p, uint64_t v)
+{
+	graph_put_be32(p, v >> 32);
+	graph_put_be32(p + 4, v & 0xffffffff);
+}
+
+void
+graph_close(struct commit_graph *graph)
+{
+	if (graph == NULL)
+		return;
+	munmap(graph->map, graph->size);
+	free(graph);
+}
+
+/*
+ * Maps and parses objects/info/commit-graph. Returns NULL if there is
+ * none, or if it is not usable, in which case a warning is printed.
+ */
+struct commit_graph *
+graph_open(void)
+{
+	char path[PATH_MAX];
+	struct commit_graph *graph;
+	struct stat sb;
+	unsigned char *chunk;
+	uint64_t offset, next;
+	int fd, n, nchunks;
+
+	snprintf(path, sizeof(path), "%s/objects/info/commit-graph",
+	    dotgitpath);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (NULL);
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return (NULL);
+	}
+
+	graph = calloc(1, sizeof(struct commit_graph));
+	graph->size = sb.st_size;
+	graph->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (graph->map == MAP_FAILED) {
+		free(graph);
+		return (NULL);
+	}
+
+	if (graph->size < GRAPH_HEADER_SIZE + GRAPH_CHUNK_ENTRY_SIZE + 20 ||
+	    graph_get_be32(graph->map) != GRAPH_SIGNATURE ||
+	    graph->map[4] != GRAPH_VERSION ||
+	    graph->map[5] != GRAPH_HASH_SHA1 || graph->map[7] != 0)
+		goto bad;
+	nchunks = graph->map[6];
+	if (graph->size < GRAPH_HEADER_SIZE +
+	    (nchunks + 1) * GRAPH_CHUNK_ENTRY_SIZE + 20)
+		goto bad;
+
+	for (n = 0; n < nchunks; n++) {
+		chunk = graph->map + GRAPH_HEADER_SIZE +
+		    n * GRAPH_CHUNK_ENTRY_SIZE;
+		offset = graph_get_be64(chunk + 4);
+		next = graph_get_be64(chunk + GRAPH_CHUNK_ENTRY_SIZE + 4);
+		if (offset > next || next > graph->size - 20)
+			goto bad;
+
+		switch (graph_get_be32(chunk)) {
+		case GRAPH_CHUNKID_OIDFANOUT:
+			if (next - offset != sizeof(uint32_t) * 256)
+				goto bad;
+			graph->fanout = (uint32_t *)(graph->map + offset);
+			break;
+		case GRAPH_CHUNKID_OIDLOOKUP:
+			graph->oids = graph->map + offset;
+			break;
+		case GRAPH_CHUNKID_DATA:
+			graph->data = graph->map + offset;
+			break;
+		case GRAPH_CHUNKID_EXTRAEDGES:
+			graph->edges = graph->map + offset;
+			graph->nedges = (next - offset) / 4;
+			break;
+		}
+	}
+
+	if (graph->fanout == NULL || graph->oids == NULL ||
+	    graph->data == NULL)
+		goto bad;
+	graph->ncommits = ntohl(graph->fanout[255]);
+	if (graph->oids + graph->ncommits * 20 > graph->map + graph->size ||
+	    graph->data + graph->ncommits * GRAPH_DATA_SIZE >
+	    graph->map + graph->size)
+		goto bad;
+
+	return (graph);
+
+bad:
+	fprintf(stderr, "warning: ignoring invalid %s\n", path);
+	graph_close(graph);
+	return (NULL);
+}
+
+/* Returns the position of a binary SHA in the graph, or -1 */
+int
+graph_find(struct commit_graph *graph, uint8_t *sha)
+{
+	int lo, hi, mid;
+	int cmp;
+
+	lo = (sha[0] == 0) ? 0 : ntohl(graph->fanout[sha[0] - 1]);
+	hi = ntohl(graph->fanout[sha[0]]);
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = memcmp(graph->oids + mid * 20, sha, 20);
+		if (cmp == 0)
+			return (mid);
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (-1);
+}
+
+uint8_t *
+graph_oid(struct commit_graph *graph, int pos)
+{
+	return (graph->oids + pos * 20);
+}
+
+uint8_t *
+graph_tree(struct commit_graph *graph, int pos)
+{
+	return (graph->data + pos * GRAPH_DATA_SIZE);
+}
+
+static int
+graph_check_parent(struct commit_graph *graph, uint32_t parent)
+{
+	if (parent >= graph->ncommits) {
+		fprintf(stderr, "fatal: commit-graph has an invalid parent "
+		    "position %u\n", parent);
+		exit(128);
+	}
+	return (parent);
+}
+
+/*
+ * Stores up to max parent positions of the commit at pos in parents.
+ * Returns the number of parents, which may be more than max.
+ */
+int
+graph_parents(struct commit_graph *graph, int pos, int *parents, int max)
+{
+	unsigned char *data;
+	uint32_t parent, edge;
+	int n;
+
+	data = graph->data + pos * GRAPH_DATA_SIZE;
+	parent = graph_get_be32(data + 20);
+	if (parent == GRAPH_PARENT_NONE)
+		return (0);
+	if (max > 0)
+		parents[0] = graph_check_parent(graph, parent);
+
+	parent = graph_get_be32(data + 24);
+	if (parent == GRAPH_PARENT_NONE)
+		return (1);
+	if ((parent & GRAPH_EXTRA_EDGES) == 0) {
+		if (max > 1)
+			parents[1] = graph_check_parent(graph, parent);
+		return (2);
+	}
+
+	/* Octopus merges list the parents after the first in EDGE */
+	n = 1;
+	edge = parent & ~GRAPH_EXTRA_EDGES;
+	do {
+		if (graph->edges == NULL || edge >= graph->nedges) {
+			fprintf(stderr, "fatal: commit-graph extra edge out of "
+			    "bounds\n");
+			exit(128);
+		}
+		parent = graph_get_be32(graph->edges + edge * 4);
+		if (n < max)
+			parents[n] = graph_check_parent(graph,
+			    parent & ~GRAPH_LAST_EDGE);
+		n++;
+		edge++;
+	} while ((parent & GRAPH_LAST_EDGE) == 0);
+
+	return (n);
+}
+
+/* The commit date takes 34 bits, the low 2 bits share a word */
+time_t
+graph_time(struct commit_graph *graph, int pos)
+{
+	unsigned char *data;
+
+	data = graph->data + pos * GRAPH_DATA_SIZE;
+	return ((time_t)(graph_get_be32(data + 28) & 0x3) << 32 |
+	    graph_get_be32(data + 32));
+}
+
+/* The topological level, 1 for root commits */
+uint32_t
+graph_generation(struct commit_graph *graph, int pos)
+{
+	return (graph_get_be32(graph->data + pos * GRAPH_DATA_SIZE + 28) >> 2);
+}
+
+struct graph_entry {
+	uint8_t		 sha[20];
+	uint8_t		 tree[20];
+	uint8_t		(*parents)[20];
+	int		 nparents;
+	int		*parentpos;
+	time_t		 time;
+	uint32_t	 level;		// 0 until computed
+	time_t		 corrected;	// Corrected commit date
+	bool		 parsed;
+};
+
+static int
+graph_entry_cmp(const void *a, const void *b)
+{
+	const struct graph_entry *x = a;
+	const struct graph_entry *y = b;
+	return (memcmp(x->sha, y->sha, 20));
+}
+
+static int
+graph_entry_find(struct graph_entry *entries, int nentries, uint8_t *sha)
+{
+	struct graph_entry key, *found;
+
+	memcpy(key.sha, sha, 20);
+	found = bsearch(&key, entries, nentries, sizeof(struct graph_entry),
+	    graph_entry_cmp);
+
+	return (found ? found - entries : -1);
+}
+
+/* Reads the tree, parents and committer date of a commit */
+static void
+graph_parse_commit(struct graph_entry *entry)
+{
+	struct commitcontent commitcontent;
+	unsigned char *data;
+	unsigned long size;
+	int type;
+
+	data = object_read(entry->sha, &type, &size);
+	bzero(&commitcontent, sizeof(struct commitcontent));
+	parse_commitcontent(&commitcontent, (char *)data, size);
+	free(data);
+
+	memcpy(entry->tree, commitcontent.treesha, 20);
+	entry->nparents = commitcontent.numparent;
+	entry->parents = commitcontent.parent;
+	commitcontent.parent = NULL;
+	entry->time = commitcontent.committer_time;
+	entry->parsed = true;
+	free_commitcontent(&commitcontent);
+}
+
+/*
+ * Lists the commits of every pack, from the object headers, sorted and
+ * without duplicates. Returns the number found.
+ */
+static int
+graph_pack_commits(struct graph_entry **entriesp)
+{
+	DIR *d;
+	struct dirent *dir;
+	struct packfile *packfile;
+	struct objectinfo objectinfo;
+	struct graph_entry *entries;
+	struct fan *fans;
+	char packdir[PATH_MAX], idxpath[PATH_MAX];
+	char *file_ext;
+	int nentries, maxentries, nobjects;
+	int n, x;
+
+	entries = NULL;
+	nentries = maxentries = 0;
+
+	snprintf(packdir, sizeof(packdir), "%s/objects/pack", dotgitpath);
+	d = opendir(packdir);
+	if (d == NULL) {
+		*entriesp = NULL;
+		return (0);
+	}
+	while ((dir = readdir(d)) != NULL) {
+		file_ext = strrchr(dir->d_name, '.');
+		if (!file_ext || strncmp(file_ext, ".idx", 5))
+			continue;
+		snprintf(idxpath, sizeof(idxpath), "%s/%s", packdir,
+		    dir->d_name);
+		packfile = pack_registry_get(idxpath);
+		if (packfile == NULL)
+			continue;
+
+		fans = (struct fan *)(packfile->idxmap + 8);
+		nobjects = ntohl(fans->count[255]);
+		for (n = 0; n < nobjects; n++) {
+			bzero(&objectinfo, sizeof(struct objectinfo));
+			if (pack_object_header(packfile,
+			    pack_position_offset(packfile->idxmap, n),
+			    &objectinfo, NULL) == 0 &&
+			    objectinfo.ftype == OBJ_COMMIT) {
+				if (nentries == maxentries) {
+					maxentries = maxentries ?
+					    maxentries * 2 : 1024;
+					entries = realloc(entries,
+					    sizeof(struct graph_entry) *
+					    maxentries);
+				}
+				bzero(&entries[nentries],
+				    sizeof(struct graph_entry));
+				memcpy(entries[nentries++].sha,
+				    packfile->idxmap + 8 + sizeof(struct fan) +
+				    n * sizeof(struct entry), 20);
+			}
+			free(objectinfo.deltas);
+		}
+	}
+	closedir(d);
+
+	qsort(entries, nentries, sizeof(struct graph_entry), graph_entry_cmp);
+	for (n = x = 0; n < nentries; n++)
+		if (x == 0 || memcmp(entries[n].sha, entries[x-1].sha, 20))
+			entries[x++] = entries[n];
+
+	*entriesp = entries;
+	return (x);
+}
+
+/* Computes the levels and corrected dates, parents before children */
+static void
+graph_compute_generations(struct graph_entry *entries, int nentries)
+{
+	struct graph_entry *entry, *parent;
+	int *stack;
+	int nstack, maxstack;
+	int n, p;
+	bool ready;
+
+	maxstack = 1024;
+	stack = malloc(sizeof(int) * maxstack);
+	for (n = 0; n < nentries; n++) {
+		if (entries[n].level)
+			continue;
+		nstack = 0;
+		stack[nstack++] = n;
+		while (nstack > 0) {
+			entry = &entries[stack[nstack-1]];
+			if (entry->level) {
+				nstack--;
+				continue;
+			}
+
+			ready = true;
+			for (p = 0; p < entry->nparents; p++) {
+				if (entries[entry->parentpos[p]].level)
+					continue;
+				ready = false;
+				if (nstack == maxstack) {
+					maxstack *= 2;
+					stack = realloc(stack,
+					    sizeof(int) * maxstack);
+				}
+				stack[nstack++] = entry->parentpos[p];
+			}
+			if (!ready)
+				continue;
+
+			entry->level = 1;
+			entry->corrected = entry->time;
+			for (p = 0; p < entry->nparents; p++) {
+				parent = &entries[entry->parentpos[p]];
+				if (parent->level >= entry->level)
+					entry->level = parent->level + 1;
+				if (parent->corrected >= entry->corrected)
+					entry->corrected = parent->corrected + 1;
+			}
+			if (entry->level > GRAPH_GENERATION_MAX)
+				entry->level = GRAPH_GENERATION_MAX;
+			nstack--;
+		}
+	}
+	free(stack);
+}
+
+/*
+ * Writes objects/info/commit-graph for the commits in every pack, plus
+ * any parents they reach that are only loose, in the layout GPL git
+ * writes by default: OIDF, OIDL, CDAT and GDA2, with GDO2 and EDGE when
+ * needed. Returns 0 on success.
+ */
+int
+graph_write(void)
+{
+	struct graph_entry *entries, *entry;
+	uint8_t (*missing)[20];
+	unsigned char chunks[7][GRAPH_CHUNK_ENTRY_SIZE];
+	unsigned char hdr[GRAPH_HEADER_SIZE];
+	unsigned char buf[GRAPH_DATA_SIZE];
+	unsigned char digest[20];
+	char path[PATH_MAX], lockpath[PATH_MAX];
+	uint32_t chunkids[6];
+	uint64_t chunksizes[6], offset;
+	int nentries, nmissing, nedges, noverflow;
+	int nchunks, fd, n, p, x;
+	time_t genoffset;
+	SHA1_CTX ctx;
+
+	nentries = graph_pack_commits(&entries);
+
+	/* Parse every commit, adding parents that are not in a pack */
+	for (;;) {
+		missing = NULL;
+		nmissing = 0;
+		for (n = 0; n < nentries; n++) {
+			if (entries[n].parsed)
+				continue;
+			graph_parse_commit(&entries[n]);
+			for (p = 0; p < entries[n].nparents; p++) {
+				if (graph_entry_find(entries, nentries,
+				    entries[n].parents[p]) != -1)
+					continue;
+				missing = realloc(missing,
+				    sizeof(*missing) * (nmissing + 1));
+				memcpy(missing[nmissing++],
+				    entries[n].parents[p], 20);
+			}
+		}
+		if (nmissing == 0)
+			break;
+
+		entries = realloc(entries,
+		    sizeof(struct graph_entry) * (nentries + nmissing));
+		for (x = 0; x < nmissing; x++) {
+			bzero(&entries[nentries + x],
+			    sizeof(struct graph_entry));
+			memcpy(entries[nentries + x].sha, missing[x], 20);
+		}
+		free(missing);
+		nentries += nmissing;
+		qsort(entries, nentries, sizeof(struct graph_entry),
+		    graph_entry_cmp);
+		for (n = x = 0; n < nentries; n++)
+			if (x == 0 ||
+			    memcmp(entries[n].sha, entries[x-1].sha, 20))
+				entries[x++] = entries[n];
+			else
+				free(entries[n].parents);
+		nentries = x;
+	}
+
+	nedges = noverflow = 0;
+	for (n = 0; n < nentries; n++) {
+		entry = &entries[n];
+		entry->parentpos = malloc(sizeof(int) * entry->nparents);
+		for (p = 0; p < entry->nparents; p++)
+			entry->parentpos[p] = graph_entry_find(entries,
+			    nentries, entry->parents[p]);
+		if (entry->nparents > 2)
+			nedges += entry->nparents - 1;
+	}
+	graph_compute_generations(entries, nentries);
+	for (n = 0; n < nentries; n++)
+		if (entries[n].corrected - entries[n].time > 0x7fffffff)
+			noverflow++;
+
+	nchunks = 0;
+	chunkids[nchunks] = GRAPH_CHUNKID_OIDFANOUT;
+	chunksizes[nchunks++] = sizeof(uint32_t) * 256;
+	chunkids[nchunks] = GRAPH_CHUNKID_OIDLOOKUP;
+	chunksizes[nchunks++] = (uint64_t)nentries * 20;
+	chunkids[nchunks] = GRAPH_CHUNKID_DATA;
+	chunksizes[nchunks++] = (uint64_t)nentries * GRAPH_DATA_SIZE;
+	chunkids[nchunks] = GRAPH_CHUNKID_GENDATA;
+	chunksizes[nchunks++] = (uint64_t)nentries * 4;
+	if (noverflow) {
+		chunkids[nchunks] = GRAPH_CHUNKID_GENOVERFLOW;
+		chunksizes[nchunks++] = (uint64_t)noverflow * 8;
+	}
+	if (nedges) {
+		chunkids[nchunks] = GRAPH_CHUNKID_EXTRAEDGES;
+		chunksizes[nchunks++] = (uint64_t)nedges * 4;
+	}
+
+	offset = GRAPH_HEADER_SIZE + (nchunks + 1) * GRAPH_CHUNK_ENTRY_SIZE;
+	for (n = 0; n < nchunks; n++) {
+		graph_put_be32(chunks[n], chunkids[n]);
+		graph_put_be64(chunks[n] + 4, offset);
+		offset += chunksizes[n];
+	}
+	graph_put_be32(chunks[nchunks], 0);
+	graph_put_be64(chunks[nchunks] + 4, offset);
+
+	snprintf(path, sizeof(path), "%s/objects/info", dotgitpath);
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "fatal: cannot create '%s'\n", path);
+		exit(128);
+	}
+	strlcat(path, "/commit-graph", sizeof(path));
+	snprintf(lockpath, sizeof(lockpath), "%s.lock", path);
+	fd = open(lockpath, O_WRONLY | O_CREAT | O_EXCL, 0444);
+	if (fd == -1) {
+		fprintf(stderr, "fatal: unable to create '%s'\n", lockpath);
+		exit(128);
+	}
+	SHA1_Init(&ctx);
+
+	graph_put_be32(hdr, GRAPH_SIGNATURE);
+	hdr[4] = GRAPH_VERSION;
+	hdr[5] = GRAPH_HASH_SHA1;
+	hdr[6] = nchunks;
+	hdr[7] = 0;
+	sha_write(fd, hdr, GRAPH_HEADER_SIZE, &ctx);
+	sha_write(fd, chunks, (nchunks + 1) * GRAPH_CHUNK_ENTRY_SIZE, &ctx);
+
+	/* OIDF */
+	x = 0;
+	for (n = 0; n < 256; n++) {
+		while (x < nentries && entries[x].sha[0] == n)
+			x++;
+		graph_put_be32(buf, x);
+		sha_write(fd, buf, 4, &ctx);
+	}
+
+	/* OIDL */
+	for (n = 0; n < nentries; n++)
+		sha_write(fd, entries[n].sha, 20, &ctx);
+
+	/* CDAT */
+	nedges = 0;
+	for (n = 0; n < nentries; n++) {
+		entry = &entries[n];
+		memcpy(buf, entry->tree, 20);
+		graph_put_be32(buf + 20, entry->nparents > 0 ?
+		    entry->parentpos[0] : GRAPH_PARENT_NONE);
+		if (entry->nparents > 2) {
+			graph_put_be32(buf + 24, GRAPH_EXTRA_EDGES | nedges);
+			nedges += entry->nparents - 1;
+		}
+		else
+			graph_put_be32(buf + 24, entry->nparents > 1 ?
+			    entry->parentpos[1] : GRAPH_PARENT_NONE);
+		graph_put_be32(buf + 28, entry->level << 2 |
+		    ((uint64_t)entry->time >> 32 & 0x3));
+		graph_put_be32(buf + 32, entry->time & 0xffffffff);
+		sha_write(fd, buf, GRAPH_DATA_SIZE, &ctx);
+	}
+
+	/* GDA2, offsets too large for 31 bits index GDO2 */
+	noverflow = 0;
+	for (n = 0; n < nentries; n++) {
+		genoffset = entries[n].corrected - entries[n].time;
+		if (genoffset > 0x7fffffff)
+			graph_put_be32(buf, GRAPH_GEN_OVERFLOW | noverflow++);
+		else
+			graph_put_be32(buf, genoffset);
+		sha_write(fd, buf, 4, &ctx);
+	}
+
+	/* GDO2 */
+	for (n = 0; n < nentries; n++) {
+		genoffset = entries[n].corrected - entries[n].time;
+		if (genoffset <= 0x7fffffff)
+			continue;
+		graph_put_be64(buf, genoffset);
+		sha_write(fd, buf, 8, &ctx);
+	}
+
+	/* EDGE */
+	for (n = 0; n < nentries; n++) {
+		entry = &entries[n];
+		if (entry->nparents <= 2)
+			continue;
+		for (p = 1; p < entry->nparents; p++) {
+			graph_put_be32(buf, entry->parentpos[p] |
+			    (p == entry->nparents - 1 ? GRAPH_LAST_EDGE : 0));
+			sha_write(fd, buf, 4, &ctx);
+		}
+	}
+
+	SHA1_Final(digest, &ctx);
+	write(fd, digest, 20);
+	close(fd);
+
+	if (rename(lockpath, path) == -1) {
+		fprintf(stderr, "fatal: unable to rename '%s'\n", lockpath);
+		unlink(lockpath);
+		exit(128);
+	}
+
+	for (n = 0; n < nentries; n++) {
+		free(entries[n].parents);
+		free(entries[n].parentpos);
+	}
+	free(entries);
+
+	return (0);
+}
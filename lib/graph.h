@@ -0,0 +1,79 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "common.h"
+
+/* Header source Documentation/technical/commit-graph-format.txt */
+
+#define GRAPH_SIGNATURE		0x43475048	/* "CGPH" */
+#define GRAPH_VERSION		1
+#define GRAPH_HASH_SHA1		1
+#define GRAPH_HEADER_SIZE	8
+#define GRAPH_CHUNK_ENTRY_SIZE	12
+#define GRAPH_DATA_SIZE		36		/* Tree, 2 parents, date */
+
+#define GRAPH_CHUNKID_OIDFANOUT	0x4f494446	/* "OIDF" */
+#define GRAPH_CHUNKID_OIDLOOKUP	0x4f49444c	/* "OIDL" */
+#define GRAPH_CHUNKID_DATA	0x43444154	/* "CDAT" */
+#define GRAPH_CHUNKID_GENDATA	0x47444132	/* "GDA2" */
+#define GRAPH_CHUNKID_GENOVERFLOW 0x47444f32	/* "GDO2" */
+#define GRAPH_CHUNKID_EXTRAEDGES 0x45444745	/* "EDGE" */
+
+#define GRAPH_PARENT_NONE	0x70000000
+#define GRAPH_EXTRA_EDGES	0x80000000U	/* Parent 2 indexes EDGE */
+#define GRAPH_LAST_EDGE		0x80000000U
+#define GRAPH_GEN_OVERFLOW	0x80000000U	/* Offset indexes GDO2 */
+#define GRAPH_GENERATION_MAX	0x3fffffff
+
+/* A mapped objects/info/commit-graph, the chunk pointers point into map */
+struct commit_graph {
+	unsigned char	*map;
+	off_t		 size;
+	int		 ncommits;
+	uint32_t	*fanout;
+	unsigned char	*oids;
+	unsigned char	*data;
+	unsigned char	*edges;		// NULL without octopus merges
+	int		 nedges;
+};
+
+struct commit_graph *graph_open(void);
+void		 graph_close(struct commit_graph *graph);
+int		 graph_find(struct commit_graph *graph, uint8_t *sha);
+uint8_t		*graph_oid(struct commit_graph *graph, int pos);
+uint8_t		*graph_tree(struct commit_graph *graph, int pos);
+int		 graph_parents(struct commit_graph *graph, int pos, int *parents, int max);
+time_t		 graph_time(struct commit_graph *graph, int pos);
+uint32_t	 graph_generation(struct commit_graph *graph, int pos);
+int		 graph_write(void);
+
+#endif
@@ -27,6 +27,7 @@
 
 #include <netinet/in.h>
 #include <sys/stat.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -268,7 +269,6 @@ index_write(struct indextree *indextree, int indexfd)
 	int padding;
 	uint32_t fourbyte;
 	uint16_t twobyte;
-	uint8_t onebyte;
 
 	SHA1_Init(&indexctx);
 
@@ -312,10 +312,7 @@ index_write(struct indextree *indextree, int indexfd)
 		fourbyte = htonl(dircleaf[i].size);
 		write_sha(&indexctx, indexfd, &fourbyte, 4);
 
-		for(int v=0;v<HASH_SIZE/2;v++){
-			onebyte = (dircleaf[i].sha[v] << 4) | (dircleaf[i].sha[v] >> 4);
-			write_sha(&indexctx, indexfd, &onebyte, 1);
-		}
+		write_sha(&indexctx, indexfd, dircleaf[i].sha, HASH_SIZE/2);
 		twobyte = strlen(dircleaf[i].name);
 		twobyte = htons(twobyte);
 		write_sha(&indexctx, indexfd, &twobyte, 2);
@@ -341,97 +338,97 @@ index_write(struct indextree *indextree, int indexfd)
 	write(indexfd, sha, HASH_SIZE/2);
 }
 
+/* Sets the stat data of an index entry from that of its checked out file */
 void
-index_generate_indextree(char *mode, uint8_t type, char *sha, char *filename, void *arg)
+index_entry_stat(struct dircleaf *dircleaf, struct stat *sb)
 {
-	struct indexpath *indexpath = arg;
-	struct indextree *indextree = indexpath->indextree;
-	char *path = indexpath->path;
-	char *fn = path + strlen(path);
-
-	if (type == OBJ_TREE) {
-		strlcat(path, filename, PATH_MAX);
-		strlcat(path, "/", PATH_MAX);
-		ITERATE_TREE(sha, index_generate_indextree, indexpath);
-	}
-	else {
-		struct dircleaf *curleaf;
-		struct stat sb;
-		int ret;
-		strlcat(path, filename, PATH_MAX);
-		ret = stat(indexpath->fullpath, &sb);
-		if (ret == -1) {
-			fprintf(stderr, "Unable to generate index file, exiting.\n");
-			exit(ret);
-		}
-		indextree->dircleaf = realloc(indextree->dircleaf, sizeof(struct dircleaf) * (indextree->entries+1));
-		curleaf = &indextree->dircleaf[indextree->entries];
-		curleaf->isextended = 0;
-		curleaf->ctime_sec	= sb.st_ctime;
-		curleaf->ctime_nsec 	= sb.st_ctim.tv_nsec;
-		curleaf->mtime_sec	= sb.st_mtime;
-		curleaf->mtime_nsec	= sb.st_mtim.tv_nsec;
-		curleaf->dev		= sb.st_dev;
-		curleaf->ino		= sb.st_ino;
-		curleaf->mode		= sb.st_mode;
-		curleaf->uid		= sb.st_uid;
-		curleaf->gid		= sb.st_gid;
-		curleaf->size		= sb.st_size;
-		/* SHA assigner would go here */
-		curleaf->flags		= 0x0000;
-		curleaf->flags2		= 0x0000;
-
-		sha_str_to_bin(sha, curleaf->sha);
-		strlcpy(curleaf->name, path, PATH_MAX);
-
-		indextree->entries++;
-	}
-	*fn = '\0';
+	dircleaf->ctime_sec	= sb->st_ctime;
+	dircleaf->ctime_nsec 	= sb->st_ctim.tv_nsec;
+	dircleaf->mtime_sec	= sb->st_mtime;
+	dircleaf->mtime_nsec	= sb->st_mtim.tv_nsec;
+	dircleaf->dev		= sb->st_dev;
+	dircleaf->ino		= sb->st_ino;
+	dircleaf->uid		= sb->st_uid;
+	dircleaf->gid		= sb->st_gid;
+	dircleaf->size		= sb->st_size;
 }
 
 /*
- * This function recursively iterates through a TREE to produce the data
- * necessary to write the index.
- * ToFree after function: treeleaf->subtree
+ * Adds the file indexpath->path, which is checked out from the tree entry,
+ * to the index and counts it in the TREE extension of the tree it is in.
+ * The stat data is taken from sb, or if sb is NULL it is left zeroed to be
+ * set by index_entry_stat once the file is written.
  */
 void
-index_generate_treedata(char *mode, uint8_t type, char *sha, char *filename, void *arg)
+index_add_entry(struct indexpath *indexpath, struct tree_entry *entry,
+    struct stat *sb)
 {
-	struct indexpath *indexpath = arg;
 	struct indextree *indextree = indexpath->indextree;
 	struct treeleaf *treeleaf = indextree->treeleaf;
-	struct subtree *next_tree;
+	struct dircleaf *curleaf;
+
+	indextree->dircleaf = realloc(indextree->dircleaf,
+	    sizeof(struct dircleaf) * (indextree->entries+1));
+	curleaf = &indextree->dircleaf[indextree->entries];
+	bzero(curleaf, offsetof(struct dircleaf, name));
+	if (sb != NULL)
+		index_entry_stat(curleaf, sb);
+	curleaf->mode = entry->mode;
+	memcpy(curleaf->sha, entry->sha, 20);
+	strlcpy(curleaf->name, indexpath->path, PATH_MAX);
+
+	indextree->entries++;
+
+	treeleaf->entry_count++;
+	if (indexpath->current_position > 0)
+		treeleaf->subtree[indexpath->current_position-1].entries++;
+}
 
-	if (type == OBJ_TREE) {
-		int local_position, next_position;
+/*
+ * Adds the sub-tree of a tree entry to the TREE extension, the entries
+ * added until index_leave_tree are counted in it. Returns the position of
+ * the enclosing tree, for index_leave_tree.
+ */
+int
+index_enter_tree(struct indexpath *indexpath, struct tree_entry *entry)
+{
+	struct treeleaf *treeleaf = indexpath->indextree->treeleaf;
+	struct subtree *next_tree;
+	int local_position;
+
+	local_position = indexpath->current_position;
+	treeleaf->total_tree_count++;
+	treeleaf->subtree = realloc(treeleaf->subtree,
+	    sizeof(struct subtree)*(treeleaf->total_tree_count));
+	next_tree=&treeleaf->subtree[treeleaf->total_tree_count-1];
+	next_tree->entries=0;
+	next_tree->sub_count=0;
+	memcpy(next_tree->sha, entry->sha, 20);
+	strlcpy(next_tree->path, entry->name, PATH_MAX);
+
+	if (local_position > 0)
+		treeleaf->subtree[local_position-1].sub_count++;
+	else
+		treeleaf->local_tree_count++;
+	indexpath->current_position = treeleaf->total_tree_count;
 
-		local_position = indexpath->current_position;
-		treeleaf->total_tree_count++;
-		treeleaf->subtree = realloc(treeleaf->subtree,
-		    sizeof(struct subtree)*(treeleaf->total_tree_count));
-		next_tree=&treeleaf->subtree[treeleaf->total_tree_count-1];
-		next_tree->entries=0;
-		next_tree->sub_count=0;
-		sha_str_to_bin_network(sha, next_tree->sha);
-		strlcpy(next_tree->path, filename, PATH_MAX);
+	return (local_position);
+}
 
-		indexpath->current_position = next_position = treeleaf->total_tree_count;
-		treeleaf->subtree[local_position-1].sub_count++;
-		ITERATE_TREE(sha, index_generate_treedata, indexpath);
-		indexpath->current_position = local_position;
+/*
+ * Ends the sub-tree started by index_enter_tree, whose entries are added
+ * to those of the enclosing tree at local_position.
+ */
+void
+index_leave_tree(struct indexpath *indexpath, int local_position)
+{
+	struct treeleaf *treeleaf = indexpath->indextree->treeleaf;
+	int next_position = indexpath->current_position;
 
-		if (local_position > 0)
-			treeleaf->subtree[local_position-1].entries += treeleaf->subtree[next_position-1].entries;
-		else
-			treeleaf->local_tree_count++;
-	}
-	else {
-		treeleaf->entry_count++;
-		if (indexpath->current_position > 0) {
-			next_tree = &treeleaf->subtree[indexpath->current_position-1];
-			next_tree->entries++;
-		}
-	}
+	indexpath->current_position = local_position;
+	if (local_position > 0)
+		treeleaf->subtree[local_position-1].entries +=
+		    treeleaf->subtree[next_position-1].entries;
 }
 
 /*
@@ -441,7 +438,7 @@ index_generate_treedata(char *mode, uint8_t type, char *sha, char *filename, voi
  *    - The initial NULL char (1 byte)
  *    - The length of the entry_count in ASCII (variable size)
  *    - The space character (1 byte)
- *    - The length of the total_tree_count in ASCII (variable size)
+ *    - The length of the local_tree_count in ASCII (variable size)
  *    - The newline char (1 byte)
  *    - The SHA in bin format (20 bytes)
  * 2. The subtree sections:
@@ -457,7 +454,7 @@ index_generate_treedata(char *mode, uint8_t type, char *sha, char *filename, voi
 void
 index_calculate_tree_ext_size(struct treeleaf *treeleaf)
 {
-	treeleaf->ext_size += count_digits(treeleaf->entry_count) + count_digits(treeleaf->total_tree_count);
+	treeleaf->ext_size += count_digits(treeleaf->entry_count) + count_digits(treeleaf->local_tree_count);
 	treeleaf->ext_size += EXT_SIZE_FIXED;
 
 	for(int r=0;r<treeleaf->total_tree_count;r++) {
@@ -28,6 +28,7 @@
 #ifndef INDEX_H
 #define INDEX_H
 
+#include <sys/stat.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -140,8 +141,11 @@ struct indexpath {
 
 void		index_parse(struct indextree *indextree, unsigned char *indexmap, off_t indexsize);
 void		index_write(struct indextree *indextree, int indexfd);
-void		index_generate_indextree(char *mode, uint8_t type, char *sha, char *filename, void *arg);
-void		index_generate_treedata(char *mode, uint8_t type, char *sha, char *filename, void *arg);
+void		index_entry_stat(struct dircleaf *dircleaf, struct stat *sb);
+void		index_add_entry(struct indexpath *indexpath, struct tree_entry *entry,
+		    struct stat *sb);
+int		index_enter_tree(struct indexpath *indexpath, struct tree_entry *entry);
+void		index_leave_tree(struct indexpath *indexpath, int local_position);
 void		index_calculate_tree_ext_size(struct treeleaf *treeleaf);
 
 #endif
@@ -29,6 +29,7 @@
 #include <regex.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <fcntl.h>
@@ -43,29 +44,56 @@ static regex_t re_variable;
 
 struct section *sections = NULL;
 
-int
-config_parser()
+/*
+ * Parses a git config size value, an integer with an optional
+ * k, m or g suffix. Returns -1 if the value is not a number.
+ */
+static long
+ini_parse_size(const char *value)
+{
+	char *endptr;
+	long size;
+
+	size = strtol(value, &endptr, 10);
+	if (endptr == value)
+		return (-1);
+
+	switch (*endptr) {
+	case 'k': case 'K':
+		size *= 1024;
+		break;
+	case 'm': case 'M':
+		size *= 1024 * 1024;
+		break;
+	case 'g': case 'G':
+		size *= 1024 * 1024 * 1024;
+		break;
+	}
+
+	return (size);
+}
+
+/*
+ * Adds the sections of the config file fp to sections. The variables of
+ * sections it does not know are skipped.
+ */
+static void
+ini_parse_file(FILE *fp)
 {
-	FILE* fp;
 	char line[1000];
 	regmatch_t pmatch[10];
 	struct section *current_section = sections;
 	struct section *new_section;
-	char ini_file[PATH_MAX];
+	bool skip = false;
 	int sz;
 
 	char tmp[1000];
 	char tmpvar[1000];
 	char *tmpval;
 
-	ini_init_regex();
-
-	snprintf(ini_file, PATH_MAX, "%s/config", dotgitpath);
-	fp = fopen(ini_file, "r");
-	if (!fp) {
-		printf("Unable to open file: %s\n", ini_file);
-		return (-1);
-	}
+	/* Append to the sections of an earlier file */
+	while (current_section && current_section->next)
+		current_section = current_section->next;
 
 	while (fgets(line, sizeof(line), fp) != NULL) {
 		line[strlen(line)-1] = '\0'; // chomp()
@@ -74,11 +102,16 @@ config_parser()
 		    regexec(&re_remote_header, line, 4, pmatch, 0) != REG_NOMATCH) {
 			new_section = calloc(1, sizeof(struct section));
 			new_section->logallrefupdates = 0xFF;
+			new_section->workers = 1;
+			skip = false;
 
-			strlcpy(tmp, line + pmatch[1].rm_so, pmatch[1].rm_eo - pmatch[1].rm_so);
+			strlcpy(tmp, line + pmatch[1].rm_so, pmatch[1].rm_eo - pmatch[1].rm_so + 1);
 			if (strncmp(tmp, "core", 4) == 0) {
 				new_section->type = CORE;
 			}
+			else if (strncmp(tmp, "checkout", 8) == 0) {
+				new_section->type = CHECKOUT;
+			}
 			else if (strncmp(tmp, "remote", 6) == 0) {
 				new_section->type = REMOTE;
 				sz = pmatch[2].rm_eo - pmatch[2].rm_so;
@@ -97,8 +130,13 @@ config_parser()
 
 			continue;
 		}
+		else if (line[strspn(line, " \t")] == '[') {
+			skip = true;
+			continue;
+		}
 		/* Capture variables */
-		else if (regexec(&re_variable, line, 3, pmatch, 0) != REG_NOMATCH) {
+		else if (!skip &&
+		    regexec(&re_variable, line, 3, pmatch, 0) != REG_NOMATCH) {
 
 			if (current_section == NULL) {
 				fprintf(stderr,
@@ -109,12 +147,12 @@ config_parser()
 		
 			strlcpy(tmpvar,
 			    line + pmatch[1].rm_so,
-			    pmatch[1].rm_eo - pmatch[1].rm_so);
+			    pmatch[1].rm_eo - pmatch[1].rm_so + 1);
 
 			tmpval = malloc(pmatch[2].rm_eo - pmatch[2].rm_so + 1);
 			strlcpy(tmpval,
 			    line + pmatch[2].rm_so,
-			    pmatch[2].rm_eo - pmatch[2].rm_so);
+			    pmatch[2].rm_eo - pmatch[2].rm_so + 1);
 
 			tmpval[pmatch[2].rm_eo - pmatch[2].rm_so] = '\0';
 
@@ -134,7 +172,7 @@ config_parser()
 				if (!strncmp(tmpval, "true", 4))
 					current_section->bare = TRUE;
 				else if (!strncmp(tmpval, "false", 5))
-					current_section->bare = TRUE;
+					current_section->bare = FALSE;
 				free(tmpval);
 			}
 			else if (!strncmp("logallrefupdates", tmpvar, 16)) {
@@ -144,6 +182,24 @@ config_parser()
 					current_section->logallrefupdates = FALSE;
 				free(tmpval);
 			}
+			else if (!strncasecmp(tmpvar, "deltaBaseCacheLimit", 20)) {
+				current_section->deltabasecachelimit = ini_parse_size(tmpval);
+				free(tmpval);
+			}
+			else if (!strncasecmp(tmpvar, "packedGitWindowSize", 20)) {
+				current_section->packedgitwindowsize = ini_parse_size(tmpval);
+				free(tmpval);
+			}
+			else if (!strncasecmp(tmpvar, "packedGitLimit", 15)) {
+				current_section->packedgitlimit = ini_parse_size(tmpval);
+				free(tmpval);
+			}
+			/* Matches for Checkout */
+			else if (current_section->type == CHECKOUT &&
+			    !strncasecmp(tmpvar, "workers", 8)) {
+				current_section->workers = ini_parse_size(tmpval);
+				free(tmpval);
+			}
 			/* Matches for Remote */
 			else if (strncmp("url", tmpvar, 3) == 0)
 				current_section->url = tmpval;
@@ -154,6 +210,51 @@ config_parser()
 			continue;
 		}
 	}
+}
+
+int
+config_parser()
+{
+	FILE* fp;
+	char ini_file[PATH_MAX];
+
+	ini_init_regex();
+
+	snprintf(ini_file, PATH_MAX, "%s/config", dotgitpath);
+	fp = fopen(ini_file, "r");
+	if (!fp) {
+		printf("Unable to open file: %s\n", ini_file);
+		return (-1);
+	}
+	ini_parse_file(fp);
+	fclose(fp);
+
+	return (0);
+}
+
+/*
+ * Reads the user's ~/.gitconfig, for commands such as clone that run
+ * before there is a repository config. Returns -1 if there is none.
+ */
+int
+config_parser_global()
+{
+	FILE* fp;
+	char ini_file[PATH_MAX];
+	char *home;
+
+	home = getenv("HOME");
+	if (home == NULL)
+		return (-1);
+
+	ini_init_regex();
+
+	snprintf(ini_file, PATH_MAX, "%s/.gitconfig", home);
+	fp = fopen(ini_file, "r");
+	if (!fp)
+		return (-1);
+	ini_parse_file(fp);
+	fclose(fp);
 
 	return (0);
 }
@@ -200,7 +301,7 @@ ini_write_config(int fd, struct section *sections)
 void
 ini_init_regex()
 {
-	regcomp(&re_core_header, "^\\[(core)\\]", REG_EXTENDED);
+	regcomp(&re_core_header, "^\\[(core|checkout)\\]", REG_EXTENDED);
 	regcomp(&re_remote_header, "^\\[(remote) \"([a-zA-Z0-9_]+)\"\\]", REG_EXTENDED);
 	regcomp(&re_variable, "([A-Za-z0-9_]+)[\\s ]*=[\\s ]*([A-Za-z0-9_$&+,:;=?@#|'<>.^*()%!-/]+)", REG_EXTENDED);
 }
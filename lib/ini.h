@@ -32,6 +32,7 @@ enum section_types {
 	CORE = 1,
 	REMOTE = 2,
 	BRANCH = 3,
+	CHECKOUT = 4,
 	OTHER = 99
 };
 
@@ -50,6 +51,9 @@ struct section {
 	enum boolean		filemode;
 	enum boolean		bare;
 	enum boolean		logallrefupdates;
+	long			deltabasecachelimit;
+	long			packedgitwindowsize;
+	long			packedgitlimit;
 
 	/* Used by remote */
 	char *			repo_name;
@@ -60,6 +64,9 @@ struct section {
 	char *			remote;
 	char *			merge;
 
+	/* Used by checkout */
+	int			workers;
+
 	/* Other */
 	char *			other_header_name;
 	char *			other_variable;
@@ -71,6 +78,7 @@ struct section {
 extern struct section		*sections;
 
 int	config_parser();
+int	config_parser_global();
 void	ini_init_regex();
 void	ini_write_config(int fd, struct section *sections);
 
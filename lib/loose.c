@@ -26,6 +26,9 @@
  */
 
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -33,25 +36,41 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "zlib-handler.h"
 #include "common.h"
 #include "loose.h"
 #include "pack.h"
 
+/*
+ * Opens the file of a loose object, the hex form of the SHA that names it
+ * is left in shastr. Returns -1 if there is no such loose object.
+ */
+int
+loose_open(uint8_t *sha, char *shastr)
+{
+	char objectpath[PATH_MAX];
+
+	sha_bin_to_str(sha, shastr);
+	shastr[HASH_SIZE] = '\0';
+	snprintf(objectpath, sizeof(objectpath), "%s/objects/%.2s/%s",
+	    dotgitpath, shastr, shastr + 2);
+	return (open(objectpath, O_RDONLY));
+}
+
 /*
  * Provides a generic way to parse loose content
  * This is used to parse data in multiple ways.
  * Similar to pack_content_handler
  */
 int
-loose_content_handler(char *sha, inflated_handler inflated_handler, void *iarg)
+loose_content_handler(uint8_t *sha, inflated_handler inflated_handler, void *iarg)
 {
-	char objectpath[PATH_MAX];
+	char shastr[HASH_SIZE+1];
 	int objectfd;
 
-	snprintf(objectpath, sizeof(objectpath), "%s/objects/%c%c/%s", dotgitpath, sha[0], sha[1], sha+2);
-	objectfd = open(objectpath, O_RDONLY);
+	objectfd = loose_open(sha, shastr);
 	if (objectfd == -1)
 		return (1);
 
@@ -86,9 +105,10 @@ loose_get_headers(unsigned char *buf, int size, void *arg)
 		loosearg->size = strtol((char *)buf + 5, (char **)&endptr, 10);
 		hdr_offset = 1 + (endptr - buf);
 	}
-	else if (!memcmp(buf, "tag", 3)) {
+	else if (!memcmp(buf, "tag ", 4)) {
 		loosearg->type = OBJ_TAG;
-		hdr_offset = 3;
+		loosearg->size = strtol((char *)buf + 4, (char **)&endptr, 10);
+		hdr_offset = 1 + (endptr - buf);
 	}
 	else if (!memcmp(buf, "obj_ofs_delta", 13)) {
 		loosearg->type = OBJ_REF_DELTA;
@@ -105,19 +125,150 @@ loose_get_headers(unsigned char *buf, int size, void *arg)
 }
 
 
+/*
+ * Reads the type and size of a loose object by inflating only as much as
+ * its "<type> <size>\0" header needs. Returns 1 if there is no such loose
+ * object, like loose_content_handler.
+ */
+int
+loose_object_info(uint8_t *sha, int *type, unsigned long *size)
+{
+	char shastr[HASH_SIZE+1];
+	struct loosearg loosearg;
+	unsigned char in[512];
+	unsigned char out[64];
+	z_stream strm;
+	ssize_t r;
+	int objectfd, ret;
 
+	objectfd = loose_open(sha, shastr);
+	if (objectfd == -1)
+		return (1);
+
+	bzero(&strm, sizeof(z_stream));
+	if (inflateInit(&strm) != Z_OK) {
+		close(objectfd);
+		return (1);
+	}
+	strm.next_out = out;
+	strm.avail_out = sizeof(out) - 1;
+	do {
+		r = read(objectfd, in, sizeof(in));
+		if (r <= 0)
+			break;
+		strm.next_in = in;
+		strm.avail_in = r;
+		ret = inflate(&strm, Z_SYNC_FLUSH);
+	} while (ret == Z_OK && strm.avail_out > 0 &&
+	    memchr(out, '\0', strm.next_out - out) == NULL);
+	(void)inflateEnd(&strm);
+	close(objectfd);
+
+	*strm.next_out = '\0';
+	if (memchr(out, '\0', strm.next_out - out) == NULL) {
+		fprintf(stderr, "fatal: bad object header for %s\n", shastr);
+		exit(128);
+	}
+
+	loose_get_headers(out, strm.next_out - out, &loosearg);
+	if (loosearg.type == OBJ_UNKNOWN) {
+		fprintf(stderr, "fatal: bad object header for %s\n", shastr);
+		exit(128);
+	}
+	*type = loosearg.type;
+	*size = loosearg.size;
+
+	return (0);
+}
 
 /*
- * Description: Just gets the type of a loose object
- * Handler for loose_content_handler
+ * Reads a whole loose object into object without its "<type> <size>\0"
+ * header, its type goes in *type. Once the header is inflated, the rest is
+ * inflated by a single call into a buffer allocated at the size the header
+ * gives, rather than grown CHUNK by CHUNK as by loose_content_handler and
+ * buffer_cb. The data is NUL terminated. Returns 1 if there is no such
+ * loose object, exits if it is corrupt.
  */
-unsigned char *
-get_type_loose_cb(unsigned char *buf, int size, int __unused deflated_bytes, void *arg)
+int
+loose_read(uint8_t *sha, int *type, struct decompressed_object *object)
 {
-	uint8_t *type = arg;
+	char shastr[HASH_SIZE+1];
 	struct loosearg loosearg;
+	struct stat sb;
+	unsigned char hdr[64];
+	unsigned char *in, *nul;
+	unsigned long n, outleft;
+	z_stream strm;
+	int objectfd, ret;
+
+	objectfd = loose_open(sha, shastr);
+	if (objectfd == -1)
+		return (1);
+	if (fstat(objectfd, &sb) == -1 || sb.st_size == 0) {
+		fprintf(stderr, "fatal: bad object header for %s\n", shastr);
+		exit(128);
+	}
+	in = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, objectfd, 0);
+	close(objectfd);
+	if (in == MAP_FAILED) {
+		fprintf(stderr, "mmap(2) error, exiting.\n");
+		exit(128);
+	}
 
-	loose_get_headers(buf, size, &loosearg);
+	bzero(&strm, sizeof(z_stream));
+	if (inflateInit(&strm) != Z_OK) {
+		fprintf(stderr, "fatal: inflateInit failed\n");
+		exit(128);
+	}
+	strm.next_in = in;
+	strm.avail_in = sb.st_size;
+	strm.next_out = hdr;
+	strm.avail_out = sizeof(hdr);
+	ret = inflate(&strm, Z_SYNC_FLUSH);
+	nul = memchr(hdr, '\0', strm.next_out - hdr);
+	if ((ret != Z_OK && ret != Z_STREAM_END) || nul == NULL) {
+		fprintf(stderr, "fatal: bad object header for %s\n", shastr);
+		exit(128);
+	}
+	loose_get_headers(hdr, nul - hdr, &loosearg);
+	if (loosearg.type < OBJ_COMMIT || loosearg.type > OBJ_TAG ||
+	    loosearg.size < 0) {
+		fprintf(stderr, "fatal: bad object header for %s\n", shastr);
+		exit(128);
+	}
+
+	/* Whatever came after the header starts the buffer */
+	n = strm.next_out - (nul + 1);
+	object->data = malloc(loosearg.size + 1);
+	if (object->data == NULL || n > loosearg.size) {
+		fprintf(stderr, "fatal: loose object %s is corrupt\n", shastr);
+		exit(128);
+	}
+	memcpy(object->data, nul + 1, n);
+
+	/* One byte more than needed catches an object that inflates to more */
+	strm.next_out = object->data + n;
+	strm.avail_out = 0;
+	outleft = loosearg.size + 1 - n;
+	while (ret == Z_OK || (ret == Z_BUF_ERROR && outleft > 0)) {
+		strm.avail_out = (outleft > UINT_MAX) ? UINT_MAX : outleft;
+		outleft -= strm.avail_out;
+		ret = inflate(&strm, Z_FINISH);
+		if (strm.avail_out != 0)
+			break;
+	}
+	(void)inflateEnd(&strm);
+	munmap(in, sb.st_size);
+
+	if (ret != Z_STREAM_END ||
+	    strm.total_out != (nul + 1 - hdr) + loosearg.size) {
+		fprintf(stderr, "fatal: loose object %s is corrupt\n", shastr);
+		exit(128);
+	}
+	object->data[loosearg.size] = '\0';
+	object->size = loosearg.size;
+	object->deflated_size = sb.st_size;
 	*type = loosearg.type;
-	return (buf);
+
+	return (0);
 }
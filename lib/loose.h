@@ -40,12 +40,13 @@ struct loosearg {
 	int	 type;
 	long	 size;
 
-	char 	*sha;
 	struct decompressed_object decompressed_object;
 };
 
+int		 loose_open(uint8_t *sha, char *shastr);
 int		 loose_get_headers(unsigned char *buf, int size, void *arg);
-int 		 loose_content_handler(char *sha, inflated_handler inflated_handler, void *iarg);
-unsigned char	*get_type_loose_cb(unsigned char *buf, int size, int __unused deflated_bytes, void *arg);
+int 		 loose_content_handler(uint8_t *sha, inflated_handler inflated_handler, void *iarg);
+int		 loose_object_info(uint8_t *sha, int *type, unsigned long *size);
+int		 loose_read(uint8_t *sha, int *type, struct decompressed_object *object);
 
 #endif
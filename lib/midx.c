@@ -0,0 +1,672 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "common.h"
+#include "pack.h"
+#include "midx.h"
+
+/*
+ * The multi-pack-index maps every object of every pack in objects/pack to
+ * its pack and offset in a single sorted table, so a lookup is one binary
+ * search rather than one per pack.
+ */
+
+static uint32_t
+midx_get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+static uint64_t
+midx_get_be64(const unsigned char *p)
+{
+	return ((uint64_t)midx_get_be32(p) << 32 | midx_get_be32(p + 4));
+}
+
+static void
+midx_put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+midx_put_be64(unsigned char *p, uint64_t v)
+{
+	midx_put_be32(p, v >> 32);
+	midx_put_be32(p + 4, v & 0xffffffff);
+}
+
+/* Maps a file read-only, returns NULL if it cannot be opened */
+static unsigned char *
+midx_map_file(const char *path, off_t *size)
+{
+	unsigned char *map;
+	struct stat sb;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (NULL);
+	if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+		close(fd);
+		return (NULL);
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (NULL);
+
+	*size = sb.st_size;
+	return (map);
+}
+
+void
+midx_close(struct midx *midx)
+{
+	if (midx == NULL)
+		return;
+	munmap(midx->map, midx->size);
+	free(midx->packnames);
+	free(midx);
+}
+
+/*
+ * Maps and parses objects/pack/multi-pack-index. Returns NULL if there is
+ * none, or if it is not usable, in which case a warning is printed.
+ */
+struct midx *
+midx_open(const char *packdir)
+{
+	char path[PATH_MAX];
+	struct midx *midx;
+	struct midx_header *hdr;
+	unsigned char *chunk, *pnam, *pnamend;
+	uint64_t offset, next;
+	uint32_t id;
+	off_t size;
+	int n;
+
+	snprintf(path, sizeof(path), "%s/multi-pack-index", packdir);
+	midx = calloc(1, sizeof(struct midx));
+	midx->map = midx_map_file(path, &size);
+	if (midx->map == NULL) {
+		free(midx);
+		return (NULL);
+	}
+	midx->size = size;
+
+	hdr = (struct midx_header *)midx->map;
+	if (size < MIDX_HEADER_SIZE + MIDX_CHUNK_ENTRY_SIZE + 20 ||
+	    ntohl(hdr->signature) != MIDX_SIGNATURE ||
+	    hdr->version != MIDX_VERSION ||
+	    hdr->hashversion != MIDX_HASH_SHA1 || hdr->nbase != 0 ||
+	    size < MIDX_HEADER_SIZE +
+	    (hdr->nchunks + 1) * MIDX_CHUNK_ENTRY_SIZE + 20)
+		goto bad;
+	midx->npacks = ntohl(hdr->npacks);
+
+	pnam = pnamend = NULL;
+	for (n = 0; n < hdr->nchunks; n++) {
+		chunk = midx->map + MIDX_HEADER_SIZE + n * MIDX_CHUNK_ENTRY_SIZE;
+		id = midx_get_be32(chunk);
+		offset = midx_get_be64(chunk + 4);
+		next = midx_get_be64(chunk + MIDX_CHUNK_ENTRY_SIZE + 4);
+		if (offset > next || next > size - 20)
+			goto bad;
+
+		switch (id) {
+		case MIDX_CHUNKID_PACKNAMES:
+			pnam = midx->map + offset;
+			pnamend = midx->map + next;
+			break;
+		case MIDX_CHUNKID_OIDFANOUT:
+			if (next - offset != sizeof(uint32_t) * 256)
+				goto bad;
+			midx->fanout = (uint32_t *)(midx->map + offset);
+			break;
+		case MIDX_CHUNKID_OIDLOOKUP:
+			midx->oids = midx->map + offset;
+			break;
+		case MIDX_CHUNKID_OBJECTOFFSETS:
+			midx->offsets = midx->map + offset;
+			break;
+		case MIDX_CHUNKID_LARGEOFFSETS:
+			midx->largeoffsets = midx->map + offset;
+			midx->nlarge = (next - offset) / 8;
+			break;
+		}
+	}
+
+	if (pnam == NULL || midx->fanout == NULL || midx->oids == NULL ||
+	    midx->offsets == NULL)
+		goto bad;
+	midx->nobjects = ntohl(midx->fanout[255]);
+	if (midx->oids + midx->nobjects * 20 > midx->map + size - 20 ||
+	    midx->offsets + midx->nobjects * 8 > midx->map + size - 20)
+		goto bad;
+
+	midx->packnames = malloc(sizeof(char *) * midx->npacks);
+	for (n = 0; n < midx->npacks; n++) {
+		if (pnam >= pnamend)
+			goto bad;
+		midx->packnames[n] = (char *)pnam;
+		pnam = memchr(pnam, '\0', pnamend - pnam);
+		if (pnam == NULL)
+			goto bad;
+		pnam++;
+	}
+
+	return (midx);
+
+bad:
+	fprintf(stderr, "warning: ignoring invalid %s\n", path);
+	midx_close(midx);
+	return (NULL);
+}
+
+/* Sets the pack and offset of the object at position n */
+void
+midx_nth_object(struct midx *midx, int n, uint32_t *packid, off_t *offset)
+{
+	unsigned char *entry;
+	uint32_t offset32;
+
+	entry = midx->offsets + n * 8;
+	*packid = midx_get_be32(entry);
+	offset32 = midx_get_be32(entry + 4);
+
+	if (midx->largeoffsets && (offset32 & MIDX_LARGE_OFFSET)) {
+		offset32 &= ~MIDX_LARGE_OFFSET;
+		if (offset32 >= midx->nlarge) {
+			fprintf(stderr, "fatal: multi-pack-index large offset "
+			    "out of bounds\n");
+			exit(128);
+		}
+		*offset = midx_get_be64(midx->largeoffsets + offset32 * 8);
+	}
+	else
+		*offset = offset32;
+}
+
+/*
+ * Looks up a binary SHA, narrowed by the fan table then binary searched.
+ * Returns 0 and sets packid and offset if found, otherwise -1.
+ */
+int
+midx_find_sha(struct midx *midx, unsigned char *sha, uint32_t *packid,
+    off_t *offset)
+{
+	int lo, hi, mid;
+	int cmp;
+
+	lo = (sha[0] == 0) ? 0 : ntohl(midx->fanout[sha[0] - 1]);
+	hi = ntohl(midx->fanout[sha[0]]);
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = memcmp(midx->oids + mid * 20, sha, 20);
+		if (cmp == 0) {
+			midx_nth_object(midx, mid, packid, offset);
+			return (0);
+		}
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (-1);
+}
+
+struct midx_pack {
+	char		 name[NAME_MAX+1];	// The .idx name
+	unsigned char	*idxmap;
+	off_t		 idxsize;
+	time_t		 mtime;
+};
+
+struct midx_entry {
+	unsigned char	*sha;		// Points into the idx
+	uint32_t	 packid;
+	off_t		 offset;
+	time_t		 mtime;
+};
+
+static int
+midx_pack_cmp(const void *a, const void *b)
+{
+	const struct midx_pack *x = a;
+	const struct midx_pack *y = b;
+	return (strcmp(x->name, y->name));
+}
+
+/*
+ * Objects in several packs are kept once, from the most recently modified
+ * pack and then the first by name, as GPL git does.
+ */
+static int
+midx_entry_cmp(const void *a, const void *b)
+{
+	const struct midx_entry *x = a;
+	const struct midx_entry *y = b;
+	int cmp;
+
+	cmp = memcmp(x->sha, y->sha, 20);
+	if (cmp)
+		return (cmp);
+	if (x->mtime != y->mtime)
+		return (x->mtime > y->mtime ? -1 : 1);
+	return (x->packid < y->packid ? -1 : x->packid > y->packid);
+}
+
+/*
+ * Maps the idx of every pack in packdir, sorted by name. Returns the
+ * number of packs, or -1 if the directory cannot be read.
+ */
+static int
+midx_load_packs(const char *packdir, struct midx_pack **packsp)
+{
+	DIR *d;
+	struct dirent *dir;
+	struct midx_pack *packs;
+	struct stat sb;
+	char path[PATH_MAX];
+	char *file_ext;
+	int npacks, maxpacks;
+
+	d = opendir(packdir);
+	if (d == NULL)
+		return (-1);
+
+	packs = NULL;
+	npacks = maxpacks = 0;
+	while ((dir = readdir(d)) != NULL) {
+		file_ext = strrchr(dir->d_name, '.');
+		if (!file_ext || strncmp(file_ext, ".idx", 5))
+			continue;
+
+		/* Only index packs whose .pack is present */
+		snprintf(path, sizeof(path), "%s/%.*s.pack", packdir,
+		    (int)(file_ext - dir->d_name), dir->d_name);
+		if (stat(path, &sb) == -1)
+			continue;
+
+		if (npacks == maxpacks) {
+			maxpacks = maxpacks ? maxpacks * 2 : 16;
+			packs = realloc(packs, sizeof(struct midx_pack) * maxpacks);
+		}
+		strlcpy(packs[npacks].name, dir->d_name, NAME_MAX+1);
+		packs[npacks].mtime = sb.st_mtime;
+
+		snprintf(path, sizeof(path), "%s/%s", packdir, dir->d_name);
+		packs[npacks].idxmap = midx_map_file(path,
+		    &packs[npacks].idxsize);
+		if (packs[npacks].idxmap == NULL ||
+		    pack_idx_check(packs[npacks].idxmap,
+		    packs[npacks].idxsize)) {
+			fprintf(stderr, "warning: ignoring %s\n", path);
+			if (packs[npacks].idxmap)
+				munmap(packs[npacks].idxmap,
+				    packs[npacks].idxsize);
+			continue;
+		}
+		npacks++;
+	}
+	closedir(d);
+
+	qsort(packs, npacks, sizeof(struct midx_pack), midx_pack_cmp);
+	*packsp = packs;
+
+	return (npacks);
+}
+
+static void
+midx_unload_packs(struct midx_pack *packs, int npacks)
+{
+	int n;
+
+	for (n = 0; n < npacks; n++)
+		munmap(packs[n].idxmap, packs[n].idxsize);
+	free(packs);
+}
+
+/*
+ * Writes objects/pack/multi-pack-index covering every pack in packdir.
+ * The file is written under a lock name and renamed into place.
+ * Returns 0 on success.
+ */
+int
+midx_write(const char *packdir)
+{
+	struct midx_pack *packs;
+	struct midx_entry *entries;
+	struct midx_header hdr;
+	struct fan *fans;
+	unsigned char chunks[6][MIDX_CHUNK_ENTRY_SIZE];
+	unsigned char buf[8];
+	unsigned char pad[MIDX_CHUNK_ALIGNMENT] = { 0 };
+	unsigned char digest[20];
+	char path[PATH_MAX], lockpath[PATH_MAX];
+	uint64_t pnamsize, offset;
+	uint32_t fanout, nlarge;
+	bool large_needed;
+	int npacks, nentries, nobjects, nchunks;
+	int fd, n, x, i;
+	SHA1_CTX ctx;
+
+	npacks = midx_load_packs(packdir, &packs);
+	if (npacks <= 0) {
+		fprintf(stderr, "error: no pack files to index.\n");
+		return (1);
+	}
+
+	/* Gather every object of every pack */
+	nentries = 0;
+	for (n = 0; n < npacks; n++) {
+		fans = (struct fan *)(packs[n].idxmap + 8);
+		nentries += ntohl(fans->count[255]);
+	}
+	entries = malloc(sizeof(struct midx_entry) * nentries);
+	x = 0;
+	for (n = 0; n < npacks; n++) {
+		fans = (struct fan *)(packs[n].idxmap + 8);
+		for (i = 0; i < ntohl(fans->count[255]); i++, x++) {
+			entries[x].sha = packs[n].idxmap + 8 +
+			    sizeof(struct fan) + i * sizeof(struct entry);
+			entries[x].packid = n;
+			entries[x].offset = pack_position_offset(
+			    packs[n].idxmap, i);
+			entries[x].mtime = packs[n].mtime;
+		}
+	}
+	qsort(entries, nentries, sizeof(struct midx_entry), midx_entry_cmp);
+
+	/* Drop the duplicates, the preferred copy sorts first */
+	nobjects = 0;
+	for (x = 0; x < nentries; x++)
+		if (nobjects == 0 ||
+		    memcmp(entries[x].sha, entries[nobjects-1].sha, 20))
+			entries[nobjects++] = entries[x];
+
+	/*
+	 * Offsets that do not fit in 32 bits go in the LOFF chunk, along
+	 * with every offset past 2 GiB once that chunk exists.
+	 */
+	nlarge = 0;
+	large_needed = false;
+	for (x = 0; x < nobjects; x++) {
+		if (entries[x].offset > 0x7fffffff)
+			nlarge++;
+		if (entries[x].offset > 0xffffffff)
+			large_needed = true;
+	}
+
+	pnamsize = 0;
+	for (n = 0; n < npacks; n++)
+		pnamsize += strlen(packs[n].name) + 1;
+
+	/* The chunk lookup table, with a terminating entry */
+	nchunks = large_needed ? 5 : 4;
+	offset = MIDX_HEADER_SIZE + (nchunks + 1) * MIDX_CHUNK_ENTRY_SIZE;
+	midx_put_be32(chunks[0], MIDX_CHUNKID_PACKNAMES);
+	midx_put_be64(chunks[0] + 4, offset);
+	offset += (pnamsize + MIDX_CHUNK_ALIGNMENT - 1) &
+	    ~(MIDX_CHUNK_ALIGNMENT - 1);
+	midx_put_be32(chunks[1], MIDX_CHUNKID_OIDFANOUT);
+	midx_put_be64(chunks[1] + 4, offset);
+	offset += sizeof(uint32_t) * 256;
+	midx_put_be32(chunks[2], MIDX_CHUNKID_OIDLOOKUP);
+	midx_put_be64(chunks[2] + 4, offset);
+	offset += (uint64_t)nobjects * 20;
+	midx_put_be32(chunks[3], MIDX_CHUNKID_OBJECTOFFSETS);
+	midx_put_be64(chunks[3] + 4, offset);
+	offset += (uint64_t)nobjects * 8;
+	if (large_needed) {
+		midx_put_be32(chunks[4], MIDX_CHUNKID_LARGEOFFSETS);
+		midx_put_be64(chunks[4] + 4, offset);
+		offset += (uint64_t)nlarge * 8;
+	}
+	midx_put_be32(chunks[nchunks], 0);
+	midx_put_be64(chunks[nchunks] + 4, offset);
+
+	snprintf(path, sizeof(path), "%s/multi-pack-index", packdir);
+	snprintf(lockpath, sizeof(lockpath), "%s.lock", path);
+	fd = open(lockpath, O_WRONLY | O_CREAT | O_EXCL, 0444);
+	if (fd == -1) {
+		fprintf(stderr, "fatal: unable to create '%s'\n", lockpath);
+		exit(128);
+	}
+	SHA1_Init(&ctx);
+
+	hdr.signature = htonl(MIDX_SIGNATURE);
+	hdr.version = MIDX_VERSION;
+	hdr.hashversion = MIDX_HASH_SHA1;
+	hdr.nchunks = nchunks;
+	hdr.nbase = 0;
+	hdr.npacks = htonl(npacks);
+	sha_write(fd, &hdr, MIDX_HEADER_SIZE, &ctx);
+	sha_write(fd, chunks, (nchunks + 1) * MIDX_CHUNK_ENTRY_SIZE, &ctx);
+
+	/* PNAM */
+	for (n = 0; n < npacks; n++)
+		sha_write(fd, packs[n].name, strlen(packs[n].name) + 1, &ctx);
+	if (pnamsize % MIDX_CHUNK_ALIGNMENT)
+		sha_write(fd, pad, MIDX_CHUNK_ALIGNMENT -
+		    pnamsize % MIDX_CHUNK_ALIGNMENT, &ctx);
+
+	/* OIDF */
+	x = 0;
+	for (n = 0; n < 256; n++) {
+		while (x < nobjects && entries[x].sha[0] == n)
+			x++;
+		fanout = htonl(x);
+		sha_write(fd, &fanout, 4, &ctx);
+	}
+
+	/* OIDL */
+	for (x = 0; x < nobjects; x++)
+		sha_write(fd, entries[x].sha, 20, &ctx);
+
+	/* OOFF */
+	nlarge = 0;
+	for (x = 0; x < nobjects; x++) {
+		midx_put_be32(buf, entries[x].packid);
+		if (large_needed && entries[x].offset > 0x7fffffff)
+			midx_put_be32(buf + 4, MIDX_LARGE_OFFSET | nlarge++);
+		else
+			midx_put_be32(buf + 4, entries[x].offset);
+		sha_write(fd, buf, 8, &ctx);
+	}
+
+	/* LOFF */
+	if (large_needed) {
+		for (x = 0; x < nobjects; x++) {
+			if (entries[x].offset <= 0x7fffffff)
+				continue;
+			midx_put_be64(buf, entries[x].offset);
+			sha_write(fd, buf, 8, &ctx);
+		}
+	}
+
+	SHA1_Final(digest, &ctx);
+	write(fd, digest, 20);
+	close(fd);
+
+	if (rename(lockpath, path) == -1) {
+		fprintf(stderr, "fatal: unable to rename '%s'\n", lockpath);
+		unlink(lockpath);
+		exit(128);
+	}
+
+	free(entries);
+	midx_unload_packs(packs, npacks);
+
+	return (0);
+}
+
+/*
+ * Checks the multi-pack-index against its checksum and against the idx of
+ * every pack it names. Errors are printed, returns the number found.
+ */
+int
+midx_verify(const char *packdir)
+{
+	struct midx *midx;
+	struct midx_pack *packs;
+	unsigned char digest[20];
+	unsigned char (*shas)[20];
+	uint32_t packid, prev, *packids;
+	off_t offset, *offsets;
+	int *packmap, *objects;
+	int npacks, errors, nshas;
+	int n, x;
+	SHA1_CTX ctx;
+
+	midx = midx_open(packdir);
+	if (midx == NULL) {
+		fprintf(stderr, "error: no valid multi-pack-index in %s\n",
+		    packdir);
+		return (1);
+	}
+	errors = 0;
+
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, midx->map, midx->size - 20);
+	SHA1_Final(digest, &ctx);
+	if (memcmp(digest, midx->map + midx->size - 20, 20)) {
+		fprintf(stderr, "error: incorrect checksum\n");
+		errors++;
+	}
+
+	npacks = midx_load_packs(packdir, &packs);
+	if (npacks < 0)
+		npacks = 0;
+
+	/* Find each named pack among those present */
+	packmap = malloc(sizeof(int) * midx->npacks);
+	for (n = 0; n < midx->npacks; n++) {
+		packmap[n] = -1;
+		if (n > 0 && strcmp(midx->packnames[n-1],
+		    midx->packnames[n]) >= 0) {
+			fprintf(stderr, "error: pack names out of order: "
+			    "'%s' before '%s'\n", midx->packnames[n-1],
+			    midx->packnames[n]);
+			errors++;
+		}
+		for (x = 0; x < npacks; x++)
+			if (!strcmp(packs[x].name, midx->packnames[n]))
+				packmap[n] = x;
+		if (packmap[n] == -1) {
+			fprintf(stderr, "error: failed to load pack '%s'\n",
+			    midx->packnames[n]);
+			errors++;
+		}
+	}
+
+	prev = 0;
+	for (n = 0; n < 256; n++) {
+		if (ntohl(midx->fanout[n]) < prev) {
+			fprintf(stderr, "error: oid fanout out of order: "
+			    "fanout[%d] = %u > %u = fanout[%d]\n", n - 1,
+			    prev, ntohl(midx->fanout[n]), n);
+			errors++;
+		}
+		prev = ntohl(midx->fanout[n]);
+	}
+
+	packids = malloc(sizeof(uint32_t) * midx->nobjects);
+	for (x = 0; x < midx->nobjects; x++) {
+		if (x > 0 && memcmp(midx->oids + (x - 1) * 20,
+		    midx->oids + x * 20, 20) >= 0) {
+			fprintf(stderr, "error: oid lookup out of order: "
+			    "oid[%d] >= oid[%d]\n", x - 1, x);
+			errors++;
+		}
+
+		midx_nth_object(midx, x, &packids[x], &offset);
+		if (packids[x] >= midx->npacks) {
+			fprintf(stderr, "error: bad pack-int-id: %u (%d total "
+			    "packs)\n", packids[x], midx->npacks);
+			errors++;
+		}
+	}
+
+	/*
+	 * The oids of each pack are in order, so they are looked up in its
+	 * idx in one pass rather than searched for one by one.
+	 */
+	shas = malloc(20 * midx->nobjects);
+	objects = malloc(sizeof(int) * midx->nobjects);
+	offsets = malloc(sizeof(off_t) * midx->nobjects);
+	for (n = 0; n < midx->npacks; n++) {
+		if (packmap[n] == -1)
+			continue;
+		nshas = 0;
+		for (x = 0; x < midx->nobjects; x++)
+			if (packids[x] == n) {
+				memcpy(shas[nshas], midx->oids + x * 20, 20);
+				objects[nshas++] = x;
+			}
+		pack_find_sha_offsets(shas, nshas, packs[packmap[n]].idxmap,
+		    offsets);
+		for (x = 0; x < nshas; x++) {
+			midx_nth_object(midx, objects[x], &packid, &offset);
+			if (offsets[x] != offset) {
+				fprintf(stderr, "error: incorrect object offset "
+				    "for object %d in %s\n", objects[x],
+				    midx->packnames[n]);
+				errors++;
+			}
+		}
+	}
+	free(offsets);
+	free(objects);
+	free(shas);
+	free(packids);
+
+	free(packmap);
+	midx_unload_packs(packs, npacks);
+	midx_close(midx);
+
+	return (errors);
+}
@@ -0,0 +1,83 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef MIDX_H
+#define MIDX_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "common.h"
+
+/* Header source Documentation/technical/multi-pack-index.txt */
+
+#define MIDX_SIGNATURE		0x4d494458	/* "MIDX" */
+#define MIDX_VERSION		1
+#define MIDX_HASH_SHA1		1
+#define MIDX_HEADER_SIZE	12
+#define MIDX_CHUNK_ENTRY_SIZE	12
+#define MIDX_CHUNK_ALIGNMENT	4
+
+#define MIDX_CHUNKID_PACKNAMES	0x504e414d	/* "PNAM" */
+#define MIDX_CHUNKID_OIDFANOUT	0x4f494446	/* "OIDF" */
+#define MIDX_CHUNKID_OIDLOOKUP	0x4f49444c	/* "OIDL" */
+#define MIDX_CHUNKID_OBJECTOFFSETS 0x4f4f4646	/* "OOFF" */
+#define MIDX_CHUNKID_LARGEOFFSETS 0x4c4f4646	/* "LOFF" */
+
+/* Set in an OOFF offset that indexes the LOFF chunk */
+#define MIDX_LARGE_OFFSET	0x80000000U
+
+struct midx_header {
+	uint32_t	signature;
+	uint8_t		version;
+	uint8_t		hashversion;
+	uint8_t		nchunks;
+	uint8_t		nbase;
+	uint32_t	npacks;
+} __packed;
+
+/* A mapped multi-pack-index, the chunk pointers point into map */
+struct midx {
+	unsigned char	*map;
+	off_t		 size;
+	int		 npacks;
+	int		 nobjects;
+	char		**packnames;	// The .idx names, sorted
+	uint32_t	*fanout;
+	unsigned char	*oids;
+	unsigned char	*offsets;	// Pairs of pack id and offset
+	unsigned char	*largeoffsets;	// NULL without a LOFF chunk
+	int		 nlarge;
+};
+
+struct midx	*midx_open(const char *packdir);
+void		 midx_close(struct midx *midx);
+int		 midx_find_sha(struct midx *midx, unsigned char *sha, uint32_t *packid, off_t *offset);
+void		 midx_nth_object(struct midx *midx, int n, uint32_t *packid, off_t *offset);
+int		 midx_write(const char *packdir);
+int		 midx_verify(const char *packdir);
+
+#endif
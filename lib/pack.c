@@ -30,18 +30,26 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #include "buffering.h"
+#include "crc.h"
 #include "zlib-handler.h"
 #include "pack.h"
 #include "common.h"
 #include "ini.h"
+#include "midx.h"
 
 /*
  * This function is a wrapper for write(1) and also updates
@@ -55,28 +63,23 @@ sha_write(int fd, const void *buf, size_t nbytes, SHA1_CTX *idxctx)
 }
 
 void
-write_pack_cb(int packfd, struct objectinfo *objectinfo, void *pargs)
+write_pack_cb(struct packfile *packfile, struct objectinfo *objectinfo, void *pargs)
 {
 	struct writer_args *writer_args = pargs;
-	if (objectinfo->ptype != OBJ_OFS_DELTA) {
-		lseek(packfd, objectinfo->offset + objectinfo->used, SEEK_SET);
-		deflate_caller(packfd, NULL, NULL, write_cb, writer_args);
+
+	if (objectinfo->ptype != OBJ_OFS_DELTA &&
+	    objectinfo->ptype != OBJ_REF_DELTA) {
+		pack_inflate(packfile, objectinfo->offset + objectinfo->used,
+		    NULL, NULL, write_cb, writer_args);
 	}
 	else {
-		pack_delta_content(packfd, objectinfo, NULL);
+		pack_delta_content(packfile, objectinfo);
 		write(writer_args->fd, objectinfo->data, objectinfo->isize);
 		free(objectinfo->data);
 		free(objectinfo->deltas);
 	}
 }
 
-void
-get_type_pack_cb(int packfd, struct objectinfo *objectinfo, void *pargs)
-{
-	uint8_t *type = pargs;
-	*type = objectinfo->ftype;
-}
-
 
 int
 read_sha_update(void *buf, size_t count, void *arg)
@@ -112,6 +115,18 @@ readvint(unsigned char **datap, unsigned char *top)
 	return (size);
 }
 
+/* Reads an optional byte of a delta copy operation, which may not pass top */
+static unsigned long
+delta_ops_byte(unsigned char **data, unsigned char *top)
+{
+
+	if (*data >= top) {
+		fprintf(stderr, "Bad length: Copy\n");
+		exit(0);
+	}
+	return (*(*data)++);
+}
+
 void
 applypatch(struct decompressed_object *base, struct decompressed_object *delta, struct objectinfo *objectinfo)
 {
@@ -143,21 +158,21 @@ applypatch(struct decompressed_object *base, struct decompressed_object *delta,
 
 			/* Offset in base */
 			if (opcode & BIT(0))
-				cp_off |= (*data++ << 0);
+				cp_off |= delta_ops_byte(&data, top) << 0;
 			if (opcode & BIT(1))
-				cp_off |= (*data++ << 8);
+				cp_off |= delta_ops_byte(&data, top) << 8;
 			if (opcode & BIT(2))
-				cp_off |= (*data++ << 16);
+				cp_off |= delta_ops_byte(&data, top) << 16;
 			if (opcode & BIT(3))
-				cp_off |= (*data++ << 24);
+				cp_off |= delta_ops_byte(&data, top) << 24;
 
 			/* Length to copy */
 			if (opcode & BIT(4))
-				cp_size |= (*data++ << 0);
+				cp_size |= delta_ops_byte(&data, top) << 0;
 			if (opcode & BIT(5))
-				cp_size |= (*data++ << 8);
+				cp_size |= delta_ops_byte(&data, top) << 8;
 			if (opcode & BIT(6))
-				cp_size |= (*data++ << 16);
+				cp_size |= delta_ops_byte(&data, top) << 16;
 
 			if (cp_size == 0)
 				cp_size = 0x10000;
@@ -169,6 +184,10 @@ applypatch(struct decompressed_object *base, struct decompressed_object *delta,
 			memcpy(out, (char *) base->data + cp_off, cp_size);
 			out += cp_size;
 		} else if (opcode) {
+			if (data + opcode > top) {
+				fprintf(stderr, "Bad length: Insert\n");
+				exit(0);
+			}
 			memcpy(out, data, opcode);
 			out += opcode;
 			data += opcode;
@@ -179,587 +198,3143 @@ applypatch(struct decompressed_object *base, struct decompressed_object *delta,
 	}
 }
 
-/*
- * Identifies the header information of each object in the pack file.
- * If will identify the following:
- * - The object type in objectinfo.ptype
- * - If its an OBJ_OFS_DELTA:
- *   - The real objectype in objectinfo.ftype
- *   - The delta offsets to reconstruct the object
- * - The start of the objects offset (not the header)
- */
-
-int
-pack_get_object_meta(int packfd, int offset, struct packfileinfo *packfileinfo,
-    struct index_entry *index_entry,
-    SHA1_CTX *packctx, SHA1_CTX *idxctx)
+/* Only counts the compressed bytes, used to skip over unresolved deltas */
+static unsigned char *
+pack_skip_cb(unsigned char *buf, int size, int deflated_bytes, void *arg)
 {
-	int x;
-	struct objectinfo objectinfo;
-	struct index_generate_arg index_generate_arg;
-	char hdr[32];
-	int hdrlen;
-//	Bytef tmpref[2];
-	struct two_darg two_darg;
-
-	for (x = 0; x < packfileinfo->nobjects; x++) {
-		objectinfo.crc = 0x00;
-		lseek(packfd, offset, SEEK_SET);
-		pack_object_header(packfd, offset, &objectinfo, packctx);
-
-		switch (objectinfo.ptype) {
-		case OBJ_REF_DELTA:
-			fprintf(stderr, "OBJ_REF_DELTA: currently not implemented. Exiting.\n");
-			exit(0);
-//			offset += objectinfo.used;
-//			lseek(packfd, offset, SEEK_SET);
-//			buf_read(packfd, tmpref, 2, read_sha_update, packctx);
-//			objectinfo.crc = crc32(objectinfo.crc, tmpref, 2);
-//			buf_read(packfd, index_entry[x].digest, 20,
-//			    read_sha_update, packctx);
-//			offset += 22; /* 20 bytes + 2 for the header */
-//			break;
-		case OBJ_OFS_DELTA:
-			SHA1_Init(&index_generate_arg.shactx);
-			pack_delta_content(packfd, &objectinfo, packctx);
-			hdrlen = snprintf(hdr, sizeof(hdr), "%s %lu",
-			    object_name[objectinfo.ftype],
-			    objectinfo.isize) + 1;
-			SHA1_Update(&index_generate_arg.shactx, hdr, hdrlen);
-			SHA1_Update(&index_generate_arg.shactx,
-			    objectinfo.data, objectinfo.isize);
-			SHA1_Final(index_entry[x].digest,
-			    &index_generate_arg.shactx);
-			/* The next two are allocated in pack_delta_content */
-			free(objectinfo.data);
-			free(objectinfo.deltas);
-
-			offset = objectinfo.offset + objectinfo.used +
-			    objectinfo.ofshdrsize + objectinfo.deflated_size;
-			break;
-		case OBJ_COMMIT:
-		case OBJ_TREE:
-		case OBJ_BLOB:
-		case OBJ_TAG:
-		default:
-			offset += objectinfo.used;
-			lseek(packfd, offset, SEEK_SET);
-			index_generate_arg.bytes = 0;
-			SHA1_Init(&index_generate_arg.shactx);
-
-			hdrlen = snprintf(hdr, sizeof(hdr), "%s %lu",
-			    object_name[objectinfo.ftype],
-			    objectinfo.psize) + 1;
-			SHA1_Update(&index_generate_arg.shactx, hdr, hdrlen);
-			two_darg.crc = &objectinfo.crc;
-			two_darg.sha = packctx;
-			deflate_caller(packfd, zlib_update_crc_sha, &two_darg,
-			    pack_get_index_bytes_cb, &index_generate_arg);
-
-			SHA1_Final(index_entry[x].digest,
-			    &index_generate_arg.shactx);
-			offset += index_generate_arg.bytes;
-			break;
-		}
+	struct index_generate_arg *index_generate_arg = arg;
+	index_generate_arg->bytes += deflated_bytes;
+	return (buf);
+}
 
-		index_entry[x].crc = objectinfo.crc;
-		index_entry[x].offset = objectinfo.offset;
-	}
+static unsigned long	 pack_parse_type_size(unsigned char *hdr, size_t left,
+			    unsigned int *type, unsigned long *size);
+static unsigned long	 pack_parse_ofs(unsigned char *hdr, size_t left,
+			    uint64_t *delta);
+static long		 delta_cache_get_limit();
+static int		 pack_read_local_object(unsigned char *sha, int *type,
+			    struct decompressed_object *object);
+static int		 pack_index_file(int packfd, off_t offset,
+			    struct packfileinfo *packfileinfo,
+			    struct index_entry *index_entry, SHA1_CTX *packctx,
+			    int nthreads, unsigned char (*extbases)[20],
+			    int nextbases);
 
-	return (offset);
-}
+/*
+ * index-pack resolves deltas from their bases rather than from the deltas:
+ * each whole object is inflated once, then every delta against it is
+ * applied to it, depth first, so each object in the pack is inflated once
+ * however deep its chain. These are the edges of that delta tree.
+ */
+struct pack_ofs_child {
+	off_t		 base;		// Offset of the base object's header
+	int		 obj;
+};
+
+struct pack_ref_child {
+	unsigned char	 base[20];
+	int		 obj;
+};
+
+/* What the first pass learns about each object */
+struct pack_index_object {
+	off_t		 data;		// Offset of the zlib stream
+	unsigned int	 ptype;
+	unsigned long	 psize;
+	bool		 hashed;	// Whole object hashed as it arrived
+	bool		 claimed;	// REF delta taken by a worker
+};
 
 /*
- * Writes the header of the index file.
+ * A resolved object whose deltas are being applied. Its data may be
+ * dropped to stay within the memory limit and is then rebuilt from its
+ * own base.
  */
-inline void
-write_index_header(int idxfd, SHA1_CTX *idxctx)
+struct pack_base {
+	struct pack_base *parent;
+	int		 obj;
+	unsigned char	*data;
+	unsigned long	 size;
+};
+
+/* Whole objects up to this size are hashed SHA1_LANES at a time */
+#define PACK_INDEX_SMALL	(16 * 1024)
+
+/* Work shared by the index-pack workers, see pack_index_worker */
+struct pack_index_job {
+	struct packfile		*packfile;
+	struct index_entry	*index_entry;
+	struct pack_index_object *objects;
+	int			 nobjects;
+	struct pack_ofs_child	*ofs;		// Sorted by base offset
+	int			 nofs;
+	struct pack_ref_child	*ref;		// Sorted by base SHA
+	int			 nref;
+	long			 limit;		// Base data each worker may hold
+	int			 next;		// Next object to claim
+	bool			 datacrc;	// Workers add the data to the crc32s
+	off_t			 end;		// Where the last object ends
+	unsigned char		(*extbases)[20]; // Local bases of a thin pack
+	int			 nextbases;
+	pthread_mutex_t		 lock;
+};
+
+/* The per-thread side of a pack_index_job */
+struct pack_index_worker {
+	struct pack_index_job	*job;
+	struct pack_base	**stack;	// The chain being resolved
+	int			 depth;
+	int			 maxdepth;
+	unsigned long		 held;		// Bytes of base data held
+};
+
+static int
+pack_ofs_child_cmp(const void *a, const void *b)
 {
-	sha_write(idxfd, "\377tOc", 4, idxctx);
-	sha_write(idxfd, "\x00\x00\x00\x02", 4, idxctx);
+	const struct pack_ofs_child *x = a;
+	const struct pack_ofs_child *y = b;
+
+	if (x->base != y->base)
+		return (x->base < y->base ? -1 : 1);
+	return (x->obj - y->obj);
 }
 
-inline void
-write_hash_count(int idxfd, struct index_entry *index_entry,
-    SHA1_CTX *idxctx)
+/* Compares the base SHAs only, to find the deltas against a base */
+static int
+pack_ref_child_base_cmp(const void *a, const void *b)
 {
-	int hashnum;
-	int reversed;
-	int x;
+	const struct pack_ref_child *x = a;
+	const struct pack_ref_child *y = b;
 
-	hashnum = 0;
-
-	for (x=0;x<256;x++) {
-		while (index_entry[hashnum].digest[0] == x)
-			hashnum++;
-		reversed = htonl(hashnum);
-		sha_write(idxfd, &reversed, 4, idxctx);
-	}
+	return (memcmp(x->base, y->base, 20));
 }
 
-inline void
-write_hashes(int idxfd, struct packfileinfo *packfileinfo,
-    struct index_entry *index_entry, SHA1_CTX *idxctx)
+static int
+pack_ref_child_cmp(const void *a, const void *b)
 {
-	int x;
-
-	for (x=0;x<packfileinfo->nobjects; x++)
-		sha_write(idxfd, index_entry[x].digest, 20, idxctx);
+	const struct pack_ref_child *x = a;
+	const struct pack_ref_child *y = b;
+	int cmp;
+
+	cmp = memcmp(x->base, y->base, 20);
+	if (cmp)
+		return (cmp);
+	return (x->obj - y->obj);
 }
 
-inline void
-write_crc_table(int idxfd, struct packfileinfo *packfileinfo,
-    struct index_entry *index_entry, SHA1_CTX *idxctx)
+/* Computes the object SHA of an inflated object */
+static void
+pack_object_digest(int type, unsigned char *data, unsigned long size,
+    unsigned char *digest)
 {
-	uint32_t crc32tmp;
-	int x;
+	SHA1_CTX shactx;
+	char hdr[32];
+	int hdrlen;
 
-	for (x=0;x<packfileinfo->nobjects;x++) {
-		crc32tmp = htonl(index_entry[x].crc);
-		sha_write(idxfd, &crc32tmp, 4, idxctx);
-	}
+	SHA1_Init(&shactx);
+	hdrlen = snprintf(hdr, sizeof(hdr), "%s %lu", object_name[type],
+	    size) + 1;
+	SHA1_Update(&shactx, hdr, hdrlen);
+	SHA1_Update(&shactx, data, size);
+	SHA1_Final(digest, &shactx);
 }
 
-inline void
-write_32bit_table(int idxfd, struct packfileinfo *packfileinfo,
-    struct index_entry *index_entry, SHA1_CTX *idxctx)
+/* Frees the data of the oldest bases until the worker is within its limit */
+static void
+pack_index_prune(struct pack_index_worker *worker)
 {
-	uint64_t offsettmp;
-	int x;
+	struct pack_base *base;
+	int n;
 
-	for (x = 0; x < packfileinfo->nobjects; x++) {
-		offsettmp = htonl(index_entry[x].offset);
-		sha_write(idxfd, &offsettmp, 4, idxctx);
+	for (n = 0; n < worker->depth - 1 && worker->held > worker->job->limit;
+	    n++) {
+		base = worker->stack[n];
+		/* A base from outside the pack cannot be rebuilt */
+		if (base->data == NULL || base->obj >= worker->job->nobjects)
+			continue;
+		free(base->data);
+		base->data = NULL;
+		worker->held -= base->size;
 	}
 }
 
-inline void
-write_checksums(int idxfd, struct packfileinfo *packfileinfo, SHA1_CTX *idxctx)
-{
-	sha_write(idxfd, packfileinfo->sha, 20, idxctx);
-	SHA1_Final(packfileinfo->ctx, idxctx);
-	sha_write(idxfd, packfileinfo->ctx, 20, idxctx);
-}
-
 /*
- * Builds the idx file, combines the functions above.
+ * Makes sure the data of base is in memory, inflating it if it is a whole
+ * object or applying its delta to its own base otherwise. Rebuilding a
+ * base may take its dropped ancestors back into memory, so the caller
+ * prunes afterwards.
  */
-void
-pack_build_index(int idxfd, struct packfileinfo *packfileinfo,
-    struct index_entry *index_entry, SHA1_CTX *idxctx)
+static void
+pack_index_base_data(struct pack_index_worker *worker, struct pack_base *base)
 {
-	/* Write pack header */
-	write_index_header(idxfd, idxctx);
-	/* Writing hash count */
-	write_hash_count(idxfd, index_entry, idxctx);
-	/* Writing hashes */
-	write_hashes(idxfd, packfileinfo, index_entry, idxctx);
-	/* Write the crc32 table */
-	write_crc_table(idxfd, packfileinfo, index_entry, idxctx);
-	/* Write the 32-bit offset table */
-	write_32bit_table(idxfd, packfileinfo, index_entry, idxctx);
-	/* Currently does not write large files */
-	/* Write the SHA1 checksum of the corresponding packfile */
-	write_checksums(idxfd, packfileinfo, idxctx);
+	struct pack_index_object *object;
+	struct decompressed_object parent, delta;
+	struct objectinfo objectinfo;
+
+	if (base->data)
+		return;
+
+	object = &worker->job->objects[base->obj];
+	pack_inflate_whole(worker->job->packfile, object->data, object->psize,
+	    &delta);
+
+	if (base->parent == NULL) {
+		base->data = delta.data;
+		base->size = delta.size;
+	}
+	else {
+		pack_index_base_data(worker, base->parent);
+		parent.data = base->parent->data;
+		parent.size = base->parent->size;
+		applypatch(&parent, &delta, &objectinfo);
+		free(delta.data);
+		base->data = objectinfo.data;
+		base->size = objectinfo.isize;
+	}
+
+	worker->held += base->size;
 }
 
 /*
- * This function reassembles an OBJ_OFS_DELTA object. It requires that the
- * objectinfo variable has already passed through pack_object_header.
- * It starts by inflating the base object. Then, it loops through each delta
- * by offset, inflates the contents and applies the patch.
- *
- * Note: This is a memory-extensive function, as it requires a copy of the base
- * object and fully patched object in memory at once and I cannot think of any
- * way to only have one object in memory at once.
- *
- * This function also calculates the crc32 value. The code is not as clean as
- * it should be, but this is the best approach I had without using a file-scope
- * variable, which is GPL git's approach.
+ * Takes a REF delta for the calling worker. A pack may hold an object
+ * twice, and the workers of both copies find the same REF deltas, so only
+ * the first to get here resolves one. Returns false if it was taken.
  */
-void
-pack_delta_content(int packfd, struct objectinfo *objectinfo, SHA1_CTX *packctx)
+static bool
+pack_index_claim(struct pack_index_job *job, int obj)
 {
-	struct decompressed_object base_object, delta_object;
-	int q;
-
-	base_object.data = NULL;
-	base_object.size = 0;
-	base_object.deflated_size = 0;
+	bool claimed;
 
-	/*
-	 * Prevent a potential condition where this
-	 * value is assigned without being used.
-	 */
-	delta_object.deflated_size = 0;
+	pthread_mutex_lock(&job->lock);
+	claimed = job->objects[obj].claimed;
+	job->objects[obj].claimed = true;
+	pthread_mutex_unlock(&job->lock);
 
-	lseek(packfd, objectinfo->ofsbase, SEEK_SET);
-	deflate_caller(packfd, NULL, NULL, buffer_cb, &base_object);
-	objectinfo->deflated_size = base_object.deflated_size;
+	return (!claimed);
+}
 
-	for (q=objectinfo->ndeltas-1;q>=0;q--) {
-		lseek(packfd, objectinfo->deltas[q], SEEK_SET);
+/* Resolves every delta against base, and the deltas against those */
+static void
+pack_index_descend(struct pack_index_worker *worker, struct pack_base *base)
+{
+	struct pack_index_job *job = worker->job;
+	struct index_entry *entry;
+	struct pack_ofs_child ofskey, *ofs;
+	struct pack_ref_child refkey, *ref;
+	struct pack_base child;
+	int type, obj;
+	int lo, hi, mid;
+
+	type = job->index_entry[base->obj].type;
+	ofskey.base = job->index_entry[base->obj].offset;
+	ofskey.obj = -1;
+	memcpy(refkey.base, job->index_entry[base->obj].digest, 20);
+	refkey.obj = -1;
+
+	/* Find the first child of each kind, the lists are sorted */
+	lo = 0;
+	hi = job->nofs;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pack_ofs_child_cmp(&job->ofs[mid], &ofskey) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	ofs = job->ofs + lo;
+	lo = 0;
+	hi = job->nref;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pack_ref_child_cmp(&job->ref[mid], &refkey) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	ref = job->ref + lo;
 
-		delta_object.data = NULL;
-		delta_object.size = 0;
-		delta_object.deflated_size = 0;
-		/* Only calculate the crc32 for the first iteration */
-		if (q == 0) {
-			struct two_darg two_darg;
-			two_darg.crc =  &objectinfo->crc;
-			two_darg.sha = packctx;
-			deflate_caller(packfd, zlib_update_crc_sha, &two_darg, buffer_cb, &delta_object);
+	if (worker->depth == worker->maxdepth) {
+		worker->maxdepth *= 2;
+		worker->stack = realloc(worker->stack,
+		    sizeof(struct pack_base *) * worker->maxdepth);
+	}
+	worker->stack[worker->depth++] = base;
+
+	for (;;) {
+		if (ofs < job->ofs + job->nofs && ofs->base == ofskey.base)
+			obj = (ofs++)->obj;
+		else if (ref < job->ref + job->nref &&
+		    !memcmp(ref->base, refkey.base, 20)) {
+			obj = (ref++)->obj;
+			if (!pack_index_claim(job, obj))
+				continue;
 		}
 		else
-			deflate_caller(packfd, NULL, NULL, buffer_cb, &delta_object);
-
+			break;
 
-		applypatch(&base_object, &delta_object, objectinfo);
-		free(base_object.data);
-		free(delta_object.data);
-		base_object.data = objectinfo->data;
-		base_object.size = objectinfo->isize;
+		child.parent = base;
+		child.obj = obj;
+		child.data = NULL;
+		pack_index_base_data(worker, &child);
+		pack_index_prune(worker);
+
+		entry = &job->index_entry[obj];
+		pack_object_digest(type, child.data, child.size,
+		    entry->digest);
+		entry->type = type;
+
+		pack_index_descend(worker, &child);
+		if (child.data) {
+			free(child.data);
+			worker->held -= child.size;
+		}
 	}
 
-	/*
-	 * This instance of deflated_size is the 0th in the list which
-	 * means it is the deflated_size of the current OBJ_OFS_DELTA,
-	 * not of the parent deltas.
-	 */
-	objectinfo->deflated_size = delta_object.deflated_size;
-
+	worker->depth--;
 }
 
-/* Used by index-pack to compute SHA and get offset bytes */
-unsigned char *
-pack_get_index_bytes_cb(unsigned char *buf, int size, int deflated_bytes, void *arg)
+/*
+ * Hashes the whole objects among roots that were not hashed as they
+ * arrived. The small ones are hashed together, see sha1_final_many, and
+ * keep their data for their deltas, the others are hashed one at a time
+ * and dropped until a delta needs them.
+ */
+static void
+pack_index_hash_roots(struct pack_index_worker *worker, struct pack_base *roots,
+    int nroots)
 {
-	struct index_generate_arg *index_generate_arg = arg;
-	SHA1_Update(&index_generate_arg->shactx, buf, size);
-	index_generate_arg->bytes += deflated_bytes;
-	return (buf);
+	struct pack_index_job *job = worker->job;
+	struct index_entry *entry;
+	SHA1_CTX ctx[SHA1_LANES], *ctxp[SHA1_LANES];
+	const unsigned char *data[SHA1_LANES];
+	unsigned char *digest[SHA1_LANES];
+	size_t len[SHA1_LANES];
+	char hdr[32];
+	int hdrlen, r, n;
+
+	n = 0;
+	for (r = 0; r < nroots; r++) {
+		if (job->objects[roots[r].obj].hashed)
+			continue;
+		pack_index_base_data(worker, &roots[r]);
+		entry = &job->index_entry[roots[r].obj];
+		entry->type = job->objects[roots[r].obj].ptype;
+
+		if (roots[r].size > PACK_INDEX_SMALL) {
+			pack_object_digest(entry->type, roots[r].data,
+			    roots[r].size, entry->digest);
+			free(roots[r].data);
+			roots[r].data = NULL;
+			worker->held -= roots[r].size;
+			continue;
+		}
+		hdrlen = snprintf(hdr, sizeof(hdr), "%s %lu",
+		    object_name[entry->type], roots[r].size) + 1;
+		SHA1_Init(&ctx[n]);
+		SHA1_Update(&ctx[n], hdr, hdrlen);
+		ctxp[n] = &ctx[n];
+		data[n] = roots[r].data;
+		len[n] = roots[r].size;
+		digest[n] = entry->digest;
+		n++;
+	}
+	sha1_final_many(ctxp, data, len, digest, n);
 }
 
-/* Gets the offset and filename prefix based on the SHA */
-int
-pack_get_packfile_offset(char *sha_str, char *filename)
+/*
+ * Adds the compressed data of an object, which runs up to the next object,
+ * to its crc32, which the first pass left at that of the header. This way
+ * the workers each hash a share of the pack.
+ */
+static void
+pack_index_data_crc(struct pack_index_job *job, int obj)
 {
-	DIR *d;
-	struct dirent *dir;
-	char packdir[PATH_MAX];
-	int packfd;
-	char *file_ext;
-	unsigned char *idxmap;
-	struct stat sb;
-	int offset = 0;
-	uint8_t sha_bin[20];
-	int i;
-
-	for (i=0;i<20;i++)
-		sscanf(sha_str+i*2, "%2hhx", &sha_bin[i]);
+	struct pack_window *window = NULL;
+	struct index_entry *entry = &job->index_entry[obj];
+	unsigned char *data;
+	off_t offset, end;
+	size_t left;
+
+	offset = job->objects[obj].data;
+	end = obj + 1 < job->nobjects ? entry[1].offset : job->end;
+	while (offset < end) {
+		data = pack_window_use(job->packfile, &window, offset, &left);
+		if (left > end - offset)
+			left = end - offset;
+		entry->crc = crc_update(entry->crc, data, left);
+		offset += left;
+	}
+	pack_window_unuse(&window);
+}
 
-	snprintf(packdir, sizeof(packdir), "%s/objects/pack", dotgitpath);
-	d = opendir(packdir);
+static void *
+pack_index_worker(void *arg)
+{
+	struct pack_index_worker worker;
+	struct pack_index_job *job = arg;
+	struct pack_base roots[SHA1_LANES];
+	int first, nroots, n;
+
+	bzero(&worker, sizeof(struct pack_index_worker));
+	worker.job = job;
+	worker.maxdepth = 64;
+	worker.stack = malloc(sizeof(struct pack_base *) * worker.maxdepth);
+
+	/* Objects are claimed SHA1_LANES at a time so they hash together */
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		first = job->next;
+		job->next += SHA1_LANES;
+		pthread_mutex_unlock(&job->lock);
+		if (first >= job->nobjects)
+			break;
 
-	/* Find hash in idx file or die */
-	if (d) {
-		while ((dir = readdir(d)) != NULL) {
-			file_ext = strrchr(dir->d_name, '.');
-			if (!file_ext || strncmp(file_ext, ".idx", 4))
+		nroots = 0;
+		for (n = first; n < first + SHA1_LANES && n < job->nobjects;
+		    n++) {
+			if (job->datacrc)
+				pack_index_data_crc(job, n);
+			if (job->objects[n].ptype == OBJ_OFS_DELTA ||
+			    job->objects[n].ptype == OBJ_REF_DELTA)
 				continue;
-			/* XXX This is wrong; we need to know the size of the buffer */
-			snprintf(filename, PATH_MAX, "%s/objects/pack/%s", dotgitpath,
-			    dir->d_name);
-
-			packfd = open(filename, O_RDONLY);
-			fstat(packfd, &sb);
-			idxmap = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, packfd, 0);
-
-			if (idxmap == NULL) {
-				fprintf(stderr, "mmap(2) error, exiting.\n");
-				exit(0);
+			roots[nroots].parent = NULL;
+			roots[nroots].obj = n;
+			roots[nroots].data = NULL;
+			nroots++;
+		}
+		pack_index_hash_roots(&worker, roots, nroots);
+
+		/* The data is only inflated again if a delta needs it */
+		for (n = 0; n < nroots; n++) {
+			pack_index_descend(&worker, &roots[n]);
+			if (roots[n].data) {
+				free(roots[n].data);
+				worker.held -= roots[n].size;
 			}
-			close(packfd);
-
-			offset = pack_find_sha_offset(sha_bin, idxmap);
+		}
+	}
 
-			munmap(idxmap, sb.st_size);
+	free(worker.stack);
+	return (NULL);
+}
 
-			if (offset != -1)
+/*
+ * Resolves the deltas left in a thin pack against the bases in
+ * job->extbases, read from the local object store. Each base is the
+ * object nobjects + n of the job, its data stays in memory while its
+ * deltas are resolved. Bases whose deltas were all resolved from a copy
+ * in the pack, or from an earlier base, are not read.
+ */
+static void
+pack_index_resolve_external(struct pack_index_job *job)
+{
+	struct pack_index_worker worker;
+	struct decompressed_object object;
+	struct pack_ref_child refkey, *ref;
+	struct pack_base root;
+	char shastr[HASH_SIZE+1];
+	int type, obj, n;
+
+	bzero(&worker, sizeof(struct pack_index_worker));
+	worker.job = job;
+	worker.maxdepth = 64;
+	worker.stack = malloc(sizeof(struct pack_base *) * worker.maxdepth);
+
+	for (n = 0; n < job->nextbases; n++) {
+		memcpy(refkey.base, job->extbases[n], 20);
+		refkey.obj = -1;
+		ref = bsearch(&refkey, job->ref, job->nref,
+		    sizeof(struct pack_ref_child), pack_ref_child_base_cmp);
+		if (ref == NULL)
+			continue;
+		while (ref > job->ref && !memcmp(ref[-1].base, refkey.base, 20))
+			ref--;
+		for (; ref < job->ref + job->nref &&
+		    !memcmp(ref->base, refkey.base, 20); ref++)
+			if (!job->objects[ref->obj].claimed)
 				break;
+		if (ref == job->ref + job->nref ||
+		    memcmp(ref->base, refkey.base, 20))
+			continue;
+
+		if (pack_read_local_object(job->extbases[n], &type, &object)) {
+			sha_bin_to_str(job->extbases[n], shastr);
+			shastr[HASH_SIZE] = '\0';
+			fprintf(stderr, "fatal: pack has unresolved delta base "
+			    "%s, which is not in the local repository\n",
+			    shastr);
+			exit(128);
 		}
+
+		obj = job->nobjects + n;
+		job->objects[obj].ptype = type;
+		job->index_entry[obj].type = type;
+		job->index_entry[obj].offset = -1;
+		memcpy(job->index_entry[obj].digest, job->extbases[n], 20);
+
+		root.parent = NULL;
+		root.obj = obj;
+		root.data = object.data;
+		root.size = object.size;
+		pack_index_descend(&worker, &root);
+		free(object.data);
 	}
 
-	closedir(d);
+	free(worker.stack);
+}
 
-	return (offset);
+/*
+ * Resolves the deltas of a job whose first pass is done, see
+ * pack_get_object_meta, and frees the job's lists.
+ */
+static int
+pack_index_resolve(struct pack_index_job *job, int nthreads)
+{
+	struct index_entry *index_entry = job->index_entry;
+	pthread_t *threads;
+	int unresolved, x, n;
+
+	qsort(job->ofs, job->nofs, sizeof(struct pack_ofs_child),
+	    pack_ofs_child_cmp);
+	qsort(job->ref, job->nref, sizeof(struct pack_ref_child),
+	    pack_ref_child_cmp);
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > job->nobjects)
+		nthreads = job->nobjects;
+	if (nthreads < 1)
+		nthreads = 1;
+	job->limit = delta_cache_get_limit() / nthreads;
+	pthread_mutex_init(&job->lock, NULL);
+
+	/* The calling thread is one of the workers */
+	threads = malloc(sizeof(pthread_t) * nthreads);
+	for (n = 1; n < nthreads; n++)
+		if (pthread_create(&threads[n], NULL, pack_index_worker, job)) {
+			fprintf(stderr, "fatal: unable to create thread\n");
+			exit(128);
+		}
+	pack_index_worker(job);
+	for (n = 1; n < nthreads; n++)
+		pthread_join(threads[n], NULL);
+	free(threads);
+	if (job->nextbases > 0)
+		pack_index_resolve_external(job);
+	pthread_mutex_destroy(&job->lock);
+
+	/* Deltas whose base is not in the pack */
+	for (n = 0; n < job->nref; n++) {
+		x = job->ref[n].obj;
+		if (index_entry[x].type == OBJ_OFS_DELTA) {
+			index_entry[x].type = OBJ_REF_DELTA;
+			memcpy(index_entry[x].digest, job->ref[n].base, 20);
+		}
+	}
+	unresolved = 0;
+	for (x = 0; x < job->nobjects; x++)
+		if (index_entry[x].type == OBJ_OFS_DELTA ||
+		    index_entry[x].type == OBJ_REF_DELTA)
+			unresolved++;
+
+	free(job->objects);
+	free(job->ofs);
+	free(job->ref);
+	return (unresolved);
 }
 
+/*
+ * Indexes every object in the pack file: its offset, crc32, final type
+ * and SHA go in index_entry.
+ *
+ * A first sequential pass walks the pack to find where each object starts,
+ * which object each delta is against, the crc32s and the pack checksum.
+ * Then nthreads workers, or one per online CPU if nthreads is 0, take the
+ * whole objects in turn and resolve the tree of deltas under each, see
+ * pack_index_descend. The base data a worker holds is bounded by its share
+ * of core.deltaBaseCacheLimit.
+ *
+ * Returns the number of deltas left unresolved because their base is not
+ * in the pack (a thin pack). The index_entry of an OBJ_REF_DELTA among them
+ * has the type OBJ_REF_DELTA and the digest of its missing base, see
+ * pack_fix_thin, the deltas against those have the type OBJ_OFS_DELTA.
+ */
 int
-pack_parse_header(int packfd, struct packfileinfo *packfileinfo, SHA1_CTX *packctx)
+pack_get_object_meta(int packfd, off_t offset, struct packfileinfo *packfileinfo,
+    struct index_entry *index_entry,
+    SHA1_CTX *packctx, SHA1_CTX *idxctx, int nthreads)
 {
-	int version;
-	int nobjects;
-	unsigned char buf[4];
 
-	buf_read(packfd, buf, 4, read_sha_update, packctx);
+	return (pack_index_file(packfd, offset, packfileinfo, index_entry,
+	    packctx, nthreads, NULL, 0));
+}
 
-	if (memcmp(buf, "PACK", 4)) {
-		fprintf(stderr, "error: bad object header. Git repository may be corrupt.\n");
+/*
+ * Does pack_get_object_meta, also resolving the deltas against the
+ * nextbases objects extbases from the local object store. index_entry has
+ * room for nobjects + nextbases entries, see pack_index_resolve_external.
+ */
+static int
+pack_index_file(int packfd, off_t offset, struct packfileinfo *packfileinfo,
+    struct index_entry *index_entry, SHA1_CTX *packctx, int nthreads,
+    unsigned char (*extbases)[20], int nextbases)
+{
+	struct pack_index_object *object;
+	struct pack_window *window = NULL;
+	struct index_generate_arg index_generate_arg;
+	struct packfile packfile;
+	struct pack_index_job job;
+	struct stat sb;
+	unsigned char *hdr, *ref;
+	size_t left;
+	uint64_t delta;
+	uLong crc;
+	int unresolved, x, n;
+
+	/* Not a registered pack, its windows are dropped */
+	bzero(&packfile, sizeof(struct packfile));
+	packfile.packfd = packfd;
+	if (fstat(packfd, &sb) == -1) {
+		fprintf(stderr, "fatal: cannot stat packfile\n");
 		exit(128);
 	}
+	packfile.packsize = sb.st_size;
+
+	bzero(&job, sizeof(struct pack_index_job));
+	job.packfile = &packfile;
+	job.index_entry = index_entry;
+	job.nobjects = packfileinfo->nobjects;
+	job.objects = malloc(sizeof(struct pack_index_object) *
+	    (job.nobjects + nextbases));
+	job.ofs = malloc(sizeof(struct pack_ofs_child) * job.nobjects);
+	job.ref = malloc(sizeof(struct pack_ref_child) * job.nobjects);
+	job.datacrc = true;
+	job.extbases = extbases;
+	job.nextbases = nextbases;
 
-	buf_read(packfd, &version, 4, read_sha_update, packctx);
-	packfileinfo->version = ntohl(version);
-	if (packfileinfo->version != 2) {
-		fprintf(stderr, "error: unsupported version: %d\n", version);
-		exit(128);
+	/*
+	 * Find the objects, the edges of the delta tree, the pack checksum and
+	 * the crc32 of the headers, the workers add the data to those.
+	 */
+	for (x = 0; x < job.nobjects; x++) {
+		object = &job.objects[x];
+		hdr = pack_window_use(&packfile, &window, offset, &left);
+		n = pack_parse_type_size(hdr, left, &object->ptype,
+		    &object->psize);
+		object->hashed = false;
+		object->claimed = false;
+
+		if (object->ptype == OBJ_OFS_DELTA) {
+			n += pack_parse_ofs(hdr + n, left - n, &delta);
+			if (delta == 0 || delta > offset) {
+				fprintf(stderr, "fatal: delta base offset is "
+				    "out of bound at offset %jd\n",
+				    (intmax_t)offset);
+				exit(128);
+			}
+			job.ofs[job.nofs].base = offset - delta;
+			job.ofs[job.nofs++].obj = x;
+		}
+		crc = crc_update(0, hdr, n);
+		SHA1_Update(packctx, hdr, n);
+
+		if (object->ptype == OBJ_REF_DELTA) {
+			ref = pack_window_use(&packfile, &window, offset + n,
+			    &left);
+			crc = crc_update(crc, ref, 20);
+			SHA1_Update(packctx, ref, 20);
+			memcpy(job.ref[job.nref].base, ref, 20);
+			job.ref[job.nref++].obj = x;
+			n += 20;
+		}
+		pack_window_unuse(&window);
+
+		object->data = offset + n;
+		index_generate_arg.bytes = 0;
+		pack_inflate(&packfile, object->data, zlib_update_sha, packctx,
+		    pack_skip_cb, &index_generate_arg);
+
+		index_entry[x].offset = offset;
+		index_entry[x].crc = crc;
+		index_entry[x].type = OBJ_OFS_DELTA;	// Not resolved yet
+		offset = object->data + index_generate_arg.bytes;
 	}
+	job.end = offset;
 
-	buf_read(packfd, &nobjects, 4, read_sha_update, packctx);
-	packfileinfo->nobjects = ntohl(nobjects);
+	unresolved = pack_index_resolve(&job, nthreads);
+	pack_window_release(&packfile);
 
-	/* This hardcoded value is because we read 4*3 bytes from the header */
-	return (12);
+	return (unresolved);
 }
 
 /*
- * The function pack_object_header checks the object type of the current object.
- * If the type is not deltified, it will immediately return and the variable
- * objectinfo will contain the type as objectinfo->ftype. Additionally, we will
- * have the objectinfo->isize.
- *
- * If the object is deltified, it will iteratively call object_header_ofs to
- * locate the following values:
- * A. The base object type, stored in objectinto->ftype
- * B. The base offset, stored in objectinfo->base
- * C. All delta offsets, stored in objectinfo->deltas
- * D. Number of deltas, stored in objectinfo->ndelta
- * Note: The objectinfo->isize value is NOT captured
- *
- * If the application needs the objectinfo->isize or objectinfo->data, it must
- * run pack_delta_content. This function will consumed values B-D to produce
- * the final non-deltified data.
+ * Indexes a pack while it is being received, see pack_stream_open. The
+ * pack checksum, the crc32s and the SHAs of whole objects are computed as
+ * the bytes arrive, so only the deltas are left once the last one has.
  */
+enum pack_stream_state {
+	PACK_STREAM_HEADER,
+	PACK_STREAM_OBJHDR,
+	PACK_STREAM_DATA,
+	PACK_STREAM_TRAILER,
+	PACK_STREAM_DONE
+};
+
+struct pack_stream {
+	int		 packfd;
+	enum pack_stream_state state;
+	off_t		 offset;	// Bytes of the pack received
+	SHA1_CTX	 packctx;
+	struct packfileinfo packfileinfo;
+	struct pack_index_job job;
+	int		 obj;		// The object being received
+	unsigned char	 hdr[32];	// The pack, object header or trailer
+	int		 hdrlen;
+	uLong		 crc;
+	z_stream	 zst;
+	SHA1_CTX	 objctx;	// SHA of the object, if not a delta
+	unsigned long	 isize;		// Bytes of the object inflated so far
+	unsigned char	 out[65536];
+};
 
-/* Starts at a new object header, not the delta */
-void
-object_header_ofs(int packfd, int offset, int layer,
-    struct objectinfo *objectinfo, struct objectinfo *childinfo,
-    SHA1_CTX *packctx)
+/*
+ * Returns the length of the object header in hdr, including the base
+ * offset or SHA of a delta, or 0 if more bytes are needed.
+ */
+static int
+pack_stream_header_len(unsigned char *hdr, int len)
 {
-	uint8_t c;
-	unsigned shift;
-	unsigned long used;
-	lseek(packfd, offset, SEEK_SET);
-
-	read(packfd, &c, 1);
-	used = 1;
-	childinfo->psize = c & 15;
-	childinfo->ptype = (c >> 4) & 7;
-
-	shift = 4;
-
-	while (c & 0x80) {
-		read(packfd, &c, 1);
-		childinfo->psize += (c & 0x7f) << shift;
-		shift += 7;
-		used++;
-	}
-
-	if (childinfo->ptype != OBJ_OFS_DELTA) {
-		objectinfo->ftype = childinfo->ptype;
-		objectinfo->deltas = malloc(sizeof(unsigned long) * layer);
-		objectinfo->ofsbase = offset + used;
-		objectinfo->ndeltas = layer;
-	}
-	else {
-		unsigned long delta;
-		unsigned long ofshdr = 1;
-
-		read(packfd, &c, 1);
-		delta = c & 0x7f;
-		while (c & 0x80) {
-			delta++;
-			ofshdr++;
-			read(packfd, &c, 1);
-			delta = (delta << 7) + (c & 0x7f);
-		}
-		object_header_ofs(packfd, offset - delta, layer+1, objectinfo, childinfo, packctx);
-		objectinfo->deltas[layer] = offset + used + ofshdr;
+	int n = 0;
+
+	while (n < len && (hdr[n] & 0x80))
+		n++;
+	if (n++ == len)
+		return (0);
+
+	switch ((hdr[0] >> 4) & 7) {
+	case OBJ_REF_DELTA:
+		return (len >= n + 20 ? n + 20 : 0);
+	case OBJ_OFS_DELTA:
+		while (n < len && (hdr[n] & 0x80))
+			n++;
+		return (n < len ? n + 1 : 0);
 	}
+	return (n);
 }
 
-void
-pack_object_header(int packfd, int offset, struct objectinfo *objectinfo,
-    SHA1_CTX *packctx)
+/* Adds up to want bytes to the stream's hdr, returns how many were used */
+static size_t
+pack_stream_fill(struct pack_stream *pstream, unsigned char *buf, size_t len,
+    int want)
 {
-	uint8_t c;
-	unsigned shift;
+	size_t n;
 
-	lseek(packfd, offset, SEEK_SET);
-
-	objectinfo->offset = offset;
-	objectinfo->used = 1;
+	n = want - pstream->hdrlen;
+	if (n > len)
+		n = len;
+	memcpy(pstream->hdr + pstream->hdrlen, buf, n);
+	pstream->hdrlen += n;
+	pstream->offset += n;
 
-	c = 0;
-	buf_read(packfd, &c, 1, read_sha_update, packctx);
+	return (n);
+}
 
-	objectinfo->crc = crc32(objectinfo->crc, &c, 1);
-	objectinfo->ptype = (c >> 4) & 7;
-	objectinfo->psize = c & 15;
-	shift = 4;
+/* Takes the pack header out of the stream's hdr */
+static void
+pack_stream_start(struct pack_stream *pstream)
+{
+	struct pack_index_job *job = &pstream->job;
+	uint32_t word;
 
-	while (c & 0x80) { 
-		buf_read(packfd, &c, 1, read_sha_update, packctx);
-		objectinfo->crc = crc32(objectinfo->crc, &c, 1);
-		objectinfo->psize += (c & 0x7f) << shift;
-		shift += 7;
-		objectinfo->used++;
+	if (memcmp(pstream->hdr, "PACK", 4)) {
+		fprintf(stderr, "fatal: protocol error: bad pack header\n");
+		exit(128);
 	}
-
-	if (objectinfo->ptype != OBJ_OFS_DELTA && objectinfo->ptype != OBJ_REF_DELTA) {
-		objectinfo->ftype = objectinfo->ptype;
-		objectinfo->ndeltas = 0;
+	memcpy(&word, pstream->hdr + 4, 4);
+	pstream->packfileinfo.version = ntohl(word);
+	if (pstream->packfileinfo.version != 2) {
+		fprintf(stderr, "fatal: pack version %d unsupported\n",
+		    pstream->packfileinfo.version);
+		exit(128);
 	}
+	memcpy(&word, pstream->hdr + 8, 4);
+	pstream->packfileinfo.nobjects = ntohl(word);
+	SHA1_Update(&pstream->packctx, pstream->hdr, 12);
+
+	job->nobjects = pstream->packfileinfo.nobjects;
+	job->index_entry = malloc(sizeof(struct index_entry) * job->nobjects);
+	job->objects = malloc(sizeof(struct pack_index_object) * job->nobjects);
+	job->ofs = malloc(sizeof(struct pack_ofs_child) * job->nobjects);
+	job->ref = malloc(sizeof(struct pack_ref_child) * job->nobjects);
+	if (job->index_entry == NULL || job->objects == NULL ||
+	    job->ofs == NULL || job->ref == NULL) {
+		fprintf(stderr, "fatal: out of memory for %d objects\n",
+		    job->nobjects);
+		exit(128);
+	}
+
+	pstream->state = job->nobjects ? PACK_STREAM_OBJHDR :
+	    PACK_STREAM_TRAILER;
+}
+
+/* Takes the header of the next object out of the stream's hdr */
+static void
+pack_stream_object(struct pack_stream *pstream, int n)
+{
+	struct pack_index_job *job = &pstream->job;
+	struct pack_index_object *object = &job->objects[pstream->obj];
+	off_t offset = pstream->offset - n;
+	uint64_t delta;
+	char hdr[32];
+	int hdrlen, used;
+
+	used = pack_parse_type_size(pstream->hdr, n, &object->ptype,
+	    &object->psize);
+	switch (object->ptype) {
+	case OBJ_COMMIT:
+	case OBJ_TREE:
+	case OBJ_BLOB:
+	case OBJ_TAG:
+		hdrlen = snprintf(hdr, sizeof(hdr), "%s %lu",
+		    object_name[object->ptype], object->psize) + 1;
+		SHA1_Init(&pstream->objctx);
+		SHA1_Update(&pstream->objctx, hdr, hdrlen);
+		break;
+	case OBJ_OFS_DELTA:
+		pack_parse_ofs(pstream->hdr + used, n - used, &delta);
+		if (delta == 0 || delta > offset) {
+			fprintf(stderr, "fatal: delta base offset is out of "
+			    "bound at offset %jd\n", (intmax_t)offset);
+			exit(128);
+		}
+		job->ofs[job->nofs].base = offset - delta;
+		job->ofs[job->nofs++].obj = pstream->obj;
+		break;
+	case OBJ_REF_DELTA:
+		memcpy(job->ref[job->nref].base, pstream->hdr + used, 20);
+		job->ref[job->nref++].obj = pstream->obj;
+		break;
+	default:
+		fprintf(stderr, "fatal: unknown object type %d at offset "
+		    "%jd\n", object->ptype, (intmax_t)offset);
+		exit(128);
+	}
+
+	object->data = pstream->offset;
+	object->hashed = false;
+	object->claimed = false;
+	job->index_entry[pstream->obj].offset = offset;
+	job->index_entry[pstream->obj].type = OBJ_OFS_DELTA;
+	pstream->crc = crc_update(0, pstream->hdr, n);
+	SHA1_Update(&pstream->packctx, pstream->hdr, n);
+
+	pstream->isize = 0;
+	if (inflateReset(&pstream->zst) != Z_OK) {
+		fprintf(stderr, "fatal: zlib reset failed\n");
+		exit(128);
+	}
+	pstream->state = PACK_STREAM_DATA;
+}
+
+/*
+ * Inflates the next bytes of the current object's data, returns how many
+ * of them were part of it.
+ */
+static size_t
+pack_stream_data(struct pack_stream *pstream, unsigned char *buf, size_t len)
+{
+	struct pack_index_object *object;
+	struct index_entry *entry;
+	bool whole;
+	size_t used;
+	int ret;
+
+	object = &pstream->job.objects[pstream->obj];
+	whole = object->ptype != OBJ_OFS_DELTA &&
+	    object->ptype != OBJ_REF_DELTA;
+
+	pstream->zst.next_in = buf;
+	pstream->zst.avail_in = len;
+	do {
+		pstream->zst.next_out = pstream->out;
+		pstream->zst.avail_out = sizeof(pstream->out);
+		ret = inflate(&pstream->zst, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+			fprintf(stderr, "fatal: inflate returned %d at offset "
+			    "%jd\n", ret, (intmax_t)object->data);
+			exit(128);
+		}
+		if (whole)
+			SHA1_Update(&pstream->objctx, pstream->out,
+			    sizeof(pstream->out) - pstream->zst.avail_out);
+		pstream->isize += sizeof(pstream->out) - pstream->zst.avail_out;
+	} while (ret != Z_STREAM_END && pstream->zst.avail_out == 0);
+
+	used = len - pstream->zst.avail_in;
+	pstream->crc = crc_update(pstream->crc, buf, used);
+	SHA1_Update(&pstream->packctx, buf, used);
+	pstream->offset += used;
+	if (ret != Z_STREAM_END)
+		return (used);
+
+	if (pstream->isize != object->psize) {
+		fprintf(stderr, "fatal: inflated size mismatch at offset %jd\n",
+		    (intmax_t)object->data);
+		exit(128);
+	}
+	entry = &pstream->job.index_entry[pstream->obj];
+	entry->crc = pstream->crc;
+	if (whole) {
+		SHA1_Final(entry->digest, &pstream->objctx);
+		entry->type = object->ptype;
+		object->hashed = true;
+	}
+
+	pstream->obj++;
+	pstream->state = pstream->obj < pstream->job.nobjects ?
+	    PACK_STREAM_OBJHDR : PACK_STREAM_TRAILER;
+	return (used);
+}
+
+/*
+ * Starts indexing a pack that is written to packfd as it is received,
+ * hand each chunk to pack_stream_write then finish with pack_stream_close.
+ */
+struct pack_stream *
+pack_stream_open(int packfd)
+{
+	struct pack_stream *pstream;
+
+	pstream = calloc(1, sizeof(struct pack_stream));
+	if (pstream == NULL) {
+		fprintf(stderr, "fatal: out of memory\n");
+		exit(128);
+	}
+	pstream->packfd = packfd;
+	pstream->state = PACK_STREAM_HEADER;
+	SHA1_Init(&pstream->packctx);
+	if (inflateInit(&pstream->zst) != Z_OK) {
+		fprintf(stderr, "fatal: zlib initialization failed\n");
+		exit(128);
+	}
+
+	return (pstream);
+}
+
+/* Writes the next len bytes of the pack and indexes what it can of them */
+void
+pack_stream_write(struct pack_stream *pstream, unsigned char *buf, size_t len)
+{
+	size_t used;
+	ssize_t w;
+	int n;
+
+	for (used = 0; used < len; used += w) {
+		w = write(pstream->packfd, buf + used, len - used);
+		if (w == -1) {
+			fprintf(stderr, "fatal: unable to write pack: %s\n",
+			    strerror(errno));
+			exit(128);
+		}
+	}
+
+	while (len > 0) {
+		switch (pstream->state) {
+		case PACK_STREAM_HEADER:
+			used = pack_stream_fill(pstream, buf, len, 12);
+			if (pstream->hdrlen == 12) {
+				pack_stream_start(pstream);
+				pstream->hdrlen = 0;
+			}
+			break;
+		case PACK_STREAM_TRAILER:
+			used = pack_stream_fill(pstream, buf, len, 20);
+			if (pstream->hdrlen == 20)
+				pstream->state = PACK_STREAM_DONE;
+			break;
+		case PACK_STREAM_OBJHDR:
+			/* Headers are short, take them a byte at a time */
+			pstream->hdr[pstream->hdrlen++] = *buf;
+			pstream->offset++;
+			used = 1;
+			n = pack_stream_header_len(pstream->hdr,
+			    pstream->hdrlen);
+			if (n > 0) {
+				pack_stream_object(pstream, n);
+				pstream->hdrlen = 0;
+			}
+			else if (pstream->hdrlen == sizeof(pstream->hdr)) {
+				fprintf(stderr, "fatal: bad object header at "
+				    "offset %jd\n", (intmax_t)pstream->offset);
+				exit(128);
+			}
+			break;
+		case PACK_STREAM_DATA:
+			used = pack_stream_data(pstream, buf, len);
+			break;
+		case PACK_STREAM_DONE:
+			fprintf(stderr, "fatal: pack has junk at the end\n");
+			exit(128);
+		}
+		buf += used;
+		len -= used;
+	}
+}
+
+/*
+ * Finishes indexing a received pack once all of it has been written,
+ * resolving its deltas with nthreads workers as pack_get_object_meta does.
+ * Fills in packfileinfo, including the pack's SHA, and hands back the
+ * unsorted index_entry of every object, which the caller frees.
+ * Returns the number of unresolved deltas, see pack_get_object_meta.
+ */
+int
+pack_stream_close(struct pack_stream *pstream, struct packfileinfo *packfileinfo,
+    struct index_entry **index_entry, int nthreads)
+{
+	struct packfile packfile;
+	int unresolved;
+
+	if (pstream->state != PACK_STREAM_DONE) {
+		fprintf(stderr, "fatal: early EOF\n");
+		exit(128);
+	}
+	inflateEnd(&pstream->zst);
+
+	SHA1_Final(pstream->packfileinfo.sha, &pstream->packctx);
+	if (memcmp(pstream->packfileinfo.sha, pstream->hdr, 20)) {
+		fprintf(stderr, "fatal: pack is corrupted (SHA1 mismatch)\n");
+		exit(128);
+	}
+
+	bzero(&packfile, sizeof(struct packfile));
+	packfile.packfd = pstream->packfd;
+	packfile.packsize = pstream->offset;
+	pstream->job.packfile = &packfile;
+	unresolved = pack_index_resolve(&pstream->job, nthreads);
+	pack_window_release(&packfile);
+
+	*packfileinfo = pstream->packfileinfo;
+	*index_entry = pstream->job.index_entry;
+	free(pstream);
+
+	return (unresolved);
+}
+
+static int
+pack_sha_cmp(const void *a, const void *b)
+{
+	return (memcmp(a, b, 20));
+}
+
+/*
+ * Reads a whole object from the local object store, loose or packed.
+ * Returns 0 and fills in type and object, or 1 if the object is not found.
+ */
+static int
+pack_read_local_object(unsigned char *sha, int *type,
+    struct decompressed_object *object)
+{
+	struct packfile *packfile;
+	struct objectinfo objectinfo;
+	off_t offset;
+
+	object->data = NULL;
+	object->size = 0;
+	object->deflated_size = 0;
+
+	if (loose_read(sha, type, object) == 0)
+		return (0);
+
+	packfile = pack_registry_lookup(sha, &offset);
+	if (packfile == NULL)
+		return (1);
+
+	bzero(&objectinfo, sizeof(struct objectinfo));
+	if (pack_object_header(packfile, offset, &objectinfo, NULL)) {
+		free(objectinfo.deltas);
+		return (1);
+	}
+	pack_buffer_cb(packfile, &objectinfo, object);
+	*type = objectinfo.ftype;
+
+	return (0);
+}
+
+/*
+ * Appends the objects bases, read from the local object store, as whole
+ * objects to a pack of nobjects objects whose trailer starts at end. The
+ * object count in the header and the trailing SHA are rewritten.
+ */
+static void
+pack_fix_thin_append(int packfd, struct packfileinfo *packfileinfo,
+    uint32_t nobjects, unsigned char (*bases)[20], int nbases, off_t end)
+{
+	struct decompressed_object object;
+	unsigned char hdr[16], buf[CHUNK];
+	unsigned char *zbuf;
+	char shastr[HASH_SIZE+1];
+	uLongf zlen;
+	unsigned long size;
+	int type, hdrlen, n;
+	SHA1_CTX packctx;
+	ssize_t r;
+
+	for (n = 0; n < nbases; n++) {
+		if (pack_read_local_object(bases[n], &type, &object)) {
+			sha_bin_to_str(bases[n], shastr);
+			shastr[HASH_SIZE] = '\0';
+			fprintf(stderr, "fatal: pack has unresolved delta base "
+			    "%s, which is not in the local repository\n",
+			    shastr);
+			exit(128);
+		}
+
+		size = object.size;
+		hdr[0] = (type << 4) | (size & 15);
+		size >>= 4;
+		for (hdrlen = 1; size; hdrlen++) {
+			hdr[hdrlen-1] |= 0x80;
+			hdr[hdrlen] = size & 0x7f;
+			size >>= 7;
+		}
+
+		zlen = compressBound(object.size);
+		zbuf = malloc(zlen);
+		if (compress2(zbuf, &zlen, object.data, object.size,
+		    Z_DEFAULT_COMPRESSION) != Z_OK) {
+			fprintf(stderr, "fatal: unable to deflate appended object\n");
+			exit(128);
+		}
+
+		lseek(packfd, end, SEEK_SET);
+		write(packfd, hdr, hdrlen);
+		write(packfd, zbuf, zlen);
+		end += hdrlen + zlen;
+
+		free(zbuf);
+		free(object.data);
+	}
+
+	if (ftruncate(packfd, end) == -1) {
+		fprintf(stderr, "fatal: unable to truncate packfile\n");
+		exit(128);
+	}
+
+	nobjects = htonl(nobjects + nbases);
+	lseek(packfd, 8, SEEK_SET);
+	write(packfd, &nobjects, 4);
+
+	/* The whole pack has to be hashed again for the trailer */
+	SHA1_Init(&packctx);
+	lseek(packfd, 0, SEEK_SET);
+	while ((r = read(packfd, buf, sizeof(buf))) > 0)
+		SHA1_Update(&packctx, buf, r);
+	SHA1_Final(packfileinfo->sha, &packctx);
+	write(packfd, packfileinfo->sha, 20);
+}
+
+/*
+ * Completes a thin pack by appending the delta bases it is missing, read
+ * from the local object store, as whole objects. The arguments are those
+ * of the pack_get_object_meta call that returned nunresolved, nthreads is
+ * passed on to it. Returns the number of objects appended, after which the
+ * pack must be indexed again.
+ *
+ * The base of an unresolved OBJ_REF_DELTA may itself be an unresolved
+ * delta in the pack, whose SHA is not known until its own base is there.
+ * So when there is more than one candidate, the pack is first resolved in
+ * memory against all of them, and only those no object of the pack turns
+ * out to produce are appended.
+ */
+int
+pack_fix_thin(int packfd, struct packfileinfo *packfileinfo,
+    struct index_entry *index_entry, int nunresolved, int nthreads)
+{
+	unsigned char (*bases)[20], (*inpack)[20];
+	struct packfileinfo trialinfo;
+	struct index_entry *trial;
+	uint32_t nobjects;
+	int nbases, nrefs, x, n;
+	struct stat sb;
+	SHA1_CTX packctx;
+
+	/* Collect each candidate base once */
+	nrefs = 0;
+	for (x = 0; x < packfileinfo->nobjects; x++)
+		if (index_entry[x].type == OBJ_REF_DELTA)
+			nrefs++;
+	bases = malloc(20 * (nrefs + 1));
+	nbases = 0;
+	for (x = 0; x < packfileinfo->nobjects; x++)
+		if (index_entry[x].type == OBJ_REF_DELTA)
+			memcpy(bases[nbases++], index_entry[x].digest, 20);
+	qsort(bases, nbases, 20, pack_sha_cmp);
+	for (x = 1, n = 1; x < nbases; x++)
+		if (memcmp(bases[x], bases[n-1], 20))
+			memcpy(bases[n++], bases[x], 20);
+	if (nbases > 0)
+		nbases = n;
+	nobjects = packfileinfo->nobjects;
+
+	if (nbases > 1) {
+		SHA1_Init(&packctx);
+		lseek(packfd, 0, SEEK_SET);
+		pack_parse_header(packfd, &trialinfo, &packctx);
+		trial = malloc(sizeof(struct index_entry) * (nobjects + nbases));
+		if (pack_index_file(packfd, 12, &trialinfo, trial, &packctx,
+		    nthreads, bases, nbases) > 0) {
+			fprintf(stderr, "fatal: pack has unresolved deltas "
+			    "after completing it\n");
+			exit(128);
+		}
+
+		/* Drop the candidates that an object of the pack produces */
+		inpack = malloc(20 * nobjects);
+		for (x = 0; x < nobjects; x++)
+			memcpy(inpack[x], trial[x].digest, 20);
+		qsort(inpack, nobjects, 20, pack_sha_cmp);
+		for (x = 0, n = 0; x < nbases; x++)
+			if (bsearch(bases[x], inpack, nobjects, 20,
+			    pack_sha_cmp) == NULL)
+				memcpy(bases[n++], bases[x], 20);
+		nbases = n;
+		free(inpack);
+		free(trial);
+	}
+
+	if (fstat(packfd, &sb) == -1) {
+		fprintf(stderr, "fatal: cannot stat packfile\n");
+		exit(128);
+	}
+	/* The new objects overwrite the old trailer */
+	pack_fix_thin_append(packfd, packfileinfo, nobjects, bases, nbases,
+	    sb.st_size - 20);
+	free(bases);
+
+	packfileinfo->nobjects += nbases;
+
+	return (nbases);
+}
+
+/*
+ * Writes the header of the index file.
+ */
+inline void
+write_index_header(int idxfd, SHA1_CTX *idxctx)
+{
+	sha_write(idxfd, "\377tOc", 4, idxctx);
+	sha_write(idxfd, "\x00\x00\x00\x02", 4, idxctx);
+}
+
+inline void
+write_hash_count(int idxfd, struct packfileinfo *packfileinfo,
+    struct index_entry *index_entry, SHA1_CTX *idxctx)
+{
+	int hashnum;
+	int reversed;
+	int x;
+
+	hashnum = 0;
+
+	for (x=0;x<256;x++) {
+		while (hashnum < packfileinfo->nobjects &&
+		    index_entry[hashnum].digest[0] == x)
+			hashnum++;
+		reversed = htonl(hashnum);
+		sha_write(idxfd, &reversed, 4, idxctx);
+	}
+}
+
+inline void
+write_hashes(int idxfd, struct packfileinfo *packfileinfo,
+    struct index_entry *index_entry, SHA1_CTX *idxctx)
+{
+	int x;
+
+	for (x=0;x<packfileinfo->nobjects; x++)
+		sha_write(idxfd, index_entry[x].digest, 20, idxctx);
+}
+
+inline void
+write_crc_table(int idxfd, struct packfileinfo *packfileinfo,
+    struct index_entry *index_entry, SHA1_CTX *idxctx)
+{
+	uint32_t crc32tmp;
+	int x;
+
+	for (x=0;x<packfileinfo->nobjects;x++) {
+		crc32tmp = htonl(index_entry[x].crc);
+		sha_write(idxfd, &crc32tmp, 4, idxctx);
+	}
+}
+
+/*
+ * Writes the 32-bit offset table. Offsets that do not fit in 31 bits are
+ * written as PACK_LARGE_OFFSET and their index in the 64-bit table.
+ * Returns the number of such offsets.
+ */
+inline int
+write_32bit_table(int idxfd, struct packfileinfo *packfileinfo,
+    struct index_entry *index_entry, SHA1_CTX *idxctx)
+{
+	uint32_t offsettmp;
+	int nlarge;
+	int x;
+
+	nlarge = 0;
+	for (x = 0; x < packfileinfo->nobjects; x++) {
+		if (index_entry[x].offset > 0x7fffffff)
+			offsettmp = htonl(PACK_LARGE_OFFSET | nlarge++);
+		else
+			offsettmp = htonl(index_entry[x].offset);
+		sha_write(idxfd, &offsettmp, 4, idxctx);
+	}
+
+	return (nlarge);
+}
+
+/* Writes the 64-bit offset table, in the same order as the references */
+inline void
+write_64bit_table(int idxfd, struct packfileinfo *packfileinfo,
+    struct index_entry *index_entry, SHA1_CTX *idxctx)
+{
+	struct large_offset large;
+	int x;
+
+	for (x = 0; x < packfileinfo->nobjects; x++) {
+		if (index_entry[x].offset <= 0x7fffffff)
+			continue;
+		large.hi = htonl((uint64_t)index_entry[x].offset >> 32);
+		large.lo = htonl(index_entry[x].offset & 0xffffffff);
+		sha_write(idxfd, &large, sizeof(struct large_offset), idxctx);
+	}
+}
+
+inline void
+write_checksums(int idxfd, struct packfileinfo *packfileinfo, SHA1_CTX *idxctx)
+{
+	sha_write(idxfd, packfileinfo->sha, 20, idxctx);
+	SHA1_Final(packfileinfo->ctx, idxctx);
+	sha_write(idxfd, packfileinfo->ctx, 20, idxctx);
+}
+
+struct rev_entry {
+	off_t		offset;
+	uint32_t	pos;
+};
+
+static int
+sortreventry(const void *a, const void *b)
+{
+	const struct rev_entry *x = a;
+	const struct rev_entry *y = b;
+	return (x->offset < y->offset ? -1 : x->offset > y->offset);
+}
+
+/*
+ * Writes the reverse index, the idx position of each object in the order
+ * the objects appear in the pack, then the pack and .rev checksums.
+ * index_entry must already be sorted by digest.
+ */
+void
+write_rev_index(int revfd, struct packfileinfo *packfileinfo,
+    struct index_entry *index_entry)
+{
+	struct rev_entry *rev;
+	uint32_t *positions;
+	uint32_t hdr[3];
+	unsigned char digest[20];
+	SHA1_CTX revctx;
+	int x;
+
+	rev = malloc(sizeof(struct rev_entry) * packfileinfo->nobjects);
+	for (x = 0; x < packfileinfo->nobjects; x++) {
+		rev[x].offset = index_entry[x].offset;
+		rev[x].pos = x;
+	}
+	qsort(rev, packfileinfo->nobjects, sizeof(struct rev_entry),
+	    sortreventry);
+
+	positions = malloc(sizeof(uint32_t) * packfileinfo->nobjects);
+	for (x = 0; x < packfileinfo->nobjects; x++)
+		positions[x] = htonl(rev[x].pos);
+	free(rev);
+
+	SHA1_Init(&revctx);
+	hdr[0] = htonl(PACK_REV_SIGNATURE);
+	hdr[1] = htonl(PACK_REV_VERSION);
+	hdr[2] = htonl(PACK_REV_HASH_SHA1);
+	sha_write(revfd, hdr, PACK_REV_HEADER_SIZE, &revctx);
+	sha_write(revfd, positions, sizeof(uint32_t) * packfileinfo->nobjects,
+	    &revctx);
+	sha_write(revfd, packfileinfo->sha, 20, &revctx);
+	SHA1_Final(digest, &revctx);
+	write(revfd, digest, 20);
+
+	free(positions);
+}
+
+/*
+ * Builds the idx file, combines the functions above. The reverse index is
+ * also written unless revfd is -1.
+ */
+void
+pack_build_index(int idxfd, int revfd, struct packfileinfo *packfileinfo,
+    struct index_entry *index_entry, SHA1_CTX *idxctx)
+{
+	/* Write pack header */
+	write_index_header(idxfd, idxctx);
+	/* Writing hash count */
+	write_hash_count(idxfd, packfileinfo, index_entry, idxctx);
+	/* Writing hashes */
+	write_hashes(idxfd, packfileinfo, index_entry, idxctx);
+	/* Write the crc32 table */
+	write_crc_table(idxfd, packfileinfo, index_entry, idxctx);
+	/* Write the 32-bit offset table */
+	if (write_32bit_table(idxfd, packfileinfo, index_entry, idxctx) > 0)
+		/* Write the 64-bit offset table for packs over 2 GiB */
+		write_64bit_table(idxfd, packfileinfo, index_entry, idxctx);
+	/* Write the SHA1 checksum of the corresponding packfile */
+	write_checksums(idxfd, packfileinfo, idxctx);
+
+	if (revfd != -1)
+		write_rev_index(revfd, packfileinfo, index_entry);
+}
+
+/*
+ * The delta base cache holds reconstructed objects from delta chains, keyed
+ * by their pack and the offset of their data. When pack_delta_content walks
+ * a chain it starts from the cached object closest to the target rather
+ * than re-inflating the whole chain from its base. The cache is bounded by
+ * core.deltaBaseCacheLimit bytes and evicts the least recently used entries.
+ */
+struct delta_cache_entry {
+	struct packfile		*packfile;
+	off_t			 offset;
+	unsigned char		*data;
+	unsigned long		 size;
+
+	struct delta_cache_entry *hash_next;
+	struct delta_cache_entry *lru_prev;
+	struct delta_cache_entry *lru_next;
+};
+
+#define DELTA_CACHE_BUCKETS	1024
+
+static struct delta_cache_entry *delta_cache[DELTA_CACHE_BUCKETS];
+static struct delta_cache_entry *delta_cache_lru_head = NULL;
+static struct delta_cache_entry *delta_cache_lru_tail = NULL;
+static struct delta_cache_stats delta_cache_stats;
+static long delta_cache_limit = -1;
+static long pack_window_size;
+static long pack_window_limit;
+
+/* Guards the delta cache and the pack windows, shared by index-pack workers */
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned int
+delta_cache_hash(struct packfile *packfile, off_t offset)
+{
+	uintptr_t h = (uintptr_t)packfile ^ (uintptr_t)(offset * 2654435761u);
+	return ((h ^ (h >> 16)) % DELTA_CACHE_BUCKETS);
+}
+
+/*
+ * Reads core.deltaBaseCacheLimit, core.packedGitWindowSize and
+ * core.packedGitLimit the first time one of them is needed. The config
+ * may not have been parsed, in which case the defaults are kept.
+ */
+static void
+pack_config_load()
+{
+	struct section *section;
+	long pagesize;
+
+	if (delta_cache_limit != -1)
+		return;
+
+	delta_cache_limit = DELTA_CACHE_LIMIT;
+	pack_window_size = PACK_WINDOW_SIZE;
+	pack_window_limit = PACK_WINDOW_LIMIT;
+	for (section = sections; section; section = section->next) {
+		if (section->type != CORE)
+			continue;
+		if (section->deltabasecachelimit > 0)
+			delta_cache_limit = section->deltabasecachelimit;
+		if (section->packedgitwindowsize > 0)
+			pack_window_size = section->packedgitwindowsize;
+		if (section->packedgitlimit > 0)
+			pack_window_limit = section->packedgitlimit;
+	}
+
+	/* Windows are page aligned and span at least two pages */
+	pagesize = sysconf(_SC_PAGESIZE);
+	pack_window_size -= pack_window_size % pagesize;
+	if (pack_window_size < 2 * pagesize)
+		pack_window_size = 2 * pagesize;
+}
+
+/* The limit comes from core.deltaBaseCacheLimit if it has been parsed */
+static long
+delta_cache_get_limit()
+{
+	pack_config_load();
+	return (delta_cache_limit);
+}
+
+/* Unlinks an entry from both the hash chain and the LRU list */
+static void
+delta_cache_unlink(struct delta_cache_entry *entry)
+{
+	struct delta_cache_entry **bucket;
+
+	bucket = &delta_cache[delta_cache_hash(entry->packfile, entry->offset)];
+	while (*bucket != entry)
+		bucket = &(*bucket)->hash_next;
+	*bucket = entry->hash_next;
+
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		delta_cache_lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		delta_cache_lru_tail = entry->lru_prev;
+
+	delta_cache_stats.bytes -= entry->size;
+}
+
+/*
+ * Removes the object from the cache and hands its buffer to the caller.
+ * Returns 0 on a hit, otherwise 1 and decompressed_object is untouched.
+ */
+static int
+delta_cache_take(struct packfile *packfile, off_t offset,
+    struct decompressed_object *decompressed_object)
+{
+	struct delta_cache_entry *entry;
+
+	pthread_mutex_lock(&pack_lock);
+	entry = delta_cache[delta_cache_hash(packfile, offset)];
+	for (; entry; entry = entry->hash_next)
+		if (entry->packfile == packfile && entry->offset == offset)
+			break;
+	if (entry == NULL) {
+		pthread_mutex_unlock(&pack_lock);
+		return (1);
+	}
+
+	delta_cache_unlink(entry);
+	pthread_mutex_unlock(&pack_lock);
+	decompressed_object->data = entry->data;
+	decompressed_object->size = entry->size;
+	free(entry);
+
+	return (0);
+}
+
+/*
+ * Stores the object in the cache, which takes ownership of the buffer.
+ * Objects that would not fit are freed immediately.
+ */
+static void
+delta_cache_add(struct packfile *packfile, off_t offset,
+    struct decompressed_object *decompressed_object)
+{
+	struct delta_cache_entry *entry;
+	struct delta_cache_entry **bucket;
+	long limit;
+
+	pthread_mutex_lock(&pack_lock);
+	limit = delta_cache_get_limit();
+	if (decompressed_object->size > limit) {
+		pthread_mutex_unlock(&pack_lock);
+		free(decompressed_object->data);
+		return;
+	}
+
+	while (delta_cache_lru_tail &&
+	    delta_cache_stats.bytes + decompressed_object->size > limit) {
+		entry = delta_cache_lru_tail;
+		delta_cache_unlink(entry);
+		free(entry->data);
+		free(entry);
+		delta_cache_stats.evictions++;
+	}
+
+	entry = malloc(sizeof(struct delta_cache_entry));
+	entry->packfile = packfile;
+	entry->offset = offset;
+	entry->data = decompressed_object->data;
+	entry->size = decompressed_object->size;
+
+	bucket = &delta_cache[delta_cache_hash(packfile, offset)];
+	entry->hash_next = *bucket;
+	*bucket = entry;
+
+	entry->lru_prev = NULL;
+	entry->lru_next = delta_cache_lru_head;
+	if (delta_cache_lru_head)
+		delta_cache_lru_head->lru_prev = entry;
+	delta_cache_lru_head = entry;
+	if (delta_cache_lru_tail == NULL)
+		delta_cache_lru_tail = entry;
+
+	delta_cache_stats.bytes += entry->size;
+	pthread_mutex_unlock(&pack_lock);
+}
+
+/* Drops every cached object of a pack, used before the pack goes away */
+void
+pack_delta_cache_release(struct packfile *packfile)
+{
+	struct delta_cache_entry *entry, *next;
+
+	pthread_mutex_lock(&pack_lock);
+	for (entry = delta_cache_lru_head; entry; entry = next) {
+		next = entry->lru_next;
+		if (entry->packfile != packfile)
+			continue;
+		delta_cache_unlink(entry);
+		free(entry->data);
+		free(entry);
+	}
+	pthread_mutex_unlock(&pack_lock);
+}
+
+void
+pack_delta_cache_get_stats(struct delta_cache_stats *stats)
+{
+	pthread_mutex_lock(&pack_lock);
+	*stats = delta_cache_stats;
+	pthread_mutex_unlock(&pack_lock);
+}
+
+/*
+ * A delta as a list of copy and insert operations. Chains are composed into
+ * a single delta against the chain's start, so a deep chain is applied in
+ * one pass instead of materializing every intermediate object.
+ */
+struct delta_op {
+	unsigned char	*data;		// Insert data, NULL for a copy
+	unsigned long	 offset;	// Copy offset in the source object
+	unsigned long	 len;
+	unsigned long	 dstoff;	// Offset in the delta's output
+};
+
+struct delta_ops {
+	struct delta_op	*ops;
+	int		 nops;
+	int		 maxops;
+	unsigned long	 srcsize;
+	unsigned long	 dstsize;
+};
+
+/* Appends an operation, merging it into the last one when contiguous */
+static void
+delta_ops_emit(struct delta_ops *d, unsigned char *data,
+    unsigned long offset, unsigned long len)
+{
+	struct delta_op *last;
+
+	if (d->nops > 0) {
+		last = &d->ops[d->nops - 1];
+		if ((data == NULL && last->data == NULL &&
+		    last->offset + last->len == offset) ||
+		    (data != NULL && last->data != NULL &&
+		    last->data + last->len == data)) {
+			last->len += len;
+			d->dstsize += len;
+			return;
+		}
+	}
+
+	if (d->nops == d->maxops) {
+		d->maxops = d->maxops ? d->maxops * 2 : 64;
+		d->ops = realloc(d->ops, sizeof(struct delta_op) * d->maxops);
+	}
+	d->ops[d->nops].data = data;
+	d->ops[d->nops].offset = offset;
+	d->ops[d->nops].len = len;
+	d->ops[d->nops].dstoff = d->dstsize;
+	d->nops++;
+	d->dstsize += len;
+}
+
+/* Decodes a delta into d, insert operations point into delta->data */
+static void
+delta_ops_parse(struct decompressed_object *delta, struct delta_ops *d)
+{
+	unsigned char *data, *top;
+	unsigned char opcode;
+	unsigned long cp_off, cp_size;
+	unsigned long size;
+
+	data = delta->data;
+	top = delta->data + delta->size;
+
+	bzero(d, sizeof(struct delta_ops));
+	d->srcsize = readvint(&data, top);
+	size = readvint(&data, top);
+
+	while (data < top) {
+		opcode = *data++;
+		if (opcode & BIT(7)) {
+			cp_off = 0;
+			cp_size = 0;
+
+			/* Offset in base */
+			if (opcode & BIT(0))
+				cp_off |= delta_ops_byte(&data, top) << 0;
+			if (opcode & BIT(1))
+				cp_off |= delta_ops_byte(&data, top) << 8;
+			if (opcode & BIT(2))
+				cp_off |= delta_ops_byte(&data, top) << 16;
+			if (opcode & BIT(3))
+				cp_off |= delta_ops_byte(&data, top) << 24;
+
+			/* Length to copy */
+			if (opcode & BIT(4))
+				cp_size |= delta_ops_byte(&data, top) << 0;
+			if (opcode & BIT(5))
+				cp_size |= delta_ops_byte(&data, top) << 8;
+			if (opcode & BIT(6))
+				cp_size |= delta_ops_byte(&data, top) << 16;
+
+			if (cp_size == 0)
+				cp_size = 0x10000;
+
+			if (cp_off + cp_size > d->srcsize) {
+				fprintf(stderr, "Bad length: First\n");
+				exit(0);
+			}
+			delta_ops_emit(d, NULL, cp_off, cp_size);
+		} else if (opcode) {
+			if (data + opcode > top) {
+				fprintf(stderr, "Bad length: Insert\n");
+				exit(0);
+			}
+			delta_ops_emit(d, data, 0, opcode);
+			data += opcode;
+		} else {
+			fprintf(stderr, "Unexpected opcode 0x00, exiting.\n");
+			exit(0);
+		}
+	}
+
+	if (d->dstsize != size) {
+		fprintf(stderr, "Error, bad delta result size\n");
+		exit(0);
+	}
+}
+
+/*
+ * Composes upper, a delta against the output of lower, with lower. Each
+ * copy from lower's output is replaced by the lower operations that
+ * produced that range, so the result is a delta against lower's source.
+ */
+static void
+delta_ops_compose(struct delta_ops *upper, struct delta_ops *lower,
+    struct delta_ops *out)
+{
+	struct delta_op *u, *l;
+	unsigned long pos, end, skip, len;
+	int lo, hi, mid;
+	int n;
+
+	if (upper->srcsize != lower->dstsize) {
+		fprintf(stderr, "Error, bad original set\n");
+		exit(0);
+	}
+
+	bzero(out, sizeof(struct delta_ops));
+	out->srcsize = lower->srcsize;
+
+	for (n = 0; n < upper->nops; n++) {
+		u = &upper->ops[n];
+		if (u->data) {
+			delta_ops_emit(out, u->data, 0, u->len);
+			continue;
+		}
+
+		/* Find the lower operation that produced u->offset */
+		lo = 0;
+		hi = lower->nops - 1;
+		while (lo < hi) {
+			mid = lo + (hi - lo + 1) / 2;
+			if (lower->ops[mid].dstoff <= u->offset)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+
+		pos = u->offset;
+		end = u->offset + u->len;
+		for (l = &lower->ops[lo]; pos < end; l++) {
+			skip = pos - l->dstoff;
+			len = l->len - skip;
+			if (len > end - pos)
+				len = end - pos;
+			if (l->data)
+				delta_ops_emit(out, l->data + skip, 0, len);
+			else
+				delta_ops_emit(out, NULL, l->offset + skip, len);
+			pos += len;
+		}
+	}
+}
+
+/* Applies a composed delta to base in a single pass */
+static void
+delta_ops_apply(struct delta_ops *d, struct decompressed_object *base,
+    struct objectinfo *objectinfo)
+{
+	struct delta_op *op;
+	unsigned char *out;
+	int n;
+
+	if (d->srcsize != base->size) {
+		fprintf(stderr, "Error, bad original set\n");
+		exit(0);
+	}
+
+	objectinfo->data = malloc(d->dstsize);
+	objectinfo->isize = d->dstsize;
+	out = objectinfo->data;
+
+	for (n = 0; n < d->nops; n++) {
+		op = &d->ops[n];
+		if (op->data)
+			memcpy(out, op->data, op->len);
+		else
+			memcpy(out, base->data + op->offset, op->len);
+		out += op->len;
+	}
+}
+
+/*
+ * This function reassembles an OBJ_OFS_DELTA or OBJ_REF_DELTA object. It
+ * requires that the objectinfo variable has already passed through
+ * pack_object_header. It starts from the base object, or the cached object
+ * closest to the target. The remaining deltas are inflated and, if there
+ * is more than one, composed into a single delta against that object, which
+ * is then applied once. The starting object goes back to the delta base
+ * cache afterwards.
+ */
+void
+pack_delta_content(struct packfile *packfile, struct objectinfo *objectinfo)
+{
+	struct decompressed_object base_object;
+	struct decompressed_object *delta_objects;
+	struct delta_ops composed, lower, next;
+	off_t level_offset;
+	int q, start;
+
+	base_object.data = NULL;
+	base_object.size = 0;
+	base_object.deflated_size = 0;
+
+	/*
+	 * Level q is the object produced by applying delta q, the base is
+	 * level ndeltas. Each target is cached at level 0, so a later chain
+	 * through it resumes there instead of at the base.
+	 */
+	for (q = 1; q < objectinfo->ndeltas; q++)
+		if (delta_cache_take(packfile, objectinfo->deltas[q].offset,
+		    &base_object) == 0)
+			break;
+
+	if (q < objectinfo->ndeltas ||
+	    delta_cache_take(packfile, objectinfo->ofsbase, &base_object) == 0) {
+		pthread_mutex_lock(&pack_lock);
+		delta_cache_stats.hits++;
+		pthread_mutex_unlock(&pack_lock);
+	}
+	else {
+		pthread_mutex_lock(&pack_lock);
+		delta_cache_stats.misses++;
+		pthread_mutex_unlock(&pack_lock);
+		pack_inflate_whole(packfile, objectinfo->ofsbase,
+		    objectinfo->basesize, &base_object);
+	}
+
+	start = q;
+	level_offset = (start == objectinfo->ndeltas) ?
+	    objectinfo->ofsbase : objectinfo->deltas[start].offset;
+
+	delta_objects = calloc(start, sizeof(struct decompressed_object));
+	for (q = 0; q < start; q++)
+		pack_inflate_whole(packfile, objectinfo->deltas[q].offset,
+		    objectinfo->deltas[q].size, &delta_objects[q]);
+
+	if (start == 1)
+		applypatch(&base_object, &delta_objects[0], objectinfo);
 	else {
-		/* We have to dig deeper */
-		unsigned long delta;
-		unsigned long ofshdrsize = 1;
-		struct objectinfo childinfo;
+		/* Fold the deltas from the target down to the start */
+		delta_ops_parse(&delta_objects[0], &composed);
+		for (q = 1; q < start; q++) {
+			delta_ops_parse(&delta_objects[q], &lower);
+			delta_ops_compose(&composed, &lower, &next);
+			free(composed.ops);
+			free(lower.ops);
+			composed = next;
+		}
+		delta_ops_apply(&composed, &base_object, objectinfo);
+		free(composed.ops);
+	}
+
+	/*
+	 * This instance of deflated_size is the 0th in the list which
+	 * means it is the deflated_size of the current delta,
+	 * not of the parent deltas.
+	 */
+	objectinfo->deflated_size = delta_objects[0].deflated_size;
+
+	for (q = 0; q < start; q++)
+		free(delta_objects[q].data);
+	free(delta_objects);
+
+	delta_cache_add(packfile, level_offset, &base_object);
+
+	/* The caller owns objectinfo->data, the cache gets a copy */
+	if (objectinfo->isize <= delta_cache_get_limit()) {
+		base_object.data = malloc(objectinfo->isize);
+		memcpy(base_object.data, objectinfo->data, objectinfo->isize);
+		base_object.size = objectinfo->isize;
+		delta_cache_add(packfile, objectinfo->deltas[0].offset,
+		    &base_object);
+	}
+}
+
+int
+pack_parse_header(int packfd, struct packfileinfo *packfileinfo, SHA1_CTX *packctx)
+{
+	int version;
+	int nobjects;
+	unsigned char buf[4];
+
+	buf_read(packfd, buf, 4, read_sha_update, packctx);
+
+	if (memcmp(buf, "PACK", 4)) {
+		fprintf(stderr, "error: bad object header. Git repository may be corrupt.\n");
+		exit(128);
+	}
+
+	buf_read(packfd, &version, 4, read_sha_update, packctx);
+	packfileinfo->version = ntohl(version);
+	if (packfileinfo->version != 2) {
+		fprintf(stderr, "error: unsupported version: %d\n", version);
+		exit(128);
+	}
+
+	buf_read(packfd, &nobjects, 4, read_sha_update, packctx);
+	packfileinfo->nobjects = ntohl(nobjects);
+
+	/* This hardcoded value is because we read 4*3 bytes from the header */
+	return (12);
+}
+
+/*
+ * The function pack_object_header checks the object type of the current object.
+ * If the type is not deltified, it will immediately return and the variable
+ * objectinfo will contain the type as objectinfo->ftype. Additionally, we will
+ * have the objectinfo->isize.
+ *
+ * If the object is deltified, it will walk back through the chain of
+ * OBJ_OFS_DELTA headers to locate the following values:
+ * A. The base object type, stored in objectinto->ftype
+ * B. The base offset and size, stored in objectinfo->ofsbase and basesize
+ * C. All delta offsets and sizes, stored in objectinfo->deltas
+ * D. Number of deltas, stored in objectinfo->ndelta
+ * Note: The objectinfo->isize value is NOT captured
+ *
+ * If the application needs the objectinfo->isize or objectinfo->data, it must
+ * run pack_delta_content. This function will consumed values B-D to produce
+ * the final non-deltified data.
+ *
+ * The headers are parsed in place from the pack's mapped windows.
+ */
+
+/*
+ * Parses the type and size varint of the header at hdr. Returns the number
+ * of bytes used, which is never more than left.
+ */
+static unsigned long
+pack_parse_type_size(unsigned char *hdr, size_t left,
+    unsigned int *type, unsigned long *size)
+{
+	unsigned long used = 1;
+	unsigned shift;
+	uint8_t c;
+
+	c = hdr[0];
+	*type = (c >> 4) & 7;
+	*size = c & 15;
+	shift = 4;
+
+	while (c & 0x80) {
+		if (used == left) {
+			fprintf(stderr, "fatal: bad object header\n");
+			exit(128);
+		}
+		c = hdr[used++];
+		*size += (unsigned long)(c & 0x7f) << shift;
+		shift += 7;
+	}
+
+	return (used);
+}
+
+/* Parses the negative offset that follows an OBJ_OFS_DELTA header */
+static unsigned long
+pack_parse_ofs(unsigned char *hdr, size_t left, uint64_t *delta)
+{
+	unsigned long used = 1;
+	uint8_t c;
+
+	c = hdr[0];
+	*delta = c & 0x7f;
+	while (c & 0x80) {
+		if (used == left) {
+			fprintf(stderr, "fatal: bad delta base offset\n");
+			exit(128);
+		}
+		c = hdr[used++];
+		*delta = ((*delta + 1) << 7) + (c & 0x7f);
+	}
+
+	return (used);
+}
+
+/*
+ * Finds the offset of an OBJ_REF_DELTA base in the same pack through its
+ * idx. Returns -1 if the base is not in the pack.
+ */
+static off_t
+pack_find_ref_base(struct packfile *packfile, unsigned char *sha)
+{
+	if (packfile->idxmap == NULL)
+		return (-1);
+
+	return (pack_find_sha_offset(sha, packfile->idxmap));
+}
+
+/*
+ * Returns 0 on success. If an OBJ_REF_DELTA base in the chain is not in the
+ * pack, objectinfo->refbase is set to its SHA and -1 is returned; the
+ * object's own header has still been parsed and checksummed.
+ */
+int
+pack_object_header(struct packfile *packfile, off_t offset,
+    struct objectinfo *objectinfo, SHA1_CTX *packctx)
+{
+	struct pack_window *window = NULL;
+	unsigned char *hdr, *ref;
+	size_t left;
+	off_t base, found;
+	uint64_t delta = 0;
+	unsigned long used, size;
+	unsigned int type;
+	int ndeltas, maxdeltas;
+
+	hdr = pack_window_use(packfile, &window, offset, &left);
+
+	objectinfo->offset = offset;
+	objectinfo->used = pack_parse_type_size(hdr, left, &objectinfo->ptype,
+	    &objectinfo->psize);
+	objectinfo->ofshdrsize = 0;
+	objectinfo->deltas = NULL;
+	objectinfo->ndeltas = 0;
+
+	if (objectinfo->ptype == OBJ_OFS_DELTA) {
+		objectinfo->ofshdrsize = pack_parse_ofs(hdr + objectinfo->used,
+		    left - objectinfo->used, &delta);
+	}
+
+	/* The crc32 and pack SHA cover the whole header at once */
+	objectinfo->crc = crc_update(objectinfo->crc, hdr,
+	    objectinfo->used + objectinfo->ofshdrsize);
+	if (packctx)
+		SHA1_Update(packctx, hdr,
+		    objectinfo->used + objectinfo->ofshdrsize);
+
+	/* The base SHA may start in the next window */
+	if (objectinfo->ptype == OBJ_REF_DELTA) {
+		ref = pack_window_use(packfile, &window,
+		    offset + objectinfo->used, &left);
+		objectinfo->ofshdrsize = 20;
+		objectinfo->crc = crc_update(objectinfo->crc, ref, 20);
+		if (packctx)
+			SHA1_Update(packctx, ref, 20);
+	}
+
+	if (objectinfo->ptype != OBJ_OFS_DELTA &&
+	    objectinfo->ptype != OBJ_REF_DELTA) {
+		objectinfo->ftype = objectinfo->ptype;
+		pack_window_unuse(&window);
+		return (0);
+	}
+
+	/* We have to dig deeper */
+	maxdeltas = 8;
+	objectinfo->deltas = malloc(sizeof(struct pack_delta) * maxdeltas);
+	objectinfo->deltas[0].offset = offset + objectinfo->used +
+	    objectinfo->ofshdrsize;
+	objectinfo->deltas[0].size = objectinfo->psize;
+	ndeltas = 1;
+	type = objectinfo->ptype;
+	used = objectinfo->used;
+	base = offset;
+
+	for (;;) {
+		if (type == OBJ_OFS_DELTA)
+			base -= delta;
+		else {
+			ref = pack_window_use(packfile, &window, base + used,
+			    &left);
+			found = pack_find_ref_base(packfile, ref);
+			if (found == -1) {
+				memcpy(objectinfo->refbase, ref, 20);
+				objectinfo->ftype = OBJ_REF_DELTA;
+				objectinfo->ndeltas = ndeltas;
+				pack_window_unuse(&window);
+				return (-1);
+			}
+			base = found;
+		}
+
+		hdr = pack_window_use(packfile, &window, base, &left);
+		used = pack_parse_type_size(hdr, left, &type, &size);
+		if (type != OBJ_OFS_DELTA && type != OBJ_REF_DELTA)
+			break;
+
+		if (ndeltas == maxdeltas) {
+			maxdeltas *= 2;
+			objectinfo->deltas = realloc(objectinfo->deltas,
+			    sizeof(struct pack_delta) * maxdeltas);
+		}
+		if (type == OBJ_OFS_DELTA) {
+			objectinfo->deltas[ndeltas].offset = base + used +
+			    pack_parse_ofs(hdr + used, left - used, &delta);
+		}
+		else
+			objectinfo->deltas[ndeltas].offset = base + used + 20;
+		objectinfo->deltas[ndeltas++].size = size;
+	}
+
+	objectinfo->ftype = type;
+	objectinfo->ofsbase = base + used;
+	objectinfo->basesize = size;
+	objectinfo->ndeltas = ndeltas;
+
+	pack_window_unuse(&window);
+	return (0);
+}
+
+/*
+ * Validates the header of a mapped version 2 idx file.
+ * Returns 0 if the idx is usable, otherwise prints an error and returns -1.
+ */
+int
+pack_idx_check(unsigned char *idxmap, off_t idxsize)
+{
+	if (idxsize < 8 + sizeof(struct fan) ||
+	    memcmp(idxmap, "\xff\x74\x4f\x63", 4)) {
+		fprintf(stderr, "Header signature does not match index version 2.\n");
+		return (-1);
+	}
+
+	if (*(idxmap + 7) != 2) {
+		fprintf(stderr, "opengit currently only supports version 2.\n");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Returns the position of the SHA in the sorted SHA table of the idx file,
+ * or -1 if it is not present. The fan table gives the range of entries
+ * that share the SHA's first byte, which is then binary searched.
+ */
+int
+pack_find_sha_position(unsigned char *sha, unsigned char *idxmap)
+{
+	struct fan *fans;
+	struct entry *entries;
+	int lo, hi, mid;
+	int cmp;
+
+	fans = (struct fan *)(idxmap + 8);
+	entries = (struct entry *)(idxmap + 8 + sizeof(struct fan));
+
+	lo = (sha[0] == 0) ? 0 : ntohl(fans->count[sha[0] - 1]);
+	hi = ntohl(fans->count[sha[0]]);
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = memcmp(entries[mid].sha, sha, 20);
+		if (cmp == 0)
+			return (mid);
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (-1);
+}
+
+/*
+ * Returns the pack offset of the object at position n of the idx file.
+ * Offsets past 2 GiB are stored in the 64-bit table that follows the 32-bit
+ * one, which then holds PACK_LARGE_OFFSET and the index into that table.
+ */
+off_t
+pack_position_offset(unsigned char *idxmap, int n)
+{
+	struct fan *fans;
+	struct offset *offsets;
+	struct large_offset *large;
+	uint32_t addr;
+	int nelements;
+
+	fans = (struct fan *)(idxmap + 8);
+	nelements = ntohl(fans->count[255]);
+
+	/* Skip the header, fan table, SHA entries and crc32 table */
+	offsets = (struct offset *)(idxmap + 8 + sizeof(struct fan) +
+	    (sizeof(struct entry) * nelements) + (nelements * 4));
+
+	addr = ntohl(offsets[n].addr);
+	if ((addr & PACK_LARGE_OFFSET) == 0)
+		return (addr);
+
+	large = (struct large_offset *)(offsets + nelements);
+	large += addr & ~PACK_LARGE_OFFSET;
+	return (((off_t)ntohl(large->hi) << 32) | ntohl(large->lo));
+}
+
+off_t
+pack_find_sha_offset(unsigned char *sha, unsigned char *idxmap)
+{
+	int n;
+
+	n = pack_find_sha_position(sha, idxmap);
+	if (n == -1)
+		return (-1);
+
+	return (pack_position_offset(idxmap, n));
+}
+
+/*
+ * Batch variant of pack_find_sha_offset. The nshas SHAs in shas must be
+ * sorted, they are resolved in a single merge pass over the idx's SHA table
+ * rather than one search per SHA. The fan table is used to skip ahead to
+ * the first candidate of each SHA, so sparse batches do not walk the whole
+ * table. offsets[n] is set to the offset of shas[n], or -1 if it is absent.
+ */
+void
+pack_find_sha_offsets(unsigned char (*shas)[20], int nshas,
+    unsigned char *idxmap, off_t *offsets)
+{
+	struct fan *fans;
+	struct entry *entries;
+	int nelements;
+	int n, pos, lo;
+	int cmp;
+
+	fans = (struct fan *)(idxmap + 8);
+	entries = (struct entry *)(idxmap + 8 + sizeof(struct fan));
+	nelements = ntohl(fans->count[255]);
+
+	pos = 0;
+	for (n = 0; n < nshas; n++) {
+		offsets[n] = -1;
+
+		lo = (shas[n][0] == 0) ? 0 : ntohl(fans->count[shas[n][0] - 1]);
+		if (pos < lo)
+			pos = lo;
+
+		cmp = -1;
+		while (pos < nelements &&
+		    (cmp = memcmp(entries[pos].sha, shas[n], 20)) < 0)
+			pos++;
+
+		if (cmp == 0)
+			offsets[n] = pack_position_offset(idxmap, pos);
+	}
+}
+
+/*
+ * The pack registry is a process-wide list of every pack in objects/pack.
+ * It is populated the first time an object is requested and from then on
+ * each .idx stays mapped and each .pack stays open until the process exits.
+ * The list is kept in most-recently-hit order, since consecutive lookups
+ * (tree entries, commit parents) tend to land in the same pack.
+ */
+static struct packfile *packfiles = NULL;
+static bool pack_registry_loaded = false;
+
+/*
+ * Guards the registry, whose lookups reorder it, for checkout workers.
+ * When both are needed pack_lock is taken first, the registry code never
+ * takes pack_lock.
+ */
+static pthread_mutex_t pack_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * When objects/pack has a multi-pack-index, lookups search it first and
+ * only probe the idx of packs it does not cover. pack_midx_packs maps its
+ * pack ids to registry entries.
+ */
+static struct midx *pack_midx = NULL;
+static struct packfile **pack_midx_packs = NULL;
+
+/*
+ * Maps the .idx file and allocates a registry entry. The .pack itself is
+ * not opened until the first hit in pack_registry_open.
+ */
+static struct packfile *
+pack_registry_add(char *idxpath)
+{
+	struct packfile *packfile;
+	struct stat sb;
+	int idxfd;
+
+	idxfd = open(idxpath, O_RDONLY);
+	if (idxfd == -1)
+		return (NULL);
+	if (fstat(idxfd, &sb) == -1) {
+		close(idxfd);
+		return (NULL);
+	}
+
+	packfile = calloc(1, sizeof(struct packfile));
+	packfile->idxsize = sb.st_size;
+	packfile->idxmap = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
+	    idxfd, 0);
+	close(idxfd);
+	if (packfile->idxmap == MAP_FAILED) {
+		fprintf(stderr, "mmap(2) error, exiting.\n");
+		exit(0);
+	}
+	if (pack_idx_check(packfile->idxmap, packfile->idxsize)) {
+		fprintf(stderr, "warning: ignoring %s\n", idxpath);
+		munmap(packfile->idxmap, packfile->idxsize);
+		free(packfile);
+		return (NULL);
+	}
+
+	strlcpy(packfile->path, idxpath, PATH_MAX);
+	strlcpy(packfile->path+strlen(packfile->path)-4, ".pack", 6);
+	packfile->packfd = -1;
 
-		buf_read(packfd, &c, 1, read_sha_update, packctx);
-		objectinfo->crc = crc32(objectinfo->crc, &c, 1);
-		delta = c & 0x7f;
-		
-		while (c & 0x80) {
-			ofshdrsize++;
-			delta += 1;
-			buf_read(packfd, &c, 1, read_sha_update, packctx);
-			objectinfo->crc = crc32(objectinfo->crc, &c, 1);
-			delta = (delta << 7) + (c & 0x7f);
+	packfile->next = packfiles;
+	packfiles = packfile;
+
+	return (packfile);
+}
+
+/*
+ * Opens the multi-pack-index and flags the packs it covers. It is not used
+ * if any of its packs is not registered, since that pack was removed.
+ */
+static void
+pack_registry_load_midx(const char *packdir)
+{
+	struct packfile *packfile;
+	char packpath[PATH_MAX];
+	int n;
+
+	pack_midx = midx_open(packdir);
+	if (pack_midx == NULL)
+		return;
+
+	pack_midx_packs = calloc(pack_midx->npacks, sizeof(struct packfile *));
+	for (n = 0; n < pack_midx->npacks; n++) {
+		snprintf(packpath, sizeof(packpath), "%s/%s", packdir,
+		    pack_midx->packnames[n]);
+		strlcpy(packpath+strlen(packpath)-4, ".pack", 6);
+
+		for (packfile = packfiles; packfile; packfile = packfile->next)
+			if (!strcmp(packfile->path, packpath))
+				break;
+		if (packfile == NULL) {
+			free(pack_midx_packs);
+			pack_midx_packs = NULL;
+			midx_close(pack_midx);
+			pack_midx = NULL;
+			for (packfile = packfiles; packfile;
+			    packfile = packfile->next)
+				packfile->inmidx = false;
+			return;
 		}
+		packfile->inmidx = true;
+		pack_midx_packs[n] = packfile;
+	}
+}
+
+/*
+ * Scans objects/pack for .idx files not already in the registry. This is
+ * done once on first use and again if a lookup misses, in case a pack was
+ * written after the registry was populated (ie, clone).
+ */
+static void
+pack_registry_scan()
+{
+	DIR *d;
+	struct dirent *dir;
+	struct packfile *packfile;
+	char idxpath[PATH_MAX];
+	char packdir[PATH_MAX];
+	char *file_ext;
 
-		objectinfo->ofshdrsize = ofshdrsize;
-		object_header_ofs(packfd, offset - delta, 1, objectinfo, &childinfo, packctx);
-		objectinfo->deltas[0] = offset + objectinfo->used + ofshdrsize;
+	pack_registry_loaded = true;
 
+	snprintf(packdir, sizeof(packdir), "%s/objects/pack", dotgitpath);
+	d = opendir(packdir);
+	if (d == NULL)
+		return;
+
+	while ((dir = readdir(d)) != NULL) {
+		file_ext = strrchr(dir->d_name, '.');
+		if (!file_ext || strncmp(file_ext, ".idx", 5))
+			continue;
+		snprintf(idxpath, sizeof(idxpath), "%s/%s", packdir,
+		    dir->d_name);
+
+		/* Skip packs that are already registered */
+		for (packfile = packfiles; packfile; packfile = packfile->next)
+			if (!strncmp(packfile->path, idxpath, strlen(idxpath)-4))
+				break;
+		if (packfile == NULL)
+			pack_registry_add(idxpath);
 	}
 
-	return;
+	closedir(d);
+
+	if (pack_midx == NULL)
+		pack_registry_load_midx(packdir);
 }
 
-int
-pack_find_sha_offset(unsigned char *sha, unsigned char *idxmap)
+/* Opens the .pack file and reads its header on the first hit */
+static void
+pack_registry_open(struct packfile *packfile)
+{
+	struct stat sb;
+
+	if (packfile->packfd != -1)
+		return;
+
+	packfile->packfd = open(packfile->path, O_RDONLY);
+	if (packfile->packfd == -1) {
+		fprintf(stderr, "fatal: ogit: could not get object info\n");
+		fprintf(stderr, "This The git repository may be corrupt.\n");
+		exit(128);
+	}
+	if (fstat(packfile->packfd, &sb) == -1) {
+		fprintf(stderr, "fatal: cannot stat %s\n", packfile->path);
+		exit(128);
+	}
+	packfile->packsize = sb.st_size;
+	pack_parse_header(packfile->packfd, &packfile->packfileinfo, NULL);
+}
+
+/*
+ * Loads the reverse index of a pack on first use, mapping its .rev file if
+ * it is valid for this pack. Otherwise it is built in memory by sorting the
+ * idx positions by offset. Either way the positions are in network order.
+ */
+void
+pack_rev_load(struct packfile *packfile)
 {
+	struct rev_entry *rev;
+	struct stat sb;
 	struct fan *fans;
-	struct entry *entries;
-	//struct checksum *checksums;
-	struct offset *offsets;
-	int idx_offset;
-	char idx_version;
+	char revpath[PATH_MAX];
+	uint32_t *hdr;
 	int nelements;
-	int n;
+	int revfd, x;
 
-	if (memcmp(idxmap, "\xff\x74\x4f\x63", 4)) {
-		fprintf(stderr, "Header signature does not match index version 2.\n");
-		exit(0);
+	if (packfile->revindex != NULL)
+		return;
+
+	fans = (struct fan *)(packfile->idxmap + 8);
+	nelements = ntohl(fans->count[255]);
+
+	strlcpy(revpath, packfile->path, PATH_MAX);
+	strlcpy(revpath+strlen(revpath)-5, ".rev", 5);
+	revfd = open(revpath, O_RDONLY);
+	if (revfd != -1) {
+		if (fstat(revfd, &sb) == 0 && sb.st_size ==
+		    PACK_REV_HEADER_SIZE + nelements * 4 + 40) {
+			packfile->revmap = mmap(NULL, sb.st_size, PROT_READ,
+			    MAP_PRIVATE, revfd, 0);
+			if (packfile->revmap == MAP_FAILED)
+				packfile->revmap = NULL;
+		}
+		close(revfd);
 	}
-	idx_offset = 4;
 
-	idx_version = *(idxmap + idx_offset+3);
-	if (idx_version != 2) {
-		fprintf(stderr, "opengit currently only supports version 2. Exiting.\n");
-		exit(0);
+	if (packfile->revmap != NULL) {
+		hdr = (uint32_t *)packfile->revmap;
+		packfile->revsize = sb.st_size;
+		/* The pack checksum must match the one in the idx */
+		if (ntohl(hdr[0]) == PACK_REV_SIGNATURE &&
+		    ntohl(hdr[1]) == PACK_REV_VERSION &&
+		    ntohl(hdr[2]) == PACK_REV_HASH_SHA1 &&
+		    !memcmp(packfile->revmap + sb.st_size - 40,
+		    packfile->idxmap + packfile->idxsize - 40, 20)) {
+			packfile->revindex = hdr + 3;
+			return;
+		}
+		fprintf(stderr, "warning: ignoring invalid %s\n", revpath);
+		munmap(packfile->revmap, packfile->revsize);
+		packfile->revmap = NULL;
 	}
-	idx_offset += 4;
 
-	// Get the fan table and capture last element
-	fans = (struct fan *)(idxmap + idx_offset);
-	nelements = ntohl(fans->count[255]);
-	// Move to SHA entries
-	idx_offset += sizeof(struct fan);
-	// Point to SHA entries
-	entries = (struct entry *)(idxmap + idx_offset);
+	rev = malloc(sizeof(struct rev_entry) * nelements);
+	for (x = 0; x < nelements; x++) {
+		rev[x].offset = pack_position_offset(packfile->idxmap, x);
+		rev[x].pos = x;
+	}
+	qsort(rev, nelements, sizeof(struct rev_entry), sortreventry);
 
-	for (n=0;n<nelements;n++)
-		if (!memcmp(entries[n].sha, sha, 20))
-			break;
+	packfile->revindex = malloc(sizeof(uint32_t) * nelements);
+	for (x = 0; x < nelements; x++)
+		packfile->revindex[x] = htonl(rev[x].pos);
+	free(rev);
+}
+
+/*
+ * Returns the position in pack order of the object at offset, found by a
+ * binary search of the reverse index, or -1 if no object starts there.
+ */
+static int
+pack_rev_position(struct packfile *packfile, off_t offset)
+{
+	struct fan *fans;
+	off_t found;
+	int lo, hi, mid;
+
+	pack_rev_load(packfile);
+
+	fans = (struct fan *)(packfile->idxmap + 8);
+	lo = 0;
+	hi = ntohl(fans->count[255]);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		found = pack_position_offset(packfile->idxmap,
+		    ntohl(packfile->revindex[mid]));
+		if (found == offset)
+			return (mid);
+		else if (found < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (-1);
+}
+
+/*
+ * Returns the idx position, and so the SHA, of the object at offset in the
+ * pack, or -1 if no object starts there.
+ */
+int
+pack_offset_to_position(struct packfile *packfile, off_t offset)
+{
+	int revpos;
+
+	revpos = pack_rev_position(packfile, offset);
+	if (revpos == -1)
+		return (-1);
+
+	return (ntohl(packfile->revindex[revpos]));
+}
+
+/*
+ * Returns the number of bytes the object at offset takes in the pack,
+ * header and compressed data, without inflating it. This is the distance
+ * to the next object, or to the trailing checksum for the last one.
+ */
+off_t
+pack_object_disk_size(struct packfile *packfile, off_t offset)
+{
+	struct fan *fans;
+	int revpos;
 
-	if (n==nelements)
+	revpos = pack_rev_position(packfile, offset);
+	if (revpos == -1)
 		return (-1);
 
-	// Move to Checksums
-	idx_offset += (sizeof(struct entry) * nelements);
-	// Point to checksums
-	//checksums = (struct checksum *)(idxmap + idx_offset);
-	// Move to Offsets
-	idx_offset += (nelements * 4);
-	// Capture Offsets
-	offsets = (struct offset *)(idxmap + idx_offset);
+	pack_registry_open(packfile);
+	fans = (struct fan *)(packfile->idxmap + 8);
+	if (revpos + 1 == ntohl(fans->count[255]))
+		return (packfile->packsize - 20 - offset);
 
-	return (ntohl(offsets[n].addr));
+	return (pack_position_offset(packfile->idxmap,
+	    ntohl(packfile->revindex[revpos + 1])) - offset);
 }
 
 /*
- * Provides a generic way to parse loose content
- * After getting the correct packfile fd and information, it will pass on
- * this information to 'packhandler' to be handled per the specific needs.
- * This is done because multiple functions will parse pack file data.
+ * Returns the registry entry of the pack with the idx at idxpath, opened,
+ * adding it if it has not been seen. Returns NULL if the idx is not usable.
+ */
+struct packfile *
+pack_registry_get(char *idxpath)
+{
+	struct packfile *packfile;
+
+	pthread_mutex_lock(&pack_registry_lock);
+	if (pack_registry_loaded == false)
+		pack_registry_scan();
+
+	for (packfile = packfiles; packfile; packfile = packfile->next)
+		if (!strncmp(packfile->path, idxpath, strlen(idxpath)-4))
+			break;
+	if (packfile == NULL)
+		packfile = pack_registry_add(idxpath);
+	if (packfile != NULL)
+		pack_registry_open(packfile);
+	pthread_mutex_unlock(&pack_registry_lock);
+
+	return (packfile);
+}
+
+/* Does pack_registry_lookup, pack_registry_lock must be held */
+static struct packfile *
+pack_registry_find(uint8_t *sha_bin, off_t *offset)
+{
+	struct packfile *packfile, *prev;
+	uint32_t packid;
+	int pass;
+	off_t found;
+
+	if (pack_registry_loaded == false)
+		pack_registry_scan();
+
+	if (pack_midx != NULL &&
+	    midx_find_sha(pack_midx, sha_bin, &packid, offset) == 0) {
+		packfile = pack_midx_packs[packid];
+		pack_registry_open(packfile);
+		return (packfile);
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		prev = NULL;
+		for (packfile = packfiles; packfile; packfile = packfile->next) {
+			if (packfile->inmidx) {
+				prev = packfile;
+				continue;
+			}
+			found = pack_find_sha_offset(sha_bin, packfile->idxmap);
+			if (found != -1)
+				break;
+			prev = packfile;
+		}
+
+		if (packfile != NULL) {
+			if (prev != NULL) {
+				prev->next = packfile->next;
+				packfile->next = packfiles;
+				packfiles = packfile;
+			}
+			pack_registry_open(packfile);
+			*offset = found;
+			return (packfile);
+		}
+
+		/* Pick up any packs written since the last scan */
+		pack_registry_scan();
+	}
+
+	return (NULL);
+}
+
+/*
+ * Looks up a binary SHA in the registry. On a hit, the pack is moved to
+ * the front of the list, *offset is set to the object's offset in the
+ * pack and the pack is returned. Returns NULL if no pack has the object.
+ */
+struct packfile *
+pack_registry_lookup(uint8_t *sha_bin, off_t *offset)
+{
+	struct packfile *packfile;
+
+	pthread_mutex_lock(&pack_registry_lock);
+	packfile = pack_registry_find(sha_bin, offset);
+	pthread_mutex_unlock(&pack_registry_lock);
+
+	return (packfile);
+}
+
+/*
+ * Pack data is read through mapped windows rather than lseek(2) and
+ * read(2). Each window covers core.packedGitWindowSize bytes of a pack,
+ * starting on a multiple of half that size so that any offset is at least
+ * half a window from the end of some window. The total bytes mapped across
+ * every pack are bounded by core.packedGitLimit; when a new window would
+ * exceed it, the least recently used windows not held by a cursor are
+ * unmapped first.
+ */
+static size_t pack_mapped = 0;
+static unsigned long pack_window_tick = 0;
+
+/* Object headers are parsed in place, so require 20 bytes past offset */
+static inline bool
+pack_window_contains(struct pack_window *window, off_t offset)
+{
+	return (window->offset <= offset &&
+	    offset + 20 <= window->offset + window->len);
+}
+
+/* Points *lru at the link of packfile's oldest unused window if older */
+static void
+pack_window_find_lru(struct packfile *packfile, struct pack_window ***lru)
+{
+	struct pack_window **w;
+
+	for (w = &packfile->windows; *w; w = &(*w)->next)
+		if ((*w)->inuse == 0 && (*lru == NULL ||
+		    (*w)->last_used < (**lru)->last_used))
+			*lru = w;
+}
+
+/*
+ * Unmaps the least recently used window that is not in use, looking at
+ * every registered pack and at packfile, which may not be registered.
+ * Returns 0 if a window was unmapped, 1 if none could be. pack_lock must
+ * be held.
+ */
+static int
+pack_window_evict(struct packfile *packfile)
+{
+	struct packfile *p;
+	struct pack_window *window, **lru;
+	bool registered = false;
+
+	lru = NULL;
+	pthread_mutex_lock(&pack_registry_lock);
+	for (p = packfiles; p; p = p->next) {
+		pack_window_find_lru(p, &lru);
+		if (p == packfile)
+			registered = true;
+	}
+	pthread_mutex_unlock(&pack_registry_lock);
+	if (registered == false)
+		pack_window_find_lru(packfile, &lru);
+
+	if (lru == NULL)
+		return (1);
+
+	window = *lru;
+	*lru = window->next;
+	munmap(window->base, window->len);
+	pack_mapped -= window->len;
+	free(window);
+
+	return (0);
+}
+
+/*
+ * Returns a pointer to the pack data at offset and sets *left to the number
+ * of bytes that may be read from it. The window is remembered in *cursor,
+ * which must start out NULL, and stays mapped until the cursor is released
+ * with pack_window_unuse. Successive calls with the same cursor reuse the
+ * window while the offset falls inside it.
  */
+unsigned char *
+pack_window_use(struct packfile *packfile, struct pack_window **cursor,
+    off_t offset, size_t *left)
+{
+	struct pack_window *window = *cursor;
+	off_t align;
+
+	if (offset + 20 > packfile->packsize) {
+		fprintf(stderr, "fatal: offset %jd beyond end of pack %s\n",
+		    (intmax_t)offset, packfile->path);
+		exit(128);
+	}
+
+	pthread_mutex_lock(&pack_lock);
+	if (window == NULL || !pack_window_contains(window, offset)) {
+		if (window)
+			window->inuse--;
+
+		for (window = packfile->windows; window; window = window->next)
+			if (pack_window_contains(window, offset))
+				break;
+
+		if (window == NULL) {
+			pack_config_load();
+			window = calloc(1, sizeof(struct pack_window));
+			align = pack_window_size / 2;
+			window->offset = (offset / align) * align;
+			window->len = packfile->packsize - window->offset;
+			if (window->len > pack_window_size)
+				window->len = pack_window_size;
+
+			while (pack_mapped + window->len > pack_window_limit &&
+			    pack_window_evict(packfile) == 0)
+				;
+
+			window->base = mmap(NULL, window->len, PROT_READ,
+			    MAP_PRIVATE, packfile->packfd, window->offset);
+			if (window->base == MAP_FAILED) {
+				fprintf(stderr, "mmap(2) error, exiting.\n");
+				exit(128);
+			}
+			pack_mapped += window->len;
+
+			window->next = packfile->windows;
+			packfile->windows = window;
+		}
+
+		window->inuse++;
+		*cursor = window;
+	}
+
+	window->last_used = ++pack_window_tick;
+	*left = window->offset + window->len - offset;
+	pthread_mutex_unlock(&pack_lock);
+
+	return (window->base + (offset - window->offset));
+}
+
 void
-pack_content_handler(char *sha, packhandler packhandler, void *parg)
+pack_window_unuse(struct pack_window **cursor)
+{
+	pthread_mutex_lock(&pack_lock);
+	if (*cursor)
+		(*cursor)->inuse--;
+	pthread_mutex_unlock(&pack_lock);
+	*cursor = NULL;
+}
+
+/* Unmaps every window of a pack, used before the pack goes away */
+void
+pack_window_release(struct packfile *packfile)
+{
+	struct pack_window *window, *next;
+
+	pthread_mutex_lock(&pack_lock);
+	for (window = packfile->windows; window; window = next) {
+		next = window->next;
+		munmap(window->base, window->len);
+		pack_mapped -= window->len;
+		free(window);
+	}
+	packfile->windows = NULL;
+	pthread_mutex_unlock(&pack_lock);
+}
+
+/*
+ * Inflates the zlib stream at offset of the pack. This is the mapped
+ * counterpart of deflate_caller, the handlers have the same meaning: the
+ * compressed bytes go to deflated_handler as they are consumed, the
+ * inflated bytes to inflated_handler, which stops inflation by returning
+ * NULL. The stream is fed straight from the windows without a copy.
+ */
+int
+pack_inflate(struct packfile *packfile, off_t offset,
+    deflated_handler deflated_handler, void *darg,
+    inflated_handler inflated_handler, void *iarg)
+{
+	struct pack_window *window = NULL;
+	unsigned char out[CHUNK];
+	unsigned char *in;
+	size_t left;
+	unsigned have;
+	z_stream strm;
+	int ret;
+	int use;
+
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	ret = inflateInit(&strm);
+	if (ret != Z_OK)
+		return (ret);
+
+	do {
+		in = pack_window_use(packfile, &window, offset, &left);
+		strm.next_in = in;
+		strm.avail_in = (left > UINT_MAX) ? UINT_MAX : left;
+
+		do {
+			strm.avail_out = CHUNK;
+			strm.next_out = out;
+			ret = inflate(&strm, Z_NO_FLUSH);
+
+			switch (ret) {
+			case Z_NEED_DICT:
+				ret = Z_DATA_ERROR;
+			case Z_DATA_ERROR:
+			case Z_MEM_ERROR:
+				(void)inflateEnd(&strm);
+				pack_window_unuse(&window);
+				return (ret);
+			}
+			have = CHUNK - strm.avail_out;
+
+			use = strm.next_in - in;
+			if (deflated_handler)
+				deflated_handler(in, use, darg);
+			in += use;
+			offset += use;
+			if (inflated_handler(out, have, use, iarg) == NULL)
+				goto end_inflation;
+
+		} while (strm.avail_out == 0 && ret != Z_STREAM_END);
+	} while (ret != Z_STREAM_END);
+
+end_inflation:
+	(void)inflateEnd(&strm);
+	pack_window_unuse(&window);
+	return (ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR);
+}
+
+#ifdef HAVE_LIBDEFLATE
+static pthread_key_t	pack_libdeflate_key;
+static pthread_once_t	pack_libdeflate_once = PTHREAD_ONCE_INIT;
+
+static void
+pack_libdeflate_init(void)
+{
+	pthread_key_create(&pack_libdeflate_key,
+	    (void (*)(void *))libdeflate_free_decompressor);
+}
+
+/*
+ * Inflates the zlib stream at in, of no more than len bytes, into the size
+ * bytes of out with libdeflate, which needs the whole stream at once. Each
+ * thread keeps its own decompressor. Returns the number of bytes of in the
+ * stream takes, or 0 if it does not inflate to size bytes within len, for
+ * zlib to tell a stream that crosses windows from a corrupt one.
+ */
+static size_t
+pack_libdeflate(unsigned char *in, size_t len, unsigned char *out,
+    size_t size)
+{
+	struct libdeflate_decompressor *d;
+	size_t inlen, outlen;
+
+	pthread_once(&pack_libdeflate_once, pack_libdeflate_init);
+	d = pthread_getspecific(pack_libdeflate_key);
+	if (d == NULL) {
+		d = libdeflate_alloc_decompressor();
+		if (d == NULL)
+			return (0);
+		pthread_setspecific(pack_libdeflate_key, d);
+	}
+
+	if (libdeflate_zlib_decompress_ex(d, in, len, out, size, &inlen,
+	    &outlen) != LIBDEFLATE_SUCCESS || outlen != size)
+		return (0);
+	return (inlen);
+}
+#endif
+
+/*
+ * Inflates the zlib stream at offset of the pack, which a pack or delta
+ * header says inflates to size bytes, into object. The buffer is allocated
+ * at that size and filled by a single inflate call, rather than grown CHUNK
+ * by CHUNK through pack_inflate and buffer_cb. It is only called again if
+ * the stream crosses the end of a window, or for the next 4 GiB of a huge
+ * object as zlib counts in 32 bits. Built with libdeflate, a stream within
+ * a window is inflated by it instead. The data is NUL terminated. Exits if
+ * the stream does not inflate to exactly size bytes.
+ */
+void
+pack_inflate_whole(struct packfile *packfile, off_t offset,
+    unsigned long size, struct decompressed_object *object)
+{
+	struct pack_window *window = NULL;
+	unsigned char *in;
+	unsigned long outleft;
+	size_t left;
+	z_stream strm;
+	int ret;
+
+	object->data = malloc(size + 1);
+	if (object->data == NULL) {
+		fprintf(stderr, "fatal: out of memory, malloc failed (tried to "
+		    "allocate %lu bytes)\n", size + 1);
+		exit(128);
+	}
+	object->size = size;
+	in = pack_window_use(packfile, &window, offset, &left);
+
+#ifdef HAVE_LIBDEFLATE
+	object->deflated_size = pack_libdeflate(in, left, object->data, size);
+	if (object->deflated_size != 0) {
+		pack_window_unuse(&window);
+		object->data[size] = '\0';
+		return;
+	}
+#endif
+
+	bzero(&strm, sizeof(z_stream));
+	if (inflateInit(&strm) != Z_OK) {
+		fprintf(stderr, "fatal: inflateInit failed\n");
+		exit(128);
+	}
+
+	/* One byte more than needed catches a stream that inflates to more */
+	strm.next_out = object->data;
+	outleft = size + 1;
+	for (;;) {
+		strm.next_in = in;
+		strm.avail_in = (left > UINT_MAX) ? UINT_MAX : left;
+		if (strm.avail_out == 0) {
+			strm.avail_out = (outleft > UINT_MAX) ? UINT_MAX :
+			    outleft;
+			outleft -= strm.avail_out;
+		}
+		ret = inflate(&strm, Z_FINISH);
+		offset += strm.next_in - in;
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			break;
+		if (strm.avail_out == 0 && outleft == 0)
+			break;
+		if (strm.avail_in == 0)
+			in = pack_window_use(packfile, &window, offset, &left);
+		else {
+			left -= strm.next_in - in;
+			in = strm.next_in;
+		}
+	}
+	pack_window_unuse(&window);
+	(void)inflateEnd(&strm);
+
+	if (ret != Z_STREAM_END || strm.total_out != size) {
+		fprintf(stderr, "fatal: corrupt object at offset %jd in %s\n",
+		    (intmax_t)offset, packfile->path);
+		exit(128);
+	}
+	object->deflated_size = strm.total_in;
+	object->data[size] = '\0';
+}
+
+/*
+ * Inflates no more than len bytes from the start of the zlib stream at
+ * offset into buf. Returns the number of bytes inflated.
+ */
+static unsigned long
+pack_inflate_head(struct packfile *packfile, off_t offset, unsigned char *buf,
+    unsigned long len)
+{
+	struct pack_window *window = NULL;
+	unsigned char *in;
+	size_t left;
+	z_stream strm;
+	int ret;
+
+	bzero(&strm, sizeof(z_stream));
+	if (inflateInit(&strm) != Z_OK)
+		return (0);
+
+	strm.next_out = buf;
+	strm.avail_out = len;
+	do {
+		in = pack_window_use(packfile, &window, offset, &left);
+		strm.next_in = in;
+		strm.avail_in = (left > UINT_MAX) ? UINT_MAX : left;
+		ret = inflate(&strm, Z_SYNC_FLUSH);
+		offset += strm.next_in - in;
+	} while (ret == Z_OK && strm.avail_out > 0 && strm.avail_in == 0);
+
+	(void)inflateEnd(&strm);
+	pack_window_unuse(&window);
+	return (len - strm.avail_out);
+}
+
+/*
+ * Reads the final type and inflated size of the object at offset without
+ * inflating its content. A whole object's size is in its pack header, a
+ * delta's result size is the second varint of the delta data, so only the
+ * first bytes of it are inflated and the chain is never applied.
+ * Returns 0 on success, -1 if a ref_delta base is missing from the pack.
+ */
+int
+pack_object_info(struct packfile *packfile, off_t offset, int *type,
+    unsigned long *size)
 {
-	char filename[PATH_MAX];
-	unsigned long offset;
-	int packfd;
-	struct packfileinfo packfileinfo;
 	struct objectinfo objectinfo;
+	unsigned char buf[20], *p;
+	unsigned long len;
 
-	// Not strictly required, but needed to suppress a warning
 	bzero(&objectinfo, sizeof(struct objectinfo));
+	if (pack_object_header(packfile, offset, &objectinfo, NULL)) {
+		free(objectinfo.deltas);
+		return (-1);
+	}
+	*type = objectinfo.ftype;
 
-	offset = pack_get_packfile_offset(sha, filename);
-	if (offset == -1) {
-		fprintf(stderr, "fatal: ogit: Cannot retrieve %s\n", sha);
-		exit(128);
+	if (objectinfo.ptype != OBJ_OFS_DELTA &&
+	    objectinfo.ptype != OBJ_REF_DELTA) {
+		*size = objectinfo.psize;
+		return (0);
 	}
 
-	strlcpy(filename+strlen(filename)-4, ".pack", 6);
-	packfd = open(filename, O_RDONLY);
-	if (packfd == -1) {
-		fprintf(stderr, "fatal: ogit: could not get object info\n");
-		fprintf(stderr, "This The git repository may be corrupt.\n");
+	len = pack_inflate_head(packfile, objectinfo.deltas[0].offset, buf,
+	    sizeof(buf));
+	free(objectinfo.deltas);
+	p = buf;
+	readvint(&p, buf + len);		// The base size
+	if (p >= buf + len) {
+		fprintf(stderr, "fatal: bad delta header at offset %jd in "
+		    "%s\n", (intmax_t)offset, packfile->path);
 		exit(128);
 	}
-	pack_parse_header(packfd, &packfileinfo, NULL);
+	*size = readvint(&p, buf + len);
 
-	lseek(packfd, offset, SEEK_SET);
-	pack_object_header(packfd, offset, &objectinfo, NULL);
+	return (0);
+}
 
-	// XXX This if-condition might not be necessary
-	if (objectinfo.ftype == OBJ_OFS_DELTA) {
-		int c;
-		unsigned long r = 0;
+/*
+ * Provides a generic way to parse pack content
+ * After getting the correct packfile fd and information, it will pass on
+ * this information to 'packhandler' to be handled per the specific needs.
+ * This is done because multiple functions will parse pack file data.
+ */
+void
+pack_content_handler(uint8_t *sha, packhandler packhandler, void *parg)
+{
+	struct packfile *packfile;
+	struct objectinfo objectinfo;
+	off_t offset;
+	char shastr[HASH_SIZE+1];
+	char basesha[HASH_SIZE+1];
 
-		// Reads header of read ofs delta
-		do {
-			buf_read(packfd, &c, 1, NULL, NULL);
-			r |= c & 0x7f;
-			if (!(c & BIT(7)))
-				break;
-			r++;
-			r <<= 7;
-		} while(c & BIT(7));
+	// Not strictly required, but needed to suppress a warning
+	bzero(&objectinfo, sizeof(struct objectinfo));
 
-		lseek(packfd, offset - r, SEEK_SET);
+	packfile = pack_registry_lookup(sha, &offset);
+	if (packfile == NULL) {
+		sha_bin_to_str(sha, shastr);
+		shastr[HASH_SIZE] = '\0';
+		fprintf(stderr, "fatal: ogit: Cannot retrieve %s\n", shastr);
+		exit(128);
 	}
-	else if (objectinfo.ftype == OBJ_REF_DELTA) {
-		printf("obj_ref_delta --- supposed to apply patch\n");
+
+	if (pack_object_header(packfile, offset, &objectinfo, NULL)) {
+		sha_bin_to_str(sha, shastr);
+		shastr[HASH_SIZE] = '\0';
+		sha_bin_to_str(objectinfo.refbase, basesha);
+		basesha[HASH_SIZE] = '\0';
+		fprintf(stderr, "fatal: ogit: Cannot retrieve %s, delta base "
+		    "%s is missing from %s\n", shastr, basesha, packfile->path);
+		exit(128);
 	}
 
-	packhandler(packfd, &objectinfo, parg);
-	close(packfd);
+	packhandler(packfile, &objectinfo, parg);
 }
 
 /*
@@ -768,19 +3343,18 @@ pack_content_handler(char *sha, packhandler packhandler, void *parg)
  * Arguments: pargs is a pointer to a decompressed_object
  */
 void
-pack_buffer_cb(int packfd, struct objectinfo *objectinfo, void *pargs)
+pack_buffer_cb(struct packfile *packfile, struct objectinfo *objectinfo, void *pargs)
 {
 	struct decompressed_object *decompressed_object = pargs;
 
-	if (objectinfo->ptype != OBJ_OFS_DELTA) {
-		decompressed_object->size = 0;
-		decompressed_object->data = NULL;
-		decompressed_object->deflated_size = 0;
-		lseek(packfd, objectinfo->offset + objectinfo->used, SEEK_SET);
-		deflate_caller(packfd, NULL, NULL, buffer_cb, decompressed_object);
+	if (objectinfo->ptype != OBJ_OFS_DELTA &&
+	    objectinfo->ptype != OBJ_REF_DELTA) {
+		pack_inflate_whole(packfile,
+		    objectinfo->offset + objectinfo->used, objectinfo->psize,
+		    decompressed_object);
 	}
 	else {
-		pack_delta_content(packfd, objectinfo, NULL);
+		pack_delta_content(packfile, objectinfo);
 		free(objectinfo->deltas);
 		decompressed_object->data = objectinfo->data;
 		decompressed_object->size = objectinfo->isize;
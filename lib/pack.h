@@ -29,9 +29,12 @@
 #define PACK_H
 
 #include <sys/types.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <zlib.h>
 #include "common.h"
+#include "zlib-handler.h"
 
 
 /*
@@ -48,6 +51,21 @@ struct offset {
 	unsigned int	addr;
 };
 
+/* Entries of the 64-bit offset table, for offsets past 2 GiB */
+struct large_offset {
+	uint32_t	hi;
+	uint32_t	lo;
+};
+
+/* Set in a 32-bit offset table entry that indexes the 64-bit table */
+#define PACK_LARGE_OFFSET	0x80000000U
+
+/* Reverse index (.rev) header, see Documentation/technical/pack-format.txt */
+#define PACK_REV_SIGNATURE	0x52494458	/* "RIDX" */
+#define PACK_REV_VERSION	1
+#define PACK_REV_HASH_SHA1	1
+#define PACK_REV_HEADER_SIZE	12
+
 struct checksum {
 	unsigned int	val;
 };
@@ -68,8 +86,14 @@ struct packfileinfo {
 	unsigned char	ctx[20];
 };
 
+/* A delta in the chain of an objectinfo */
+struct pack_delta {
+	off_t		offset;		// Offset of delta + delta hdr
+	unsigned long	size;		// Size of the delta data
+};
+
 struct objectinfo {
-	unsigned long	offset;		// The object header from the file's start
+	off_t		offset;		// The object header from the file's start
 	uLong		crc;
 
 	unsigned long	psize;		// Size of the object content
@@ -78,20 +102,55 @@ struct objectinfo {
 	unsigned int	ftype;		// Final type
 	unsigned int	ptype;		// Pack type
 
-	/* Values used by ofs_delta objects */
+	/* Values used by ofs_delta and ref_delta objects */
 	unsigned long	deflated_size;
-	unsigned long	ofsbase;	// Offset of object + object hdr
-	unsigned long	ofshdrsize;	// The sizeof the ofs hdr 
-	unsigned long	*deltas;	// Offset of deltas + delta hdrs
+	off_t		ofsbase;	// Offset of object + object hdr
+	unsigned long	basesize;	// Size of the base object
+	unsigned long	ofshdrsize;	// The sizeof the ofs hdr or ref SHA
+	struct pack_delta *deltas;	// The deltas, target first
 	int		ndeltas;	// Number of deltas
+	unsigned char	refbase[20];	// Set if a ref_delta base is missing
 
 	unsigned char	*data;		// Pointer to inflated data
 
 };
 
+/*
+ * A mapped region of a .pack file, see pack_window_use.
+ */
+struct pack_window {
+	struct pack_window *next;
+	unsigned char	*base;
+	off_t		 offset;	// Offset of base in the .pack
+	size_t		 len;
+	unsigned long	 last_used;
+	unsigned int	 inuse;		// Number of cursors on the window
+};
+
+/*
+ * A pack in the process-wide registry, see pack_registry_lookup.
+ * The .idx is mapped when the pack is discovered, the .pack is opened and
+ * its header parsed on the first lookup that hits it.
+ */
+struct packfile {
+	char		 path[PATH_MAX];	// Path to the .pack file
+	int		 packfd;		// -1 until first opened
+	off_t		 packsize;
+	struct pack_window *windows;
+	unsigned char	*idxmap;
+	off_t		 idxsize;
+	struct packfileinfo packfileinfo;
+	bool		 inmidx;		// Covered by the multi-pack-index
+	unsigned char	*revmap;		// The .rev file, if any
+	off_t		 revsize;
+	uint32_t	*revindex;		// NULL until first needed
+
+	struct packfile	*next;
+};
+
 /* Used to store object information when creating the index */
 struct index_entry {
-	int		offset;
+	off_t		offset;
 	int		type;
 	uLong		crc;
 	unsigned char	digest[20];
@@ -99,33 +158,87 @@ struct index_entry {
 
 /* Used in the callback to get index information */
 struct index_generate_arg {
-	int		bytes;
+	off_t		bytes;
 	SHA1_CTX	shactx;
 };
 
-typedef void 	 packhandler(int, struct objectinfo *, void *);
+/* Counters for the delta base cache */
+struct delta_cache_stats {
+	unsigned long	hits;
+	unsigned long	misses;
+	unsigned long	evictions;
+	unsigned long	bytes;		// Bytes currently cached
+};
+
+/* Default for core.deltaBaseCacheLimit, same as GPL git */
+#define DELTA_CACHE_LIMIT	(96 * 1024 * 1024)
+
+/*
+ * Defaults for core.packedGitWindowSize and core.packedGitLimit, same as
+ * GPL git. Smaller values are used where the address space is 32 bits.
+ */
+#if ULONG_MAX > 0xffffffffUL
+#define PACK_WINDOW_SIZE	(1024L * 1024 * 1024)
+#define PACK_WINDOW_LIMIT	(8L * 1024 * 1024 * 1024)
+#else
+#define PACK_WINDOW_SIZE	(32L * 1024 * 1024)
+#define PACK_WINDOW_LIMIT	(256L * 1024 * 1024)
+#endif
+
+/* A pack being indexed as it is received, see pack_stream_open */
+struct pack_stream;
+
+typedef void 	 packhandler(struct packfile *, struct objectinfo *, void *);
 
 ssize_t		 sha_write(int fd, const void *buf, size_t nbytes, SHA1_CTX *idxctx);
-int		 pack_find_sha_offset(unsigned char *sha, unsigned char *idxmap);
-int		 pack_get_packfile_offset(char *sha_str, char *filename);
+int		 pack_idx_check(unsigned char *idxmap, off_t idxsize);
+int		 pack_find_sha_position(unsigned char *sha, unsigned char *idxmap);
+off_t		 pack_position_offset(unsigned char *idxmap, int n);
+off_t		 pack_find_sha_offset(unsigned char *sha, unsigned char *idxmap);
+void		 pack_find_sha_offsets(unsigned char (*shas)[20], int nshas, unsigned char *idxmap, off_t *offsets);
+struct packfile	*pack_registry_lookup(uint8_t *sha_bin, off_t *offset);
+struct packfile	*pack_registry_get(char *idxpath);
+void		 pack_rev_load(struct packfile *packfile);
+int		 pack_offset_to_position(struct packfile *packfile, off_t offset);
+off_t		 pack_object_disk_size(struct packfile *packfile, off_t offset);
 int		 pack_parse_header(int packfd, struct packfileinfo *packfileinfo, SHA1_CTX *packctx);
-void		 pack_object_header(int packfd, int offset, struct objectinfo *objectinfo, SHA1_CTX *packctx);
-int		 pack_get_object_meta(int packfd, int offset, struct packfileinfo *packfileinfo, struct index_entry *index_entry,
-		     SHA1_CTX *packctx, SHA1_CTX *idxctx);
-unsigned char	*pack_get_index_bytes_cb(unsigned char *buf, int size, int deflated_bytes, void *arg);
-void		 pack_delta_content(int packfd, struct objectinfo *objectinfo, SHA1_CTX *packctx);
+unsigned char	*pack_window_use(struct packfile *packfile, struct pack_window **cursor, off_t offset,
+		     size_t *left);
+void		 pack_window_unuse(struct pack_window **cursor);
+void		 pack_window_release(struct packfile *packfile);
+int		 pack_inflate(struct packfile *packfile, off_t offset, deflated_handler deflated_handler,
+		     void *darg, inflated_handler inflated_handler, void *iarg);
+void		 pack_inflate_whole(struct packfile *packfile, off_t offset, unsigned long size,
+		     struct decompressed_object *object);
+int		 pack_object_header(struct packfile *packfile, off_t offset, struct objectinfo *objectinfo,
+		     SHA1_CTX *packctx);
+int		 pack_object_info(struct packfile *packfile, off_t offset, int *type,
+		     unsigned long *size);
+int		 pack_get_object_meta(int packfd, off_t offset, struct packfileinfo *packfileinfo, struct index_entry *index_entry,
+		     SHA1_CTX *packctx, SHA1_CTX *idxctx, int nthreads);
+struct pack_stream *pack_stream_open(int packfd);
+void		 pack_stream_write(struct pack_stream *pstream, unsigned char *buf, size_t len);
+int		 pack_stream_close(struct pack_stream *pstream, struct packfileinfo *packfileinfo,
+		     struct index_entry **index_entry, int nthreads);
+int		 pack_fix_thin(int packfd, struct packfileinfo *packfileinfo, struct index_entry *index_entry,
+		     int nunresolved, int nthreads);
+void		 pack_delta_content(struct packfile *packfile, struct objectinfo *objectinfo);
+void		 pack_delta_cache_release(struct packfile *packfile);
+void		 pack_delta_cache_get_stats(struct delta_cache_stats *stats);
 void		 write_index_header(int idxfd, SHA1_CTX *idxctx);
-void		 write_hash_count(int idxfd, struct index_entry *index_entry, SHA1_CTX *idxctx);
+void		 write_hash_count(int idxfd, struct packfileinfo *packfileinfo, struct index_entry *index_entry,
+		     SHA1_CTX *idxctx);
 void		 write_hashes(int idxfd, struct packfileinfo *packfileinfo, struct index_entry *index_entry, SHA1_CTX *idxctx);
 void		 write_crc_table(int idxfd, struct packfileinfo *packfileinfo, struct index_entry *index_entry, SHA1_CTX *idxctx);
-void		 write_32bit_table(int idxfd, struct packfileinfo *packfileinfo, struct index_entry *index_entry, SHA1_CTX *idxctx);
+int		 write_32bit_table(int idxfd, struct packfileinfo *packfileinfo, struct index_entry *index_entry, SHA1_CTX *idxctx);
+void		 write_64bit_table(int idxfd, struct packfileinfo *packfileinfo, struct index_entry *index_entry, SHA1_CTX *idxctx);
 void		 write_checksums(int idxfd, struct packfileinfo *packfileinfo, SHA1_CTX *idxctx);
-void		 pack_build_index(int idxfd, struct packfileinfo *packfileinfo, struct index_entry *index_entry, SHA1_CTX *idxctx);
+void		 write_rev_index(int revfd, struct packfileinfo *packfileinfo, struct index_entry *index_entry);
+void		 pack_build_index(int idxfd, int revfd, struct packfileinfo *packfileinfo, struct index_entry *index_entry, SHA1_CTX *idxctx);
 int		 sortindexentry(const void *a, const void *b);
 int		 read_sha_update(void *buf, size_t count, void *arg);
-void		 pack_content_handler(char *sha, packhandler packhandler, void *args);
-void		 pack_buffer_cb(int packfd, struct objectinfo *objectinfo, void *pargs);
-void		 get_type_pack_cb(int packfd, struct objectinfo *objectinfo, void *pargs);
-void		 write_pack_cb(int packfd, struct objectinfo *objectinfo, void *pargs);
+void		 pack_content_handler(uint8_t *sha, packhandler packhandler, void *args);
+void		 pack_buffer_cb(struct packfile *packfile, struct objectinfo *objectinfo, void *pargs);
+void		 write_pack_cb(struct packfile *packfile, struct objectinfo *objectinfo, void *pargs);
 
 #endif
@@ -35,8 +35,12 @@
 #include "protocol.h"
 
 
+/*
+ * Reads the side-band response to a want and hands the pack data to
+ * pstream as each packet arrives.
+ */
 size_t
-proto_process_pack(int packfd, FILE *stream)
+proto_process_pack(struct pack_stream *pstream, FILE *stream)
 {
 	int pktsize;
 	size_t sz;
@@ -81,7 +85,7 @@ proto_process_pack(int packfd, FILE *stream)
 #ifdef NDEBUG
 			fprintf(stderr, "debug: received pack packet\n");
 #endif
-			write(packfd, buf+1, pktsize-5);
+			pack_stream_write(pstream, buf+1, pktsize-5);
 		}
 	}
 
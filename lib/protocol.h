@@ -29,6 +29,7 @@
 #define __PROTOCOL_H
 
 #include <sys/queue.h>
+#include "pack.h"
 
 /* Specifies the pack protocol capabilities */
 #define PACKPROTO_MULTI_ACK				BIT(0)
@@ -91,7 +92,7 @@ struct smart_head {
 };
 
 int	proto_parse_response(char *response, struct smart_head *smart_head);
-size_t	proto_process_pack(int packfd, FILE *stream);
+size_t	proto_process_pack(struct pack_stream *pstream, FILE *stream);
 
 
 #endif
@@ -0,0 +1,635 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sha1.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_X86
+#elif defined(__aarch64__) && (defined(__linux__) || defined(__FreeBSD__))
+#include <sys/auxv.h>
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <asm/hwcap.h>
+#endif
+#define SHA1_ARM
+#endif
+
+/*
+ * A block function hashes nblocks whole 64 byte blocks into state. The
+ * portable one is always there, the others use the SHA instructions of
+ * x86 (SHA-NI) and ARMv8 and are only picked if the CPU reports them.
+ */
+typedef void	 sha1_block_fn(uint32_t *state, const unsigned char *data,
+		    size_t nblocks);
+
+/*
+ * Multi-buffer hashing: without SHA instructions, SHA1_LANES independent
+ * messages are hashed at once, one per 32 bit lane of a vector, which
+ * hides the per block cost of small objects such as trees and commits.
+ * The vectors are plain GCC/clang vector extensions, so the compiler uses
+ * whatever SIMD the target has, and an AVX2 copy is picked at runtime.
+ * A lanes function hashes one block of each lane.
+ */
+typedef uint32_t sha1_vec __attribute__((vector_size(SHA1_LANES * 4)));
+typedef void	 sha1_lanes_fn(sha1_vec *state, const unsigned char **blocks);
+
+static sha1_block_fn	*sha1_blocks;
+static sha1_lanes_fn	*sha1_lanes;
+static const char	*sha1_name;
+static pthread_once_t	 sha1_once = PTHREAD_ONCE_INIT;
+
+#define ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline uint32_t
+sha1_load_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+/* One round, the caller rotates the roles of a to e */
+#define SHA1_ROUND(f, k) do {						\
+	t = ROL(a, 5) + (f) + e + (k) + w[i];				\
+	e = d;								\
+	d = c;								\
+	c = ROL(b, 30);							\
+	b = a;								\
+	a = t;								\
+} while (0)
+
+static void
+sha1_blocks_portable(uint32_t *state, const unsigned char *data,
+    size_t nblocks)
+{
+	uint32_t w[80];
+	uint32_t a, b, c, d, e, t;
+	int i;
+
+	while (nblocks--) {
+		for (i = 0; i < 16; i++)
+			w[i] = sha1_load_be32(data + i * 4);
+		for (; i < 80; i++)
+			w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		for (i = 0; i < 20; i++)
+			SHA1_ROUND(d ^ (b & (c ^ d)), 0x5a827999);
+		for (; i < 40; i++)
+			SHA1_ROUND(b ^ c ^ d, 0x6ed9eba1);
+		for (; i < 60; i++)
+			SHA1_ROUND((b & c) | (d & (b | c)), 0x8f1bbcdc);
+		for (; i < 80; i++)
+			SHA1_ROUND(b ^ c ^ d, 0xca62c1d6);
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+
+		data += SHA1_BLOCK_SIZE;
+	}
+}
+
+#ifdef SHA1_X86
+/*
+ * Four rounds i*4 to i*4+3 with SHA-NI. msg[] holds the next 16 words of
+ * the schedule, which is extended in place, e[] alternates between the E
+ * of these rounds and a copy of ABCD for the next ones.
+ */
+#define SHA1_NI_ROUNDS(i) do {						\
+	if ((i) == 0)							\
+		e[0] = _mm_add_epi32(e[0], msg[0]);			\
+	else								\
+		e[(i) % 2] = _mm_sha1nexte_epu32(e[(i) % 2],		\
+		    msg[(i) % 4]);					\
+	e[((i) + 1) % 2] = abcd;					\
+	if ((i) >= 3 && (i) <= 18)					\
+		msg[((i) + 1) % 4] = _mm_sha1msg2_epu32(		\
+		    msg[((i) + 1) % 4], msg[(i) % 4]);			\
+	abcd = _mm_sha1rnds4_epu32(abcd, e[(i) % 2], (i) / 5);		\
+	if ((i) >= 1 && (i) <= 16)					\
+		msg[((i) + 3) % 4] = _mm_sha1msg1_epu32(		\
+		    msg[((i) + 3) % 4], msg[(i) % 4]);			\
+	if ((i) >= 2 && (i) <= 17)					\
+		msg[((i) + 2) % 4] = _mm_xor_si128(msg[((i) + 2) % 4],	\
+		    msg[(i) % 4]);					\
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha1_blocks_shani(uint32_t *state, const unsigned char *data, size_t nblocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+	    0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e0, msg[4], e[2];
+	int n;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state),
+	    0x1b);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	while (nblocks--) {
+		abcd_save = abcd;
+		e[0] = e0;
+		for (n = 0; n < 4; n++)
+			msg[n] = _mm_shuffle_epi8(_mm_loadu_si128(
+			    (const __m128i *)(data + n * 16)), mask);
+
+		SHA1_NI_ROUNDS(0);
+		SHA1_NI_ROUNDS(1);
+		SHA1_NI_ROUNDS(2);
+		SHA1_NI_ROUNDS(3);
+		SHA1_NI_ROUNDS(4);
+		SHA1_NI_ROUNDS(5);
+		SHA1_NI_ROUNDS(6);
+		SHA1_NI_ROUNDS(7);
+		SHA1_NI_ROUNDS(8);
+		SHA1_NI_ROUNDS(9);
+		SHA1_NI_ROUNDS(10);
+		SHA1_NI_ROUNDS(11);
+		SHA1_NI_ROUNDS(12);
+		SHA1_NI_ROUNDS(13);
+		SHA1_NI_ROUNDS(14);
+		SHA1_NI_ROUNDS(15);
+		SHA1_NI_ROUNDS(16);
+		SHA1_NI_ROUNDS(17);
+		SHA1_NI_ROUNDS(18);
+		SHA1_NI_ROUNDS(19);
+
+		e0 = _mm_sha1nexte_epu32(e[0], e0);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+		data += SHA1_BLOCK_SIZE;
+	}
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static bool
+sha1_cpu_has_shani(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+		return (false);
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return (false);
+	return ((ebx & bit_SHA) != 0);
+}
+#endif
+
+#ifdef SHA1_ARM
+#if defined(__clang__)
+#define SHA1_ARM_TARGET	__attribute__((target("crypto")))
+#else
+#define SHA1_ARM_TARGET	__attribute__((target("+crypto")))
+#endif
+
+/*
+ * Four rounds i*4 to i*4+3 with the ARMv8 SHA1 instructions. tmp[] holds
+ * the schedule words plus K for these rounds and the next, msg[] the next
+ * 16 words of the schedule, e[] the E of these rounds and of the next.
+ */
+#define SHA1_ARM_ROUNDS(i, op) do {					\
+	e[((i) + 1) % 2] = vsha1h_u32(vgetq_lane_u32(abcd, 0));		\
+	abcd = op(abcd, e[(i) % 2], tmp[(i) % 2]);			\
+	if ((i) <= 17)							\
+		tmp[(i) % 2] = vaddq_u32(msg[((i) + 2) % 4],		\
+		    vdupq_n_u32(k[((i) + 2) / 5]));			\
+	if ((i) >= 1 && (i) <= 16)					\
+		msg[((i) + 3) % 4] = vsha1su1q_u32(msg[((i) + 3) % 4],	\
+		    msg[((i) + 2) % 4]);				\
+	if ((i) <= 15)							\
+		msg[(i) % 4] = vsha1su0q_u32(msg[(i) % 4],		\
+		    msg[((i) + 1) % 4], msg[((i) + 2) % 4]);		\
+} while (0)
+
+SHA1_ARM_TARGET
+static void
+sha1_blocks_arm(uint32_t *state, const unsigned char *data, size_t nblocks)
+{
+	static const uint32_t k[4] = {
+		0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+	};
+	uint32x4_t abcd, abcd_save, msg[4], tmp[2];
+	uint32_t e0, e[2];
+	int n;
+
+	abcd = vld1q_u32(state);
+	e0 = state[4];
+
+	while (nblocks--) {
+		abcd_save = abcd;
+		e[0] = e0;
+		for (n = 0; n < 4; n++)
+			msg[n] = vreinterpretq_u32_u8(vrev32q_u8(
+			    vld1q_u8(data + n * 16)));
+		tmp[0] = vaddq_u32(msg[0], vdupq_n_u32(k[0]));
+		tmp[1] = vaddq_u32(msg[1], vdupq_n_u32(k[0]));
+
+		SHA1_ARM_ROUNDS(0, vsha1cq_u32);
+		SHA1_ARM_ROUNDS(1, vsha1cq_u32);
+		SHA1_ARM_ROUNDS(2, vsha1cq_u32);
+		SHA1_ARM_ROUNDS(3, vsha1cq_u32);
+		SHA1_ARM_ROUNDS(4, vsha1cq_u32);
+		SHA1_ARM_ROUNDS(5, vsha1pq_u32);
+		SHA1_ARM_ROUNDS(6, vsha1pq_u32);
+		SHA1_ARM_ROUNDS(7, vsha1pq_u32);
+		SHA1_ARM_ROUNDS(8, vsha1pq_u32);
+		SHA1_ARM_ROUNDS(9, vsha1pq_u32);
+		SHA1_ARM_ROUNDS(10, vsha1mq_u32);
+		SHA1_ARM_ROUNDS(11, vsha1mq_u32);
+		SHA1_ARM_ROUNDS(12, vsha1mq_u32);
+		SHA1_ARM_ROUNDS(13, vsha1mq_u32);
+		SHA1_ARM_ROUNDS(14, vsha1mq_u32);
+		SHA1_ARM_ROUNDS(15, vsha1pq_u32);
+		SHA1_ARM_ROUNDS(16, vsha1pq_u32);
+		SHA1_ARM_ROUNDS(17, vsha1pq_u32);
+		SHA1_ARM_ROUNDS(18, vsha1pq_u32);
+		SHA1_ARM_ROUNDS(19, vsha1pq_u32);
+
+		e0 = e[0] + e0;
+		abcd = vaddq_u32(abcd, abcd_save);
+		data += SHA1_BLOCK_SIZE;
+	}
+
+	vst1q_u32(state, abcd);
+	state[4] = e0;
+}
+
+static bool
+sha1_cpu_has_arm(void)
+{
+	unsigned long hwcap = 0;
+
+#if defined(__linux__)
+	hwcap = getauxval(AT_HWCAP);
+#else
+	if (elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap)) != 0)
+		return (false);
+#endif
+	return ((hwcap & HWCAP_SHA1) != 0);
+}
+#endif
+
+/* The portable rounds, run on every lane at once */
+#define VROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+#define SHA1_VROUND(f, k) do {						\
+	t = VROL(a, 5) + (f) + e + (k) + w[i % 16];			\
+	e = d;								\
+	d = c;								\
+	c = VROL(b, 30);						\
+	b = a;								\
+	a = t;								\
+} while (0)
+
+static inline __attribute__((always_inline)) void
+sha1_lanes_body(sha1_vec *state, const unsigned char **blocks)
+{
+	sha1_vec w[16], a, b, c, d, e, t;
+	int i, l;
+
+	for (i = 0; i < 16; i++)
+		for (l = 0; l < SHA1_LANES; l++)
+			w[i][l] = sha1_load_be32(blocks[l] + i * 4);
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	for (i = 0; i < 80; i++) {
+		if (i >= 16)
+			w[i % 16] = VROL(w[(i - 3) % 16] ^ w[(i - 8) % 16] ^
+			    w[(i - 14) % 16] ^ w[i % 16], 1);
+		if (i < 20)
+			SHA1_VROUND(d ^ (b & (c ^ d)), 0x5a827999);
+		else if (i < 40)
+			SHA1_VROUND(b ^ c ^ d, 0x6ed9eba1);
+		else if (i < 60)
+			SHA1_VROUND((b & c) | (d & (b | c)), 0x8f1bbcdc);
+		else
+			SHA1_VROUND(b ^ c ^ d, 0xca62c1d6);
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+static void
+sha1_lanes_generic(sha1_vec *state, const unsigned char **blocks)
+{
+	sha1_lanes_body(state, blocks);
+}
+
+#ifdef SHA1_X86
+__attribute__((target("avx2")))
+static void
+sha1_lanes_avx2(sha1_vec *state, const unsigned char **blocks)
+{
+	sha1_lanes_body(state, blocks);
+}
+#endif
+
+static void
+sha1_select(void)
+{
+	sha1_blocks = sha1_blocks_portable;
+	sha1_name = "portable";
+	sha1_lanes = sha1_lanes_generic;
+#ifdef SHA1_X86
+	if (__builtin_cpu_supports("avx2"))
+		sha1_lanes = sha1_lanes_avx2;
+	if (sha1_cpu_has_shani()) {
+		sha1_blocks = sha1_blocks_shani;
+		sha1_name = "sha-ni";
+	}
+#endif
+#ifdef SHA1_ARM
+	if (sha1_cpu_has_arm()) {
+		sha1_blocks = sha1_blocks_arm;
+		sha1_name = "armv8";
+	}
+#endif
+}
+
+/* Returns the name of the block function in use */
+const char *
+sha1_backend(void)
+{
+	pthread_once(&sha1_once, sha1_select);
+	return (sha1_name);
+}
+
+void
+sha1_init(SHA1_CTX *ctx)
+{
+	pthread_once(&sha1_once, sha1_select);
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->state[4] = 0xc3d2e1f0;
+	ctx->count = 0;
+}
+
+void
+sha1_update(SHA1_CTX *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t used, n;
+
+	if (len == 0)
+		return;
+	used = ctx->count % SHA1_BLOCK_SIZE;
+	ctx->count += len;
+
+	/* Complete a partial block first */
+	if (used) {
+		n = SHA1_BLOCK_SIZE - used;
+		if (len < n) {
+			memcpy(ctx->buf + used, p, len);
+			return;
+		}
+		memcpy(ctx->buf + used, p, n);
+		sha1_blocks(ctx->state, ctx->buf, 1);
+		p += n;
+		len -= n;
+	}
+
+	/* Whole blocks are hashed in place */
+	n = len / SHA1_BLOCK_SIZE;
+	if (n) {
+		sha1_blocks(ctx->state, p, n);
+		p += n * SHA1_BLOCK_SIZE;
+		len -= n * SHA1_BLOCK_SIZE;
+	}
+	memcpy(ctx->buf, p, len);
+}
+
+void
+sha1_final(unsigned char *digest, SHA1_CTX *ctx)
+{
+	unsigned char pad[SHA1_BLOCK_SIZE + 8];
+	uint64_t bits = ctx->count * 8;
+	size_t padlen;
+	int i;
+
+	/* A 0x80, zeros up to 56 mod 64, then the bit count */
+	padlen = SHA1_BLOCK_SIZE - (ctx->count + 8) % SHA1_BLOCK_SIZE;
+	memset(pad, 0, padlen);
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++)
+		pad[padlen + i] = bits >> (56 - i * 8);
+	sha1_update(ctx, pad, padlen + 8);
+
+	for (i = 0; i < 5; i++) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+}
+
+/*
+ * Finishes the hash into buf as a NUL terminated hex string, like libmd's
+ * SHA1_End. buf is allocated if NULL.
+ */
+char *
+sha1_end(SHA1_CTX *ctx, char *buf)
+{
+	unsigned char digest[SHA1_DIGEST_SIZE];
+	int i;
+
+	if (buf == NULL && (buf = malloc(SHA1_DIGEST_SIZE * 2 + 1)) == NULL)
+		return (NULL);
+	sha1_final(digest, ctx);
+	for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+		snprintf(buf + i * 2, 3, "%02x", digest[i]);
+
+	return (buf);
+}
+
+/*
+ * A message being fed to a lane, block by block: first the partial block
+ * left in its ctx completed with data if there is one, then the whole
+ * blocks of data in place, then the rest padded in tail.
+ */
+struct sha1_lane {
+	int		 msg;		// -1 if the lane is idle
+	bool		 first;		// tail[0] is the next block
+	const unsigned char *head;
+	size_t		 nhead;		// Whole blocks left at head
+	unsigned char	 tail[SHA1_BLOCK_SIZE * 3];
+	int		 tailpos;	// Next padded block in tail
+	int		 ntail;		// Padded blocks left
+};
+
+/* Sets a lane up for msg, whose ctx may have a partial block */
+static void
+sha1_lane_load(struct sha1_lane *lane, sha1_vec *state, int l, int msg,
+    SHA1_CTX *ctx, const unsigned char *data, size_t len)
+{
+	unsigned char *pad = lane->tail + SHA1_BLOCK_SIZE;
+	uint64_t bits = (ctx->count + len) * 8;
+	size_t used, n;
+	int i;
+
+	lane->msg = msg;
+	for (i = 0; i < 5; i++)
+		state[i][l] = ctx->state[i];
+
+	used = ctx->count % SHA1_BLOCK_SIZE;
+	lane->first = used && used + len >= SHA1_BLOCK_SIZE;
+	if (lane->first) {
+		n = SHA1_BLOCK_SIZE - used;
+		memcpy(lane->tail, ctx->buf, used);
+		memcpy(lane->tail + used, data, n);
+		data += n;
+		len -= n;
+		used = 0;
+	}
+	else
+		memcpy(pad, ctx->buf, used);
+
+	lane->head = data;
+	lane->nhead = len / SHA1_BLOCK_SIZE;
+	n = len % SHA1_BLOCK_SIZE;
+	if (n > 0)
+		memcpy(pad + used, data + lane->nhead * SHA1_BLOCK_SIZE, n);
+	used += n;
+
+	pad[used++] = 0x80;
+	while (used % SHA1_BLOCK_SIZE != SHA1_BLOCK_SIZE - 8)
+		pad[used++] = 0;
+	for (i = 0; i < 8; i++)
+		pad[used++] = bits >> (56 - i * 8);
+	lane->tailpos = 1;
+	lane->ntail = used / SHA1_BLOCK_SIZE;
+}
+
+/*
+ * Hashes data into each ctx and finishes it into digest, as calling
+ * sha1_update and sha1_final on each would.
+ */
+void
+sha1_final_many(SHA1_CTX **ctx, const unsigned char **data, const size_t *len,
+    unsigned char **digest, int n)
+{
+	static const unsigned char idle[SHA1_BLOCK_SIZE];
+	struct sha1_lane lane[SHA1_LANES];
+	const unsigned char *blocks[SHA1_LANES];
+	sha1_vec state[5];
+	int active, next, l, m, i;
+
+	pthread_once(&sha1_once, sha1_select);
+
+	/* The SHA instructions beat lanes of the portable rounds */
+	if (sha1_blocks != sha1_blocks_portable || n < 2) {
+		for (m = 0; m < n; m++) {
+			sha1_update(ctx[m], data[m], len[m]);
+			sha1_final(digest[m], ctx[m]);
+		}
+		return;
+	}
+
+	memset(state, 0, sizeof(state));
+	next = 0;
+	active = 0;
+	for (l = 0; l < SHA1_LANES; l++) {
+		lane[l].msg = -1;
+		if (next < n) {
+			sha1_lane_load(&lane[l], state, l, next, ctx[next],
+			    data[next], len[next]);
+			next++;
+			active++;
+		}
+	}
+
+	while (active) {
+		for (l = 0; l < SHA1_LANES; l++) {
+			if (lane[l].msg == -1)
+				blocks[l] = idle;
+			else if (lane[l].first)
+				blocks[l] = lane[l].tail;
+			else if (lane[l].nhead)
+				blocks[l] = lane[l].head;
+			else
+				blocks[l] = lane[l].tail +
+				    lane[l].tailpos * SHA1_BLOCK_SIZE;
+		}
+		sha1_lanes(state, blocks);
+
+		for (l = 0; l < SHA1_LANES; l++) {
+			if (lane[l].msg == -1)
+				continue;
+			if (lane[l].first) {
+				lane[l].first = false;
+				continue;
+			}
+			if (lane[l].nhead) {
+				lane[l].head += SHA1_BLOCK_SIZE;
+				lane[l].nhead--;
+				continue;
+			}
+			lane[l].tailpos++;
+			if (--lane[l].ntail > 0)
+				continue;
+
+			/* Done, hand the lane to the next message */
+			m = lane[l].msg;
+			for (i = 0; i < 5; i++)
+				ctx[m]->state[i] = state[i][l];
+			ctx[m]->count += len[m];
+			for (i = 0; i < 20; i++)
+				digest[m][i] = ctx[m]->state[i / 4] >>
+				    (24 - (i % 4) * 8);
+			lane[l].msg = -1;
+			active--;
+			if (next < n) {
+				sha1_lane_load(&lane[l], state, l, next,
+				    ctx[next], data[next], len[next]);
+				next++;
+				active++;
+			}
+		}
+	}
+}
@@ -0,0 +1,64 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_BLOCK_SIZE		64
+#define SHA1_DIGEST_SIZE	20
+
+/* Messages sha1_final_many hashes side by side, see sha1.c */
+#define SHA1_LANES		8
+
+/*
+ * SHA-1 is computed in lib/sha1.c with the fastest block function the CPU
+ * has, see sha1_backend, rather than by libmd.
+ */
+typedef struct sha1_ctx {
+	uint32_t	state[5];
+	uint64_t	count;			// Bytes hashed so far
+	unsigned char	buf[SHA1_BLOCK_SIZE];	// Partial block
+} SHA1_CTX;
+
+void		 sha1_init(SHA1_CTX *ctx);
+void		 sha1_update(SHA1_CTX *ctx, const void *data, size_t len);
+void		 sha1_final(unsigned char *digest, SHA1_CTX *ctx);
+char		*sha1_end(SHA1_CTX *ctx, char *buf);
+void		 sha1_final_many(SHA1_CTX **ctx, const unsigned char **data, const size_t *len,
+		     unsigned char **digest, int n);
+const char	*sha1_backend(void);
+
+/* The libmd names used throughout the tree */
+#define SHA1_Init(x)		sha1_init(x)
+#define SHA1_Update(x, y, z)	sha1_update(x, y, z)
+#define SHA1_Final(x, y)	sha1_final(x, y)
+#define SHA1_End(x, y)		sha1_end(x, y)
+
+#endif
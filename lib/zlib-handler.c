@@ -32,6 +32,7 @@
 #include <unistd.h>
 #include <string.h>
 #include "common.h"
+#include "crc.h"
 #include "zlib-handler.h"
 
 unsigned char *
@@ -61,7 +62,7 @@ zlib_update_crc(unsigned char *data, int use, void *darg)
 {
 	uLong *crcv = darg;
 	if (crcv)
-		*crcv = crc32(*crcv, data, use);
+		*crcv = crc_update(*crcv, data, use);
 	return (0);
 }
 
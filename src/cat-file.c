@@ -30,6 +30,8 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <dirent.h>
+#include <stdbool.h>
+#include <ctype.h>
 #include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -49,13 +51,37 @@
 
 static struct option long_options[] =
 {
+	{"batch", optional_argument, NULL, 'B'},
+	{"batch-check", optional_argument, NULL, 'C'},
+	{"batch-all-objects", no_argument, NULL, 'A'},
+	{"buffer", no_argument, NULL, 'b'},
 	{NULL, 0, NULL, 0}
 };
 
+/* Format atoms used by --batch and --batch-check */
+#define BATCH_ATOM_DISKSIZE	0x01
+
+struct batch_object {
+	uint8_t		 sha[20];
+	char		 shastr[HASH_SIZE+1];
+	int		 type;
+	unsigned long	 size;
+	off_t		 disksize;
+};
+
+struct batch_options {
+	uint8_t		 cmd;		// CAT_FILE_BATCH or CAT_FILE_BATCH_CHECK
+	const char	*format;
+	uint8_t		 atoms;
+	bool		 all_objects;
+	bool		 buffer;
+};
+
 int
 cat_file_usage(int type)
 {
 	fprintf(stderr, "usage: git cat-file (-t [--allow-unknown-type] | -s [--allow-unknown-type] | -e | -p | <type> | --textconv | --filters) [--path=<path>] <object>\n");
+	fprintf(stderr, "   or: git cat-file (--batch[=<format>] | --batch-check[=<format>]) [--batch-all-objects] [--buffer]\n");
 	fprintf(stderr, "\n");
 	exit(type);
 }
@@ -81,24 +107,12 @@ cat_loose_object_cb(unsigned char *buf, int size, int deflated_bytes, void *arg)
 	if (loosearg->step == 0) {
 		loosearg->step++;
 		hdr_offset = loose_get_headers(buf, size, arg);
-		switch(loosearg->cmd) {
-		case CAT_FILE_TYPE:
-			loose_get_headers(buf, size, loosearg);
-			cat_file_print_type_by_id(loosearg->type);
-			return (NULL);
-		case CAT_FILE_SIZE:
-			printf("%lu\n", loosearg->size);
-			return (NULL);
-		case CAT_FILE_PRINT:
-			size -= hdr_offset;
-			buf += hdr_offset;
+		size -= hdr_offset;
+		buf += hdr_offset;
 
-			loosearg->decompressed_object.size = 0;
-			loosearg->decompressed_object.data = NULL;
-			loosearg->decompressed_object.deflated_size = 0;
-
-			break;
-		}
+		loosearg->decompressed_object.size = 0;
+		loosearg->decompressed_object.data = NULL;
+		loosearg->decompressed_object.deflated_size = 0;
 	}
 
 	/*
@@ -112,95 +126,373 @@ cat_loose_object_cb(unsigned char *buf, int size, int deflated_bytes, void *arg)
 	return (buf);
 }
 
+/* Prints the entries of a tree and frees it */
 static void
-print_tree(char *mode, uint8_t type, char *sha, char *filename, void *args)
+print_tree(struct tree_iter *iter)
 {
-	printf("%06d %s %s\t%s\n", atoi(mode), object_name[type], sha, filename);
+	struct tree_entry entry;
+	char shastr[HASH_SIZE+1];
+
+	while (tree_iter_next(iter, &entry)) {
+		sha_bin_to_str(entry.sha, shastr);
+		shastr[HASH_SIZE] = '\0';
+		printf("%06o %s %s\t%s\n", entry.mode, object_name[entry.type],
+		    shastr, entry.name);
+	}
+	tree_iter_finish(iter);
 }
 
 /* Print out content of pack objects */
 static void
-print_content(int packfd, struct objectinfo *objectinfo, char *sha)
+print_content(struct packfile *packfile, struct objectinfo *objectinfo)
 {
 	if (objectinfo->ftype == OBJ_TREE) {
-		ITERATE_TREE(sha, print_tree, NULL);
+		struct decompressed_object tree;
+		struct tree_iter iter;
+
+		pack_buffer_cb(packfile, objectinfo, &tree);
+		tree_iter_init(&iter, &tree);
+		print_tree(&iter);
 	}
-	else if (objectinfo->ptype != OBJ_OFS_DELTA) {
+	else if (objectinfo->ptype != OBJ_OFS_DELTA &&
+	    objectinfo->ptype != OBJ_REF_DELTA) {
 		struct writer_args writer_args;
 		writer_args.fd = STDOUT_FILENO;
 		writer_args.sent = 0;
-		lseek(packfd, objectinfo->offset + objectinfo->used, SEEK_SET);
-		deflate_caller(packfd, NULL, NULL, write_cb, &writer_args);
+		pack_inflate(packfile, objectinfo->offset + objectinfo->used,
+		    NULL, NULL, write_cb, &writer_args);
 	}
 	else {
-		pack_delta_content(packfd, objectinfo, NULL);
+		pack_delta_content(packfile, objectinfo);
 		write(STDOUT_FILENO, objectinfo->data, objectinfo->isize);
 		free(objectinfo->data);
 		free(objectinfo->deltas);
 	}
 }
 
-/* Print out the size of pack objects */
-void
-print_size(int packfd, struct objectinfo *objectinfo)
-{
-	if (objectinfo->ptype != OBJ_OFS_DELTA) {
-		struct decompressed_object decompressed_object;
-		decompressed_object.size = 0;
-		decompressed_object.data = NULL;
-		lseek(packfd, objectinfo->offset + objectinfo->used, SEEK_SET);
-		deflate_caller(packfd, NULL, NULL, buffer_cb, &decompressed_object);
-		printf("%lu\n", decompressed_object.size);
-	}
-	else {
-		pack_delta_content(packfd, objectinfo, NULL);
-		printf("%lu\n", objectinfo->isize);
-		free(objectinfo->data);
-		free(objectinfo->deltas);
-	}
-}
-
 /* Used by pack_content_handler to output packfile by flags */
 void
-cat_file_pack_handler(int packfd, struct objectinfo *objectinfo, void *pargs)
+cat_file_pack_handler(struct packfile *packfile, struct objectinfo *objectinfo, void *pargs)
 {
 	struct loosearg *loosearg = pargs;
 
 	switch(loosearg->cmd) {
 		case CAT_FILE_PRINT:
-			print_content(packfd, objectinfo, loosearg->sha);
-			break;
-		case CAT_FILE_SIZE:
-			print_size(packfd, objectinfo);
-			break;
-		case CAT_FILE_TYPE:
-			cat_file_print_type_by_id(objectinfo->ftype);
+			print_content(packfile, objectinfo);
 			break;
 	}
 }
 
+/*
+ * Prints the type or size of an object, both of which come from the
+ * object's headers without inflating its content.
+ */
+void
+cat_file_print_info(char *sha_str, uint8_t flags)
+{
+	uint8_t sha[20];
+	unsigned long size;
+	int type;
+
+	sha_str_to_bin_network(sha_str, sha);
+	if (object_info(sha, &type, &size)) {
+		fprintf(stderr, "fatal: Not a valid object name %s\n", sha_str);
+		exit(128);
+	}
+
+	if (flags == CAT_FILE_TYPE)
+		cat_file_print_type_by_id(type);
+	else
+		printf("%lu\n", size);
+}
+
 /*
  * This function will print out the object in the intended format.
  * While the CONTENT_HANDLER callback ordinarily is sufficient to process the content
  * here the cat_loose_object_cb handler only stores the object in its decompressed_object
- * member. Afterwards, the object is printed using iterate_tree (not ITERATE_TREE). This
+ * member. Afterwards, the object is printed by print_tree from that buffer. This
  * is a special case to prevent unnecessarily double-reading a loose object's header.
  */
 void
 cat_file_get_content(char *sha_str, uint8_t flags)
 {
 	struct loosearg loosearg;
+	uint8_t sha[20];
 
 	loosearg.fd = STDOUT_FILENO;
 	loosearg.cmd = flags;
 	loosearg.step = 0;
 	loosearg.sent = 0;
-	loosearg.sha = sha_str;
 
-	CONTENT_HANDLER(sha_str, cat_loose_object_cb, cat_file_pack_handler, &loosearg);
+	sha_str_to_bin_network(sha_str, sha);
+	CONTENT_HANDLER(sha, cat_loose_object_cb, cat_file_pack_handler, &loosearg);
 	if (loosearg.type == OBJ_TREE) {
-		iterate_tree(&loosearg.decompressed_object, print_tree, NULL);
+		struct tree_iter iter;
+
+		tree_iter_init(&iter, &loosearg.decompressed_object);
+		print_tree(&iter);
+	}
+}
+
+/*
+ * Checks the atoms of a --batch format, noting those that cost more than
+ * the object's headers to answer.
+ */
+static void
+cat_file_batch_parse_format(struct batch_options *opts)
+{
+	const char *p, *end;
+	size_t len;
+
+	for (p = opts->format; (p = strstr(p, "%(")) != NULL; p = end + 1) {
+		end = strchr(p, ')');
+		if (end == NULL)
+			break;
+		p += 2;
+		len = end - p;
+		if (len == 15 && !strncmp(p, "objectsize:disk", len))
+			opts->atoms |= BATCH_ATOM_DISKSIZE;
+		else if ((len == 10 && !strncmp(p, "objectname", len)) ||
+		    (len == 10 && !strncmp(p, "objecttype", len)) ||
+		    (len == 10 && !strncmp(p, "objectsize", len)) ||
+		    (len == 4 && !strncmp(p, "rest", len)))
+			continue;
+		else {
+			fprintf(stderr, "fatal: unknown format element: %.*s\n",
+			    (int)len, p);
+			exit(128);
+		}
+	}
+}
+
+static void
+cat_file_batch_expand(struct batch_options *opts, struct batch_object *obj,
+    const char *rest)
+{
+	const char *p, *end;
+
+	for (p = opts->format; *p; p++) {
+		if (p[0] != '%' || p[1] != '(' ||
+		    (end = strchr(p, ')')) == NULL) {
+			putchar(*p);
+			continue;
+		}
+		p += 2;
+		if (!strncmp(p, "objectname)", 11))
+			fputs(obj->shastr, stdout);
+		else if (!strncmp(p, "objecttype)", 11))
+			fputs(object_name[obj->type], stdout);
+		else if (!strncmp(p, "objectsize)", 11))
+			printf("%lu", obj->size);
+		else if (!strncmp(p, "objectsize:disk)", 16))
+			printf("%jd", (intmax_t)obj->disksize);
+		else if (!strncmp(p, "rest)", 5))
+			fputs(rest, stdout);
+		p = end;
+	}
+	putchar('\n');
+}
+
+/*
+ * Looks up the type and size of an object from its headers, and its size
+ * on disk if the format asks for it. Returns -1 if it does not exist.
+ */
+static int
+cat_file_batch_info(struct batch_options *opts, struct batch_object *obj)
+{
+	struct packfile *packfile;
+	char shastr[HASH_SIZE+1];
+	struct stat sb;
+	off_t offset;
+	int objectfd;
+
+	if (loose_object_info(obj->sha, &obj->type, &obj->size) == 0) {
+		if (opts->atoms & BATCH_ATOM_DISKSIZE) {
+			objectfd = loose_open(obj->sha, shastr);
+			obj->disksize = (objectfd != -1 &&
+			    fstat(objectfd, &sb) == 0) ? sb.st_size : 0;
+			if (objectfd != -1)
+				close(objectfd);
+		}
+		return (0);
+	}
+
+	packfile = pack_registry_lookup(obj->sha, &offset);
+	if (packfile == NULL ||
+	    pack_object_info(packfile, offset, &obj->type, &obj->size))
+		return (-1);
+	if (opts->atoms & BATCH_ATOM_DISKSIZE)
+		obj->disksize = pack_object_disk_size(packfile, offset);
+
+	return (0);
+}
+
+static void
+cat_file_batch_one(struct batch_options *opts, const char *name,
+    const char *rest)
+{
+	struct batch_object obj;
+	unsigned char *data;
+	unsigned long size;
+	int type, n;
+
+	for (n = 0; n < HASH_SIZE && isxdigit((unsigned char)name[n]); n++)
+		;
+	if (n != HASH_SIZE || name[n] != '\0') {
+		printf("%s missing\n", name);
+		return;
+	}
+	for (n = 0; n < HASH_SIZE; n++)
+		obj.shastr[n] = tolower((unsigned char)name[n]);
+	obj.shastr[HASH_SIZE] = '\0';
+	sha_str_to_bin_network(obj.shastr, obj.sha);
+
+	if (cat_file_batch_info(opts, &obj)) {
+		printf("%s missing\n", name);
+		return;
 	}
+	cat_file_batch_expand(opts, &obj, rest);
+
+	if (opts->cmd == CAT_FILE_BATCH) {
+		data = object_read(obj.sha, &type, &size);
+		fwrite(data, 1, size, stdout);
+		putchar('\n');
+		free(data);
+	}
+}
+
+static int
+cat_file_sha_cmp(const void *a, const void *b)
+{
+	return (memcmp(a, b, 20));
+}
+
+/*
+ * Lists every loose and packed object, sorted and without duplicates.
+ * Returns the number of objects.
+ */
+static int
+cat_file_all_objects(uint8_t (**shasp)[20])
+{
+	DIR *d;
+	struct dirent *dir;
+	struct packfile *packfile;
+	struct fan *fans;
+	uint8_t (*shas)[20];
+	char path[PATH_MAX], shastr[HASH_SIZE+1];
+	char *file_ext;
+	int nshas, maxshas, nobjects;
+	int n, x;
+
+	maxshas = 1024;
+	shas = malloc(sizeof(*shas) * maxshas);
+	nshas = 0;
+
+	/* Loose objects */
+	for (n = 0; n < 256; n++) {
+		snprintf(path, sizeof(path), "%s/objects/%02x", dotgitpath, n);
+		d = opendir(path);
+		if (d == NULL)
+			continue;
+		while ((dir = readdir(d)) != NULL) {
+			if (strlen(dir->d_name) != HASH_SIZE - 2)
+				continue;
+			snprintf(shastr, sizeof(shastr), "%02x%s", n,
+			    dir->d_name);
+			if (nshas == maxshas) {
+				maxshas *= 2;
+				shas = realloc(shas, sizeof(*shas) * maxshas);
+			}
+			sha_str_to_bin_network(shastr, shas[nshas++]);
+		}
+		closedir(d);
+	}
+
+	/* Packed objects */
+	snprintf(path, sizeof(path), "%s/objects/pack", dotgitpath);
+	d = opendir(path);
+	while (d != NULL && (dir = readdir(d)) != NULL) {
+		file_ext = strrchr(dir->d_name, '.');
+		if (!file_ext || strncmp(file_ext, ".idx", 5))
+			continue;
+		snprintf(path, sizeof(path), "%s/objects/pack/%s", dotgitpath,
+		    dir->d_name);
+		packfile = pack_registry_get(path);
+		if (packfile == NULL)
+			continue;
+		fans = (struct fan *)(packfile->idxmap + 8);
+		nobjects = ntohl(fans->count[255]);
+		for (x = 0; x < nobjects; x++) {
+			if (nshas == maxshas) {
+				maxshas *= 2;
+				shas = realloc(shas, sizeof(*shas) * maxshas);
+			}
+			memcpy(shas[nshas++], packfile->idxmap + 8 +
+			    sizeof(struct fan) + x * sizeof(struct entry), 20);
+		}
+	}
+	if (d != NULL)
+		closedir(d);
+
+	qsort(shas, nshas, sizeof(*shas), cat_file_sha_cmp);
+	for (n = x = 0; n < nshas; n++)
+		if (x == 0 || memcmp(shas[n], shas[x-1], 20))
+			memcpy(shas[x++], shas[n], 20);
+
+	*shasp = shas;
+	return (x);
+}
+
+/*
+ * Answers --batch and --batch-check requests for every object name read
+ * from stdin, or every object in the repository, in one process so the
+ * pack mappings and caches stay warm. Output is flushed per object unless
+ * --buffer was given.
+ */
+static void
+cat_file_batch(struct batch_options *opts)
+{
+	uint8_t (*shas)[20];
+	char shastr[HASH_SIZE+1];
+	char *line, *rest;
+	size_t linecap;
+	ssize_t len;
+	int nshas, n;
+
+	cat_file_batch_parse_format(opts);
+	setvbuf(stdout, NULL, _IOFBF, CHUNK);
+
+	if (opts->all_objects) {
+		nshas = cat_file_all_objects(&shas);
+		for (n = 0; n < nshas; n++) {
+			sha_bin_to_str(shas[n], shastr);
+			shastr[HASH_SIZE] = '\0';
+			cat_file_batch_one(opts, shastr, "");
+			if (!opts->buffer)
+				fflush(stdout);
+		}
+		free(shas);
+		fflush(stdout);
+		return;
+	}
+
+	line = NULL;
+	linecap = 0;
+	while ((len = getline(&line, &linecap, stdin)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		/* The object name ends at the first whitespace */
+		rest = line + strcspn(line, " \t");
+		if (*rest != '\0') {
+			*rest++ = '\0';
+			rest += strspn(rest, " \t");
+		}
+		cat_file_batch_one(opts, line, rest);
+		if (!opts->buffer)
+			fflush(stdout);
+	}
+	free(line);
+	fflush(stdout);
 }
 
 int
@@ -208,11 +500,15 @@ cat_file_main(int argc, char *argv[])
 {
 	int ret = 0;
 	int ch;
-	char *sha_str;
+	char *sha_str = NULL;
 	uint8_t flags = 0;
+	struct batch_options opts;
 
 	argc--; argv++;
 
+	bzero(&opts, sizeof(struct batch_options));
+	opts.format = "%(objectname) %(objecttype) %(objectsize)";
+
 	while((ch = getopt_long(argc, argv, "p:t:s:", long_options, NULL)) != -1)
 		switch(ch) {
 		case 'p':
@@ -233,6 +529,18 @@ cat_file_main(int argc, char *argv[])
 			sha_str = argv[1];
 			flags = CAT_FILE_SIZE;
 			break;
+		case 'B':
+		case 'C':
+			flags = (ch == 'B') ? CAT_FILE_BATCH : CAT_FILE_BATCH_CHECK;
+			if (optarg)
+				opts.format = optarg;
+			break;
+		case 'A':
+			opts.all_objects = true;
+			break;
+		case 'b':
+			opts.buffer = true;
+			break;
 		default:
 			printf("cat-file: Currently not implemented\n");
 			cat_file_usage(0);
@@ -242,13 +550,38 @@ cat_file_main(int argc, char *argv[])
 		fprintf(stderr, "fatal: not a git repository (or any of the parent directories): .git");
 		exit(0);
 	}
+	config_parser();
+
+	if (sha_str == NULL && (flags == CAT_FILE_PRINT ||
+	    flags == CAT_FILE_TYPE || flags == CAT_FILE_SIZE)) {
+		fprintf(stderr, "fatal: <object> required with '-%c'\n",
+		    flags == CAT_FILE_PRINT ? 'p' :
+		    flags == CAT_FILE_TYPE ? 't' : 's');
+		cat_file_usage(129);
+	}
 
 	switch(flags) {
 		case CAT_FILE_PRINT:
+			cat_file_get_content(sha_str, flags);
+			break;
 		case CAT_FILE_TYPE:
 		case CAT_FILE_SIZE:
-			cat_file_get_content(sha_str, flags);
+			cat_file_print_info(sha_str, flags);
+			break;
+		case CAT_FILE_BATCH:
+		case CAT_FILE_BATCH_CHECK:
+			opts.cmd = flags;
+			cat_file_batch(&opts);
+			break;
+		default:
+			cat_file_usage(129);
 	}
+#ifdef NDEBUG
+	struct delta_cache_stats stats;
+	pack_delta_cache_get_stats(&stats);
+	fprintf(stderr, "debug: delta base cache: %lu hits, %lu misses, %lu evictions\n",
+	    stats.hits, stats.misses, stats.evictions);
+#endif
 
 	return (ret);
 }
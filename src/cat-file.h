@@ -34,8 +34,11 @@
 #define CAT_FILE_PRINT		0x02
 #define CAT_FILE_SIZE		0x04
 #define CAT_FILE_EXIT		0x08
+#define CAT_FILE_BATCH		0x10
+#define CAT_FILE_BATCH_CHECK	0x20
 
 void	cat_file_get_content(char *sha_str, uint8_t flags);
+void	cat_file_print_info(char *sha_str, uint8_t flags);
 int	cat_file_get_content_loose(char *sha_str, uint8_t flags);
 void	cat_file_get_content_pack(char *sha_str, uint8_t flags);
 int	cat_file_main(int argc, char *argv[]);
@@ -27,6 +27,7 @@
 
 #include <sys/stat.h>
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,6 +38,7 @@
 #include <errno.h>
 #include "lib/common.h"
 #include "lib/pack.h"
+#include "lib/bitmap.h"
 #include "lib/index.h"
 #include "lib/ini.h"
 #include "lib/loose.h"
@@ -66,11 +68,23 @@ static struct clone_handler clone_handlers[] = {
 /* XXX Assume ssh by default? */
 static struct clone_handler *default_handler = NULL;
 
+/* Checkout workers, from checkout.workers or --jobs. Below 1 is per CPU */
+static int workers;
+
 static struct option long_options[] =
 {
+	{"jobs", required_argument, NULL, 'j'},
 	{NULL, 0, NULL, 0}
 };
 
+/* The files of a checkout, written by clone_checkout_worker */
+struct clone_checkout {
+	struct indextree	*indextree;
+	char			*repodir;
+	int			 next;		// The next index entry to claim
+	pthread_mutex_t		 lock;
+};
+
 /*
  * Gets the git directory name from the path
  * Will expand if the path is a bare repo, does not have a name, et al
@@ -186,35 +200,135 @@ clone_initial_config(char *uri, char *repodir)
 }
 
 /*
- * Description: Used to loop through each tree object and iteratively
- * through each sub-tree object.
- * Handler for iterate_tree
+ * Description: Walks the tree sha under indexpath->fullpath, descending
+ * into each sub-tree. Directories are created as they are met and every
+ * file is added to the index and counted in the TREE extension, in tree
+ * order. The files themselves are written by clone_checkout_files.
  */
-void
-generate_tree_item(char *mode, uint8_t type, char *sha, char *filename, void *arg)
+static void
+clone_checkout_tree(struct indexpath *indexpath, uint8_t *sha)
 {
-	char *prefix = arg;
-	char *buildpath = prefix;
-	char *fn = prefix + strlen(prefix);
-	int imode;
-
-	imode = strtol(mode+2, 0, 8);
-	snprintf(fn, PATH_MAX, "/%s", filename);
-	if (type == OBJ_TREE) {
-		mkdir(buildpath, 0777);
-		ITERATE_TREE(sha, generate_tree_item, prefix);
+	struct tree_iter iter;
+	struct tree_entry entry;
+	struct stat sb;
+	char *fn = indexpath->path + strlen(indexpath->path);
+	size_t fnsize = PATH_MAX - (fn - indexpath->fullpath);
+	int local_position;
+
+	tree_iter_read(&iter, sha);
+	while (tree_iter_next(&iter, &entry)) {
+		strlcpy(fn, entry.name, fnsize);
+		if (entry.type == OBJ_TREE) {
+			mkdir(indexpath->fullpath, 0777);
+			strlcat(fn, "/", fnsize);
+			local_position = index_enter_tree(indexpath, &entry);
+			clone_checkout_tree(indexpath, entry.sha);
+			index_leave_tree(indexpath, local_position);
+		}
+		else if (entry.type == OBJ_COMMIT) {
+			/* A submodule is checked out as an empty directory */
+			mkdir(indexpath->fullpath, 0777);
+			if (stat(indexpath->fullpath, &sb) == -1) {
+				fprintf(stderr, "fatal: unable to stat '%s'\n",
+				    indexpath->fullpath);
+				exit(128);
+			}
+			index_add_entry(indexpath, &entry, &sb);
+		}
+		else
+			index_add_entry(indexpath, &entry, NULL);
+		*fn = '\0';
 	}
-	else {
-		struct writer_args writer_args;
-		int buildfd;
+	tree_iter_finish(&iter);
+}
+
+/*
+ * Claims index entries one at a time and writes their files, setting the
+ * stat data of each entry from the descriptor it was written through.
+ */
+static void *
+clone_checkout_worker(void *arg)
+{
+	struct clone_checkout *checkout = arg;
+	struct writer_args writer_args;
+	struct dircleaf *dircleaf;
+	struct stat sb;
+	char path[PATH_MAX];
+	int buildfd, n;
+
+	for (;;) {
+		pthread_mutex_lock(&checkout->lock);
+		n = checkout->next++;
+		pthread_mutex_unlock(&checkout->lock);
+		if (n >= checkout->indextree->entries)
+			break;
+
+		dircleaf = &checkout->indextree->dircleaf[n];
+		if (dircleaf->mode == S_IFGITLINK)
+			continue;
 
-		buildfd = open(buildpath, O_CREAT|O_WRONLY, imode);
+		snprintf(path, sizeof(path), "%s/%s", checkout->repodir,
+		    dircleaf->name);
+		buildfd = open(path, O_CREAT|O_WRONLY, dircleaf->mode & 0777);
+		if (buildfd == -1) {
+			fprintf(stderr, "fatal: unable to create file '%s'\n",
+			    path);
+			exit(128);
+		}
 		writer_args.fd = buildfd;
 		writer_args.sent = 0;
 
-		CONTENT_HANDLER(sha, write_cb, write_pack_cb, &writer_args);
+		CONTENT_HANDLER(dircleaf->sha, write_cb, write_pack_cb,
+		    &writer_args);
+		if (fstat(buildfd, &sb) == -1) {
+			fprintf(stderr, "fatal: unable to stat '%s'\n", path);
+			exit(128);
+		}
+		close(buildfd);
+		index_entry_stat(dircleaf, &sb);
 	}
-	*fn = '\0';
+
+	return (NULL);
+}
+
+/*
+ * Writes the files of the index entries built by clone_checkout_tree under
+ * repodir, with nworkers threads, or one per online CPU if nworkers is
+ * below 1. The entries are claimed in order but may complete in any order,
+ * each one only sets its own stat data so the index does not depend on it.
+ */
+static void
+clone_checkout_files(struct indextree *indextree, char *repodir, int nworkers)
+{
+	struct clone_checkout checkout;
+	pthread_t *threads;
+	int n;
+
+	if (nworkers < 1)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers > indextree->entries)
+		nworkers = indextree->entries;
+	if (nworkers < 1)
+		nworkers = 1;
+
+	checkout.indextree = indextree;
+	checkout.repodir = repodir;
+	checkout.next = 0;
+	pthread_mutex_init(&checkout.lock, NULL);
+
+	/* The calling thread is one of the workers */
+	threads = malloc(sizeof(pthread_t) * nworkers);
+	for (n = 1; n < nworkers; n++)
+		if (pthread_create(&threads[n], NULL, clone_checkout_worker,
+		    &checkout)) {
+			fprintf(stderr, "fatal: unable to create thread\n");
+			exit(128);
+		}
+	clone_checkout_worker(&checkout);
+	for (n = 1; n < nworkers; n++)
+		pthread_join(threads[n], NULL);
+	free(threads);
+	pthread_mutex_destroy(&checkout.lock);
 }
 
 static int
@@ -257,7 +371,8 @@ clone_build_post_content(const char *sha, char **content)
 }
 
 static void
-clone_generic_get_pack(struct clone_handler *chandler, int packfd, struct smart_head *smart_head)
+clone_generic_get_pack(struct clone_handler *chandler, struct pack_stream *pstream,
+    struct smart_head *smart_head)
 {
 	char *content = NULL;
 	FILE *stream;
@@ -265,7 +380,7 @@ clone_generic_get_pack(struct clone_handler *chandler, int packfd, struct smart_
 	clone_build_post_content(smart_head->sha, &content);
 	stream = chandler->get_pack_stream(chandler, content);
 
-	proto_process_pack(packfd, stream);
+	proto_process_pack(pstream, stream);
 
 	fclose(stream);
 	free(content);
@@ -276,17 +391,19 @@ clone_generic(struct clone_handler *chandler, char *repodir,
 	struct smart_head *smart_head)
 {
 	int packfd;
-	int offset;
 	int idxfd;
+	int revfd;
 	struct packfileinfo packfileinfo;
 	struct index_entry *index_entry;
+	struct pack_stream *pstream;
+	struct packfile *packfile;
+	uint8_t head[20];
 	char path[PATH_MAX];
 	char srcpath[PATH_MAX];
 	int ret;
 	FILE *stream;
 	char *response;
 	char *newpath;
-	SHA1_CTX packctx;
 	SHA1_CTX idxctx;
 
 	strlcpy(path, dotgitpath, PATH_MAX);
@@ -362,23 +479,19 @@ again:
 	ret = proto_parse_response(response, smart_head);
 	if (ret)
 		goto out;
-	clone_generic_get_pack(chandler, packfd, smart_head);
-
-	/* Jump to the beginning of the file */
-	lseek(packfd, 0, SEEK_SET);
 
-	SHA1_Init(&packctx);
-	SHA1_Init(&idxctx);
-
-	offset = pack_parse_header(packfd, &packfileinfo, &packctx);
-	index_entry = malloc(sizeof(struct index_entry) * packfileinfo.nobjects);
-	(void)pack_get_object_meta(packfd, offset, &packfileinfo,
-	    index_entry, &packctx, &idxctx);
-	//offset = pack_get_object_meta(packfd, offset, &packfileinfo,
-	//    index_entry, &packctx, &idxctx);
+	/* The pack is indexed as it arrives, only its deltas are left after */
+	pstream = pack_stream_open(packfd);
+	clone_generic_get_pack(chandler, pstream, smart_head);
+	ret = pack_stream_close(pstream, &packfileinfo, &index_entry, 0);
 	close(packfd);
-
-	SHA1_Final(packfileinfo.sha, &packctx);
+	SHA1_Init(&idxctx);
+	if (ret > 0) {
+		fprintf(stderr, "fatal: pack has %d unresolved deltas\n", ret);
+		free(index_entry);
+		ret = -1;
+		goto out;
+	}
 
 	/* Sort the index entry */
 	qsort(index_entry, packfileinfo.nobjects, sizeof(struct index_entry),
@@ -393,9 +506,19 @@ again:
 		goto out;
 	}
 
-	pack_build_index(idxfd, &packfileinfo, index_entry, &idxctx);
+	strlcpy(path+strlen(path)-3, "rev", 4);
+	revfd = open(path, O_RDWR | O_CREAT, 0660);
+	if (revfd == -1) {
+		fprintf(stderr, "Unable to open %s for writing.\n", path);
+		close(idxfd);
+		ret = -1;
+		goto out;
+	}
+
+	pack_build_index(idxfd, revfd, &packfileinfo, index_entry, &idxctx);
 	free(index_entry);
 	close(idxfd);
+	close(revfd);
 
 	char *suffix = path;
 	strncpy(path, dotgitpath, PATH_MAX);
@@ -413,6 +536,17 @@ again:
 	strlcpy(srcpath+strlen(srcpath)-4, "idx", 4);
 	strlcpy(path+strlen(path)-4, "idx", 4);
 	rename(srcpath, path);
+
+	strlcpy(srcpath+strlen(srcpath)-3, "rev", 4);
+	strlcpy(path+strlen(path)-3, "rev", 4);
+	rename(srcpath, path);
+
+	/* Only HEAD was wanted, so the pack has exactly what it reaches */
+	strlcpy(path+strlen(path)-3, "idx", 4);
+	sha_str_to_bin_network(smart_head->sha, head);
+	packfile = pack_registry_get(path);
+	if (packfile == NULL || bitmap_write(packfile, &head, 1))
+		fprintf(stderr, "warning: failed to write the bitmap index\n");
 	ret = 0;
 out:
 	return (ret);
@@ -451,27 +585,45 @@ clone_main(int argc, char *argv[])
 	struct treeleaf treeleaf;
 	struct decompressed_object decompressed_object;
 	struct commitcontent commitcontent;
+	uint8_t headsha[20];
 	int nch, ret = 0;
 	int packfd;
 	int ch;
 	int e;
-	int q = 0;
 	bool found;
+	struct section *section;
+	char *endptr;
 
 	argc--; argv++;
 
-	while((ch = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+	/* There is no repository yet, so only the user's config applies */
+	workers = 1;
+	config_parser_global();
+	for (section = sections; section; section = section->next)
+		if (section->type == CHECKOUT)
+			workers = section->workers;
+
+	while((ch = getopt_long(argc, argv, "j:", long_options, NULL)) != -1)
 		switch(ch) {
 		case 0:
 			break;
 		case 1:
 			break;
+		case 'j':
+			workers = strtol(optarg, &endptr, 10);
+			if (*optarg == '\0' || *endptr != '\0') {
+				fprintf(stderr, "fatal: invalid number of jobs "
+				    "specified (%s)\n", optarg);
+				exit(128);
+			}
+			break;
 		default:
 			printf("Currently not implemented\n");
 			return (-1);
 		}
-	argc = argc - q;
-	argv = argv + q;
+	/* Keep argv[1] the repository, as without options */
+	argc = argc - optind + 1;
+	argv = argv + optind - 1;
 
 	uri = argv[1];
 	repodir = get_repo_dir(argv[1]);
@@ -539,39 +691,41 @@ clone_main(int argc, char *argv[])
 	write_refs_head_sha(&smart_head, repodir);
 
 	/* Retrieve the commit header and parse it out */
-	CONTENT_HANDLER(smart_head.sha, buffer_cb, pack_buffer_cb,
+	sha_str_to_bin_network(smart_head.sha, headsha);
+	CONTENT_HANDLER(headsha, buffer_cb, pack_buffer_cb,
 		&decompressed_object);
 	parse_commitcontent(&commitcontent, (char *)decompressed_object.data,
 		decompressed_object.size);
 
-	strlcpy(inodepath, repodir, PATH_MAX);
-	ITERATE_TREE(commitcontent.treesha, generate_tree_item, inodepath);
-
 	indextree.version = INDEX_VERSION_2;
 	indextree.entries = 0;
-	indexpath.indextree = &indextree;
-	e = snprintf(inodepath, PATH_MAX, "%s/", repodir);
-	indexpath.fullpath = inodepath;
-	indexpath.path = (char *)inodepath + e;
-
 	indextree.dircleaf = NULL;
 	indextree.treeleaf = &treeleaf;
 
-	/* Terminate the string */
-	indexpath.path[0] = '\0';
-
-	ITERATE_TREE(commitcontent.treesha, index_generate_indextree, &indexpath);
-
 	treeleaf.entry_count = 0;
 	treeleaf.local_tree_count = 0;
 	treeleaf.total_tree_count = 0;
 	treeleaf.subtree = NULL;
-	sha_str_to_bin(commitcontent.treesha, treeleaf.sha);
+	treeleaf.ext_size = 0;
+	memcpy(treeleaf.sha, commitcontent.treesha, 20);
 
+	indexpath.indextree = &indextree;
+	e = snprintf(inodepath, PATH_MAX, "%s/", repodir);
+	indexpath.fullpath = inodepath;
+	indexpath.path = (char *)inodepath + e;
 	indexpath.current_position = 0;
 
-	treeleaf.ext_size = 0;
-	ITERATE_TREE(commitcontent.treesha, index_generate_treedata, &indexpath);
+	/* Terminate the string */
+	indexpath.path[0] = '\0';
+
+	clone_checkout_tree(&indexpath, commitcontent.treesha);
+	clone_checkout_files(&indextree, repodir, workers);
+#ifdef NDEBUG
+	struct delta_cache_stats stats;
+	pack_delta_cache_get_stats(&stats);
+	fprintf(stderr, "debug: delta base cache: %lu hits, %lu misses, %lu evictions\n",
+	    stats.hits, stats.misses, stats.evictions);
+#endif
 
 	index_calculate_tree_ext_size(&treeleaf);
 
@@ -586,7 +740,7 @@ clone_main(int argc, char *argv[])
 
 out:
 	free(repodir);
-//	free(treeleaf.subtree); /* Allocated by index_generate_treedata */
+//	free(treeleaf.subtree); /* Allocated by index_enter_tree */
 
 	return (ret);
 }
@@ -29,6 +29,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -46,7 +47,7 @@
 static struct option long_options[] =
 {
 	{"stdin", no_argument, NULL, 1},
-	{"stdin-paths", no_argument, NULL, 0},
+	{"stdin-paths", no_argument, NULL, 2},
 	{"no-filters", no_argument, NULL, 0},
 	{"literally", no_argument, NULL, 0},
 	{"path", required_argument, NULL, 0},
@@ -93,51 +94,82 @@ add_zlib_content(z_stream *strm, FILE *dest, int flush)
 	return ret;
 }
 
+/*
+ * Computes the checksums of n objects of the same type, which are hashed
+ * side by side, see sha1_final_many.
+ */
+static void
+hash_object_digest_many(struct decompressed_object *dobjects, int n, int objtype,
+    char (*checksums)[HEX_DIGEST_LENGTH])
+{
+	SHA1_CTX context[SHA1_LANES], *contextp[SHA1_LANES];
+	const unsigned char *data[SHA1_LANES];
+	unsigned char digest[SHA1_LANES][SHA1_DIGEST_SIZE], *digestp[SHA1_LANES];
+	size_t size[SHA1_LANES];
+	char hdr[32];
+	int hdrlen, x;
+
+	for (x = 0; x < n; x++) {
+		hdrlen = snprintf(hdr, sizeof(hdr), "%s %ld",
+		    object_name[objtype], dobjects[x].size) + 1;
+		SHA1_Init(&context[x]);
+		SHA1_Update(&context[x], hdr, hdrlen);
+		contextp[x] = &context[x];
+		data[x] = dobjects[x].data;
+		size[x] = dobjects[x].size;
+		digestp[x] = digest[x];
+	}
+	sha1_final_many(contextp, data, size, digestp, n);
+
+	for (x = 0; x < n; x++) {
+		sha_bin_to_str(digest[x], checksums[x]);
+		checksums[x][HASH_SIZE] = '\0';
+	}
+}
+
 static int
-hash_object_write(uint8_t flags, struct decompressed_object dobject, int objtype)
+hash_object_write(uint8_t flags, struct decompressed_object dobject, int objtype,
+    char *checksum)
 {
 	int r;
 	int flush;
 	int destfd;
 	int used = 0;
 	FILE *dest;
-	char checksum[HEX_DIGEST_LENGTH];
 	char tpath[PATH_MAX];
 	char objpath[PATH_MAX];
-	SHA1_CTX context;
 	Bytef in[CHUNK];
 	z_stream strm;
 
+	/* The checksum is already known, only the object is left to write */
+	if ((flags & CMD_HASH_OBJECT_WRITE) == 0)
+		goto out;
+
 	strm.avail_in = snprintf((char*)in, CHUNK, "%s %ld", object_name[objtype], dobject.size) + 1;
-	SHA1_Init(&context);
-	SHA1_Update(&context, in, strm.avail_in);
-
-	if (flags & CMD_HASH_OBJECT_WRITE) {
-		strm.next_in = in;
-		strlcpy(tpath, dotgitpath, PATH_MAX);
-		strlcat(tpath, "/objects/obj.XXXXXX", PATH_MAX);
-
-		strm.zalloc = Z_NULL;
-		strm.zfree = Z_NULL;
-		strm.opaque = Z_NULL;
-		r = deflateInit(&strm, Z_BEST_SPEED);
-		if (r != Z_OK) {
-			fprintf(stderr, "Unable to initiate zlib object, exiting.\n");
-			exit(r);
-		}
+	strm.next_in = in;
+	strlcpy(tpath, dotgitpath, PATH_MAX);
+	strlcat(tpath, "/objects/obj.XXXXXX", PATH_MAX);
 
-		destfd = mkstemp(tpath);
-		if (destfd == -1) {
-			fprintf(stderr, "Unable to temporary file %s, exiting.\n", tpath);
-			exit(0);
-		}
-		dest = fdopen(destfd, "w");
-		if (dest == NULL) {
-			fprintf(stderr, "Unable to fdopen() file, exiting.\n");
-			exit(0);
-		}
-		add_zlib_content(&strm, dest, Z_NO_FLUSH);
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	r = deflateInit(&strm, Z_BEST_SPEED);
+	if (r != Z_OK) {
+		fprintf(stderr, "Unable to initiate zlib object, exiting.\n");
+		exit(r);
+	}
+
+	destfd = mkstemp(tpath);
+	if (destfd == -1) {
+		fprintf(stderr, "Unable to temporary file %s, exiting.\n", tpath);
+		exit(0);
+	}
+	dest = fdopen(destfd, "w");
+	if (dest == NULL) {
+		fprintf(stderr, "Unable to fdopen() file, exiting.\n");
+		exit(0);
 	}
+	add_zlib_content(&strm, dest, Z_NO_FLUSH);
 
 	do {
 		strm.next_in = dobject.data + used;
@@ -149,30 +181,142 @@ hash_object_write(uint8_t flags, struct decompressed_object dobject, int objtype
 			strm.avail_in = CHUNK;
 			flush = Z_NO_FLUSH;
 		}
-		SHA1_Update(&context, dobject.data+used, strm.avail_in);
 		used = used + CHUNK;
 
-		if (flags & CMD_HASH_OBJECT_WRITE)
-			r = add_zlib_content(&strm, dest, flush);
+		r = add_zlib_content(&strm, dest, flush);
 	} while(flush != Z_FINISH);
 
-	SHA1_End(&context, checksum);
+	assert(r == Z_STREAM_END);
+	(void)deflateEnd(&strm);
+	fclose(dest);
+
+	/* Build the object directory prefix */
+	snprintf(objpath, PATH_MAX, "%s/objects/%c%c/", dotgitpath,
+	    checksum[0], checksum[1]);
+	mkdir(objpath, 0755);
+
+	/* Add the rest of the checksum path */
+	strlcat(objpath+3, checksum+2, sizeof(objpath)-3);
+	rename(tpath, objpath);
+
+out:
+	printf("%s\n", checksum);
+	return (0);
+}
+
+/*
+ * Hashes, and writes with -w, the files in paths. They are mapped and
+ * hashed SHA1_LANES at a time, which pays off for many small files.
+ */
+static int
+hash_object_files(uint8_t flags, char **paths, int npaths)
+{
+	struct decompressed_object dobjects[SHA1_LANES];
+	char checksums[SHA1_LANES][HEX_DIGEST_LENGTH];
+	struct stat sb;
+	int first, n, x;
+	int fd;
 
-	if (flags & CMD_HASH_OBJECT_WRITE) {
-		assert(r == Z_STREAM_END);
-		(void)deflateEnd(&strm);
+	for (first = 0; first < npaths; first += n) {
+		n = npaths - first;
+		if (n > SHA1_LANES)
+			n = SHA1_LANES;
 
-		/* Build the object directory prefix */
-		snprintf(objpath, PATH_MAX, "%s/objects/%c%c/", dotgitpath,
-		    checksum[0], checksum[1]);
-		mkdir(objpath, 0755);
+		for (x = 0; x < n; x++) {
+			fd = open(paths[first + x], O_RDONLY);
+			if (fd == -1) {
+				fprintf(stderr, "Unable to open file %s, exiting.\n", paths[first + x]);
+				exit(0);
+			}
 
-		/* Add the rest of the checksum path */
-		strlcat(objpath+3, checksum+2, sizeof(objpath)-3);
-		rename(tpath, objpath);
+			if (fstat(fd, &sb) != 0) {
+				fprintf(stderr, "Unable to fstat(2) %s, exiting.\n", paths[first + x]);
+				exit(127);
+			}
+			dobjects[x].size = sb.st_size;
+			dobjects[x].data = NULL;
+			if (sb.st_size > 0)
+				dobjects[x].data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (dobjects[x].data == MAP_FAILED) {
+				fprintf(stderr, "Unable to mmap(2) %s, exiting.\n", paths[first + x]);
+				exit(127);
+			}
+			close(fd);
+		}
+
+		hash_object_digest_many(dobjects, n, OBJ_BLOB, checksums);
+		for (x = 0; x < n; x++) {
+			hash_object_write(flags, dobjects[x], OBJ_BLOB, checksums[x]);
+			if (dobjects[x].size > 0)
+				munmap(dobjects[x].data, dobjects[x].size);
+		}
 	}
 
-	printf("%s\n", checksum);
+	return (0);
+}
+
+/*
+ * Hashes the file names given with --stdin-paths, one per line. Names are
+ * batched SHA1_LANES at a time, but a batch is also hashed as soon as no
+ * more input is buffered, so a caller waiting for an answer before it
+ * sends the next name is never left blocked.
+ */
+static int
+hash_object_stdin_paths(uint8_t flags)
+{
+	char *paths[SHA1_LANES];
+	char *buf, *nl;
+	size_t bufsize = 4096, len = 0, off;
+	ssize_t r;
+	int n = 0;
+
+	buf = malloc(bufsize);
+	for (;;) {
+		for (off = 0; (nl = memchr(buf + off, '\n', len - off)) != NULL;
+		    off = nl - buf + 1) {
+			*nl = '\0';
+			paths[n++] = buf + off;
+			if (n == SHA1_LANES) {
+				hash_object_files(flags, paths, n);
+				n = 0;
+			}
+		}
+		if (n > 0) {
+			hash_object_files(flags, paths, n);
+			n = 0;
+		}
+		fflush(stdout);
+
+		/* Keep a partial line and wait for the rest */
+		len -= off;
+		memmove(buf, buf + off, len);
+		if (len == bufsize) {
+			bufsize *= 2;
+			buf = realloc(buf, bufsize);
+		}
+		r = read(STDIN_FILENO, buf + len, bufsize - len);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "fatal: read error on input: %s\n",
+			    strerror(errno));
+			exit(128);
+		}
+		if (r == 0)
+			break;
+		len += r;
+	}
+
+	/* The last name may lack its newline */
+	if (len > 0) {
+		if (len == bufsize)
+			buf = realloc(buf, bufsize + 1);
+		buf[len] = '\0';
+		paths[0] = buf;
+		hash_object_files(flags, paths, 1);
+	}
+	free(buf);
+
 	return (0);
 }
 
@@ -183,7 +327,6 @@ hash_object_main(int argc, char *argv[])
 	int ch;
 	int q = 0;
 	int8_t flags = 0;
-	struct decompressed_object dobject;
 
 	argc--; argv++;
 
@@ -197,6 +340,10 @@ hash_object_main(int argc, char *argv[])
 			flags |= CMD_HASH_OBJECT_STDIN;
 			q++;
 			break;
+		case 2:
+			flags |= CMD_HASH_OBJECT_PATHS;
+			q++;
+			break;
 		default:
 			printf("Currently not implemented\n");
 			hash_object_usage(0);
@@ -212,25 +359,10 @@ hash_object_main(int argc, char *argv[])
 		exit(0);
 	}
 
-	if (argv[1]) {
-		int fd;
-		struct stat sb;
-
-		fd = open(argv[1], O_RDONLY);
-		if (fd == -1) {
-			fprintf(stderr, "Unable to open file %s, exiting.\n", argv[1]);
-			exit(0);
-		}
-
-		if (fstat(fd, &sb) != 0) {
-			fprintf(stderr, "Unable to fstat(2) %s, exiting.\n", argv[1]);
-			exit(127);
-		}
-		dobject.size = sb.st_size;
-		dobject.data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-		ret = hash_object_write(flags, dobject, OBJ_BLOB);
-		munmap(dobject.data, sb.st_size);
-	}
+	if (flags & CMD_HASH_OBJECT_PATHS)
+		ret = hash_object_stdin_paths(flags);
+	else if (argc > 1)
+		ret = hash_object_files(flags, argv + 1, argc - 1);
 
 	return (ret);
 }
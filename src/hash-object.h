@@ -34,6 +34,7 @@
 /* Commands */
 #define CMD_HASH_OBJECT_WRITE	BIT(1)
 #define CMD_HASH_OBJECT_STDIN	BIT(2)
+#define CMD_HASH_OBJECT_PATHS	BIT(3)
 
 int	hash_object_main(int argc, char *argv[]);
 
@@ -37,6 +37,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <fetch.h>
 #include <zlib.h>
 #include "lib/zlib-handler.h"
@@ -47,8 +48,17 @@
 #include "index-pack.h"
 #include "clone.h"
 
+static int fix_thin = 0;
+static int rev_index = 0;
+static int nthreads = 0;
+static int from_stdin = 0;
+
 static struct option long_options[] =
 {
+	{"fix-thin", no_argument, NULL, 't'},
+	{"rev-index", no_argument, NULL, 'r'},
+	{"threads", required_argument, NULL, 'T'},
+	{"stdin", no_argument, NULL, 's'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -64,16 +74,45 @@ sha_write(int fd, const void *buf, size_t nbytes, SHA1_CTX *idxctx)
 void
 index_pack_usage(int type)
 {
-	fprintf(stderr, "usage: ogit index-pack [-v] [-o <index-file>] [--keep | --keep=<msg>] [--verify] [--strict] (<pack-file> | --stdin [--fix-thin] [<pack-file>])\n");
+	fprintf(stderr, "usage: ogit index-pack [-v] [-o <index-file>] [--keep | --keep=<msg>] [--verify] [--strict] [--rev-index] [--threads=<n>] (<pack-file> | --stdin [--fix-thin] [<pack-file>])\n");
 	exit(128);
 }
 
+/*
+ * Reads the pack from stdin into packfd, indexing it as it arrives.
+ * Returns the number of unresolved deltas, see pack_stream_close.
+ */
+static int
+index_pack_stdin(int packfd, struct packfileinfo *packfileinfo,
+    struct index_entry **index_entry)
+{
+	struct pack_stream *pstream;
+	unsigned char buf[65536];
+	ssize_t r;
+
+	pstream = pack_stream_open(packfd);
+	while ((r = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "fatal: read error on input: %s\n",
+			    strerror(errno));
+			exit(128);
+		}
+		pack_stream_write(pstream, buf, r);
+	}
+
+	return (pack_stream_close(pstream, packfileinfo, index_entry,
+	    nthreads));
+}
+
 int
 index_pack_main(int argc, char *argv[])
 {
 	int ret = 0;
 	int ch;
 	int q = 0;
+	char *endptr;
 
 	argc--; argv++;
 
@@ -83,6 +122,26 @@ index_pack_main(int argc, char *argv[])
 			break;
 		case 1:
 			break;
+		case 't':
+			fix_thin = 1;
+			q++;
+			break;
+		case 'r':
+			rev_index = 1;
+			q++;
+			break;
+		case 's':
+			from_stdin = 1;
+			q++;
+			break;
+		case 'T':
+			nthreads = strtol(optarg, &endptr, 10);
+			if (*optarg == '\0' || *endptr != '\0' || nthreads < 0) {
+				fprintf(stderr, "fatal: invalid number of threads specified (%s)\n", optarg);
+				exit(128);
+			}
+			q++;
+			break;
 		default:
 			printf("Currently not implemented\n");
 			return (-1);
@@ -90,53 +149,139 @@ index_pack_main(int argc, char *argv[])
 	argc = argc - q;
 	argv = argv + q;
 
-	if (strncmp(".pack", argv[1] + strlen(argv[1])-5, 5) != 0) {
+	if (argc < 2 && !from_stdin)
+		index_pack_usage(0);
+	if (argc >= 2 && strncmp(".pack", argv[1] + strlen(argv[1])-5, 5) != 0) {
 		fprintf(stderr, "fatal: packfile name '%s' does not end with '.pack'\n", argv[1]);
 		exit(128);
 	}
 
 	int packfd;
 	int idxfd;
+	int revfd = -1;
 	struct packfileinfo packfileinfo;
 	struct index_entry *index_entry;
-	int offset;
+	off_t offset;
 	int x;
+	int unresolved;
+	char packpath[PATH_MAX];
+	char idxpath[PATH_MAX];
+	char path[PATH_MAX];
 	SHA1_CTX packctx;
 	SHA1_CTX idxctx;
 	SHA1_Init(&packctx);
 	SHA1_Init(&idxctx);
 
-	/* Parse the pack file */
-	packfd = open(argv[1], O_RDONLY);
-	if (packfd == -1) {
-		fprintf(stderr, "fatal: cannot open packfile '%s'\n", argv[1]);
+	/* The bases are appended to the pack, which must be our own copy */
+	if (fix_thin && !from_stdin) {
+		fprintf(stderr, "fatal: --fix-thin cannot be used without --stdin\n");
 		exit(128);
 	}
-	offset = pack_parse_header(packfd, &packfileinfo, &packctx);
-	index_entry = malloc(sizeof(struct index_entry) * packfileinfo.nobjects);
-//	offset = pack_get_object_meta(packfd, offset, &packfileinfo, index_entry, &packctx, &idxctx);
-	(void)pack_get_object_meta(packfd, offset, &packfileinfo, index_entry, &packctx, &idxctx);
+
+	/* Bases of a thin pack are read from the local repository */
+	if (fix_thin && git_repository_path() == -1) {
+		fprintf(stderr, "fatal: --fix-thin requires a git repository\n");
+		exit(128);
+	}
+
+	/* Without a pack file name the pack goes in the repository */
+	if (from_stdin && argc < 2) {
+		if (git_repository_path() == -1) {
+			fprintf(stderr, "fatal: --stdin requires a git repository\n");
+			exit(128);
+		}
+		snprintf(packpath, sizeof(packpath), "%s/objects/pack/_tmp.pack", dotgitpath);
+	}
+	else
+		strlcpy(packpath, argv[1], sizeof(packpath));
+	strlcpy(idxpath, "packout.idx", sizeof(idxpath));
+
+	if (from_stdin) {
+		packfd = open(packpath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if (packfd == -1) {
+			fprintf(stderr, "fatal: unable to create '%s'\n", packpath);
+			exit(128);
+		}
+		unresolved = index_pack_stdin(packfd, &packfileinfo, &index_entry);
+	}
+	else {
+		/* Parse the pack file */
+		packfd = open(packpath, O_RDONLY);
+		if (packfd == -1) {
+			fprintf(stderr, "fatal: cannot open packfile '%s'\n", packpath);
+			exit(128);
+		}
+		offset = pack_parse_header(packfd, &packfileinfo, &packctx);
+		index_entry = malloc(sizeof(struct index_entry) * packfileinfo.nobjects);
+		unresolved = pack_get_object_meta(packfd, offset, &packfileinfo, index_entry, &packctx, &idxctx, nthreads);
+		SHA1_Final(packfileinfo.sha, &packctx);
+	}
+
+	if (unresolved > 0 && fix_thin) {
+		pack_fix_thin(packfd, &packfileinfo, index_entry, unresolved,
+		    nthreads);
+
+		/* Index the completed pack from the start */
+		SHA1_Init(&packctx);
+		SHA1_Init(&idxctx);
+		lseek(packfd, 0, SEEK_SET);
+		offset = pack_parse_header(packfd, &packfileinfo, &packctx);
+		index_entry = realloc(index_entry, sizeof(struct index_entry) * packfileinfo.nobjects);
+		unresolved = pack_get_object_meta(packfd, offset, &packfileinfo, index_entry, &packctx, &idxctx, nthreads);
+		SHA1_Final(packfileinfo.sha, &packctx);
+	}
 	close(packfd);
-	SHA1_Final(packfileinfo.sha, &packctx);
+
+	if (unresolved > 0) {
+		fprintf(stderr, "fatal: pack has %d unresolved deltas\n", unresolved);
+		exit(128);
+	}
+
+	/* Name the received pack after its SHA, like GPL git */
+	if (from_stdin && argc < 2) {
+		x = snprintf(path, sizeof(path), "%s/objects/pack/pack-", dotgitpath);
+		sha_bin_to_str(packfileinfo.sha, path + x);
+		strlcpy(path + x + HASH_SIZE, ".pack", sizeof(path) - x - HASH_SIZE);
+		if (rename(packpath, path) == -1) {
+			fprintf(stderr, "fatal: unable to rename '%s' to '%s'\n", packpath, path);
+			exit(128);
+		}
+		strlcpy(path + x + HASH_SIZE, ".idx", sizeof(path) - x - HASH_SIZE);
+		strlcpy(idxpath, path, sizeof(idxpath));
+	}
 
 	/* Sort the index_entry */
 	qsort(index_entry, packfileinfo.nobjects,
 	    sizeof(struct index_entry), sortindexentry);
 
 	/* Build out the Index File */
-	idxfd = open("packout.idx", O_RDWR | O_CREAT | O_TRUNC, 0666);
+	idxfd = open(idxpath, O_RDWR | O_CREAT | O_TRUNC, 0666);
 	if (idxfd == -1) {
-		fprintf(stderr, "Unable to open packout.idx for writing\n");
+		fprintf(stderr, "Unable to open %s for writing\n", idxpath);
 		exit(idxfd);
 	}
-	pack_build_index(idxfd, &packfileinfo, index_entry, &idxctx);
+	if (rev_index) {
+		strlcpy(path, idxpath, sizeof(path));
+		strlcpy(path + strlen(path) - 3, "rev", 4);
+		revfd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if (revfd == -1) {
+			fprintf(stderr, "Unable to open %s for writing\n", path);
+			exit(128);
+		}
+	}
+	pack_build_index(idxfd, revfd, &packfileinfo, index_entry, &idxctx);
 	close(idxfd);
+	if (revfd != -1)
+		close(revfd);
 
 	free(index_entry);
 	/* Output the SHA to the terminal */
+	if (from_stdin)
+		printf("pack\t");
 	for(x=0;x<20;x++)
 		printf("%02x", packfileinfo.sha[x]);
+	if (from_stdin)
+		printf("\n");
 
 	return (ret);
 }
-
@@ -40,6 +40,7 @@
 #include "lib/common.h"
 #include "lib/pack.h"
 #include "lib/ini.h"
+#include "lib/graph.h"
 #include "log.h"
 #include "ogit.h"
 
@@ -73,11 +74,14 @@ void
 log_print_commit_headers(struct commitcontent *commitcontent)
 {
 	char datestr[50];
+	char shastr[HASH_SIZE+1];
 
 	ctime_r(&commitcontent->author_time, datestr);
 	datestr[strlen(datestr)-1] = '\0';
 
-	printf("%scommit %s%s\n", color ? "\e[0;33m" : "", commitcontent->commitsha,
+	sha_bin_to_str(commitcontent->commitsha, shastr);
+	shastr[HASH_SIZE] = '\0';
+	printf("%scommit %s%s\n", color ? "\e[0;33m" : "", shastr,
 	    color ? "\e[0m" : "");
 
 	printf("Author:\t%s <%s>\n", commitcontent->author_name, commitcontent->author_email);
@@ -136,59 +140,57 @@ log_get_start_sha(struct logarg *logarg)
 void
 log_display_commits()
 {
-	struct decompressed_object decompressed_object;
 	struct commitcontent commitcontent;
 	struct logarg logarg;
-	int source;
-	int hdr_offset = 0;
+	struct commit_graph *graph;
+	unsigned char *data;
+	unsigned long size;
+	uint8_t sha[20];
+	int type;
+	int count = 0;
+	int pos, parent;
 
 	bzero(&logarg, sizeof(struct logarg));
 	log_get_start_sha(&logarg);
+	sha_str_to_bin_network(logarg.sha, sha);
 
 	logarg.status = LOG_STATUS_PARENT;
 
 	bzero(&commitcontent, sizeof(struct commitcontent));
+	graph = graph_open();
 
 	while(logarg.status & LOG_STATUS_PARENT) {
-		decompressed_object.size = 0;
-		decompressed_object.data = NULL;
-
-		commitcontent.commitsha = logarg.sha;
-		/*
-		 * Expansion of the CONTENT_HANDLER macro to capture the source.
-		 * This will be added to the macro if additional use-cases arise.
-		 */
-		if (loose_content_handler(commitcontent.commitsha, buffer_cb, &decompressed_object)) {
-			source = SOURCE_PACK;
-			pack_content_handler(commitcontent.commitsha, pack_buffer_cb, &decompressed_object);
-		}
-		else
-			source = SOURCE_LOOSE;
-
-		if (source == SOURCE_LOOSE) {
-			// XXX This is an unnecessary variable, loose_get_headers's does two things
-			// Better approach would be to calculate the hdr_offset from the type and size
-			struct loosearg loosearg;
-			hdr_offset = loose_get_headers(decompressed_object.data,
-			    decompressed_object.size, &loosearg);
-		}
-		else
-			hdr_offset = 0;
-		parse_commitcontent(&commitcontent,
-		    (char *)decompressed_object.data + hdr_offset,
-		    decompressed_object.size - hdr_offset);
+		if (limit != -1 && count++ >= limit)
+			break;
+
+		data = object_read(sha, &type, &size);
+		commitcontent.commitsha = sha;
+		parse_commitcontent(&commitcontent, (char *)data, size);
 
 		log_print_commit_headers(&commitcontent);
 		log_print_message(&commitcontent);
-		if (commitcontent.numparent == 0) {
+
+		/* Take the first parent from the commit-graph when it has it */
+		pos = -1;
+		if (graph != NULL)
+			pos = graph_find(graph, sha);
+		if (pos != -1) {
+			if (graph_parents(graph, pos, &parent, 1) == 0) {
+				logarg.status &= ~LOG_STATUS_PARENT;
+				break;
+			}
+			memcpy(sha, graph_oid(graph, parent), 20);
+		}
+		else if (commitcontent.numparent == 0) {
 			logarg.status &= ~LOG_STATUS_PARENT;
 			break;
 		}
-
-		strlcpy(commitcontent.commitsha, commitcontent.parent[0], HASH_SIZE+1);
+		else
+			memcpy(sha, commitcontent.parent[0], 20);
 		free_commitcontent(&commitcontent);
-		free(decompressed_object.data);
+		free(data);
 	}
+	graph_close(graph);
 	exit(0);
 }
 
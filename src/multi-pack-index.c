@@ -0,0 +1,70 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lib/common.h"
+#include "lib/midx.h"
+#include "multi-pack-index.h"
+
+static void
+multi_pack_index_usage(int type)
+{
+	fprintf(stderr, "usage: ogit multi-pack-index (write|verify)\n");
+	exit(128);
+}
+
+int
+multi_pack_index_main(int argc, char *argv[])
+{
+	char packdir[PATH_MAX];
+	int ret = 0;
+
+	argc--; argv++;
+
+	if (argc != 2)
+		multi_pack_index_usage(0);
+
+	if (git_repository_path() == -1) {
+		fprintf(stderr, "fatal: not a git repository (or any of the parent directories): .git");
+		exit(128);
+	}
+	snprintf(packdir, sizeof(packdir), "%s/objects/pack", dotgitpath);
+
+	if (!strcmp(argv[1], "write"))
+		ret = midx_write(packdir);
+	else if (!strcmp(argv[1], "verify")) {
+		if (midx_verify(packdir))
+			exit(1);
+	}
+	else
+		multi_pack_index_usage(0);
+
+	return (ret);
+}
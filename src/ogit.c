@@ -35,6 +35,9 @@
 #include "update-index.h"
 #include "hash-object.h"
 #include "index-pack.h"
+#include "commit-graph.h"
+#include "multi-pack-index.h"
+#include "rev-list.h"
 #include "cat-file.h"
 #include "clone.h"
 #include "ogit.h"
@@ -51,7 +54,10 @@ static struct cmd cmds[] = {
 	{"cat-file",		cat_file_main},
 	{"log",			log_main},
 	{"clone",		clone_main},
-	{"index-pack",		index_pack_main}
+	{"index-pack",		index_pack_main},
+	{"commit-graph",	commit_graph_main},
+	{"multi-pack-index",	multi_pack_index_main},
+	{"rev-list",		rev_list_main}
 };
 
 bool color = true;
@@ -84,7 +90,10 @@ usage()
 	printf("\n");
 	printf("plumming commands\n");
 	printf("   cat-file      Check object existence or emit object contents\n");
+	printf("   commit-graph  Write the commit-graph file\n");
 	printf("   hash-object   Computes object ID and optionally create an object from a file\n");
+	printf("   multi-pack-index Write and verify multi-pack-indexes\n");
+	printf("   rev-list      Lists commit objects in reverse chronological order\n");
 	printf("   update-index  Register file contents in the working tree to the index\n");
 	printf("\n");
 	exit(0);
@@ -0,0 +1,520 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2018 Farhan Khan. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lib/common.h"
+#include "lib/loose.h"
+#include "lib/pack.h"
+#include "lib/bitmap.h"
+#include "lib/graph.h"
+#include "lib/ini.h"
+#include "rev-list.h"
+
+static struct option long_options[] =
+{
+	{"objects", no_argument, NULL, 'o'},
+	{"count", no_argument, NULL, 'c'},
+	{"use-bitmap-index", no_argument, NULL, 'b'},
+	{NULL, 0, NULL, 0}
+};
+
+/* A set of binary SHAs, open addressed on the first bytes of the SHA */
+struct oidset {
+	unsigned char	(*shas)[20];
+	bool		*used;
+	size_t		 size;
+	size_t		 count;
+};
+
+/* A commit waiting in the date ordered walk queue */
+struct rev_commit {
+	uint8_t		 sha[20];
+	uint8_t		 tree[20];
+	uint8_t		(*parents)[20];
+	int		 nparents;
+	time_t		 time;
+	struct rev_commit *next;
+};
+
+struct rev_list {
+	uint8_t		 flags;
+	struct oidset	 seen;
+	struct rev_commit *queue;
+	struct commit_graph *graph;
+	uint8_t		(*trees)[20];	// Of the listed commits, in order
+	int		 ntrees;
+	size_t		 count;
+};
+
+static void
+rev_list_usage(int type)
+{
+	fprintf(stderr, "usage: ogit rev-list [--objects] [--count] [--use-bitmap-index] <commit>... [^<commit>...]\n");
+	exit(128);
+}
+
+static bool	oidset_insert(struct oidset *set, uint8_t *sha);
+
+static void
+oidset_grow(struct oidset *set)
+{
+	struct oidset old = *set;
+	size_t n;
+
+	set->size = old.size ? old.size * 2 : 1024;
+	set->shas = malloc(sizeof(*set->shas) * set->size);
+	set->used = calloc(set->size, sizeof(bool));
+	set->count = 0;
+	for (n = 0; n < old.size; n++)
+		if (old.used[n])
+			oidset_insert(set, old.shas[n]);
+	free(old.shas);
+	free(old.used);
+}
+
+/* Adds sha to the set, returns false if it was already there */
+static bool
+oidset_insert(struct oidset *set, uint8_t *sha)
+{
+	size_t n;
+
+	if (set->count * 2 >= set->size)
+		oidset_grow(set);
+
+	memcpy(&n, sha, sizeof(n));
+	for (n %= set->size; set->used[n]; n = (n + 1) % set->size)
+		if (!memcmp(set->shas[n], sha, 20))
+			return (false);
+
+	memcpy(set->shas[n], sha, 20);
+	set->used[n] = true;
+	set->count++;
+	return (true);
+}
+
+/* Reads the 40 character SHA a ref file or packed-refs line points to */
+static int
+rev_list_read_ref(const char *ref, uint8_t *sha)
+{
+	char path[PATH_MAX];
+	char line[PATH_MAX + HASH_SIZE + 2];
+	FILE *fp;
+	int l;
+
+	snprintf(path, sizeof(path), "%s/%s", dotgitpath, ref);
+	fp = fopen(path, "r");
+	if (fp != NULL) {
+		if (fgets(line, sizeof(line), fp) == NULL) {
+			fclose(fp);
+			return (-1);
+		}
+		fclose(fp);
+		if (!strncmp(line, "ref: ", 5)) {
+			l = strlen(line) - 1;
+			if (line[l] == '\n')
+				line[l] = '\0';
+			return (rev_list_read_ref(line + 5, sha));
+		}
+		sha_str_to_bin_network(line, sha);
+		return (0);
+	}
+
+	snprintf(path, sizeof(path), "%s/packed-refs", dotgitpath);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return (-1);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		l = strlen(line) - 1;
+		if (line[l] == '\n')
+			line[l] = '\0';
+		if (l > HASH_SIZE && !strcmp(line + HASH_SIZE + 1, ref)) {
+			sha_str_to_bin_network(line, sha);
+			fclose(fp);
+			return (0);
+		}
+	}
+	fclose(fp);
+
+	return (-1);
+}
+
+/*
+ * Peels tags until a commit. Returns the type of the object sha names,
+ * the commit is stored in peeled.
+ */
+static int
+rev_list_peel(uint8_t *sha, uint8_t *peeled, const char *name)
+{
+	unsigned char *data;
+	unsigned long size;
+	int type, first;
+
+	memcpy(peeled, sha, 20);
+	for (first = 0;; first = type) {
+		data = object_read(peeled, &type, &size);
+		if (first == 0)
+			first = type;
+		if (type != OBJ_TAG || size < 7 + HASH_SIZE)
+			break;
+		sha_str_to_bin_network((char *)data + 7, peeled);
+		free(data);
+	}
+	free(data);
+
+	if (type != OBJ_COMMIT) {
+		fprintf(stderr, "fatal: '%s' is not a commit\n", name);
+		exit(128);
+	}
+
+	return (first);
+}
+
+/* Resolves a SHA, HEAD or a ref name, which may name a tag */
+static void
+rev_list_resolve(const char *name, uint8_t *sha)
+{
+	const char *prefixes[] = { "", "refs/", "refs/tags/", "refs/heads/" };
+	uint8_t peeled[20];
+	char ref[PATH_MAX];
+	int n;
+
+	if (strlen(name) == HASH_SIZE &&
+	    strspn(name, "0123456789abcdef") == HASH_SIZE)
+		sha_str_to_bin_network((char *)name, sha);
+	else {
+		for (n = 0; n < nitems(prefixes); n++) {
+			snprintf(ref, sizeof(ref), "%s%s", prefixes[n], name);
+			if (rev_list_read_ref(ref, sha) == 0)
+				break;
+		}
+		if (n == nitems(prefixes)) {
+			fprintf(stderr, "fatal: ambiguous argument '%s': unknown revision\n", name);
+			exit(128);
+		}
+	}
+
+	rev_list_peel(sha, peeled, name);
+}
+
+/*
+ * Reads a commit and adds it to the walk queue, which is kept newest
+ * first by committer date. Commits already seen are skipped. Commits in
+ * the commit-graph are taken from it rather than inflated.
+ */
+static void
+rev_list_push(struct rev_list *rev_list, uint8_t *sha)
+{
+	struct commitcontent commitcontent;
+	struct rev_commit *commit, **p;
+	unsigned char *data;
+	unsigned long size;
+	int *parents;
+	int type, n, pos;
+
+	if (!oidset_insert(&rev_list->seen, sha))
+		return;
+
+	commit = malloc(sizeof(struct rev_commit));
+	memcpy(commit->sha, sha, 20);
+
+	pos = rev_list->graph ? graph_find(rev_list->graph, sha) : -1;
+	if (pos != -1) {
+		memcpy(commit->tree, graph_tree(rev_list->graph, pos), 20);
+		commit->nparents = graph_parents(rev_list->graph, pos, NULL, 0);
+		parents = malloc(sizeof(int) * commit->nparents);
+		graph_parents(rev_list->graph, pos, parents, commit->nparents);
+		commit->parents = malloc(sizeof(*commit->parents) *
+		    commit->nparents);
+		for (n = 0; n < commit->nparents; n++)
+			memcpy(commit->parents[n],
+			    graph_oid(rev_list->graph, parents[n]), 20);
+		free(parents);
+		commit->time = graph_time(rev_list->graph, pos);
+	}
+	else {
+		data = object_read(sha, &type, &size);
+		bzero(&commitcontent, sizeof(struct commitcontent));
+		parse_commitcontent(&commitcontent, (char *)data, size);
+		free(data);
+
+		memcpy(commit->tree, commitcontent.treesha, 20);
+		commit->nparents = commitcontent.numparent;
+		commit->parents = commitcontent.parent;
+		commitcontent.parent = NULL;
+		commit->time = commitcontent.committer_time;
+		free_commitcontent(&commitcontent);
+	}
+
+	for (p = &rev_list->queue; *p && (*p)->time >= commit->time;
+	    p = &(*p)->next)
+		;
+	commit->next = *p;
+	*p = commit;
+}
+
+static void
+rev_list_print(struct rev_list *rev_list, uint8_t *sha, const char *path)
+{
+	char shastr[HASH_SIZE+1];
+
+	rev_list->count++;
+	if (rev_list->flags & REV_LIST_COUNT)
+		return;
+
+	sha_bin_to_str(sha, shastr);
+	shastr[HASH_SIZE] = '\0';
+	if (path)
+		printf("%s %s\n", shastr, path);
+	else
+		printf("%s\n", shastr);
+}
+
+/*
+ * Marks the trees and blobs under a tree seen, listing them if print is
+ * set. Tree entries are classified by their mode, gitlinks name commits in
+ * another repository and are not followed.
+ */
+static void
+rev_list_walk_tree(struct rev_list *rev_list, uint8_t *sha, char *path,
+    bool print)
+{
+	struct tree_iter iter;
+	struct tree_entry entry;
+	char subpath[PATH_MAX];
+
+	if (!oidset_insert(&rev_list->seen, sha))
+		return;
+	if (print)
+		rev_list_print(rev_list, sha, path);
+
+	tree_iter_read(&iter, sha);
+	while (tree_iter_next(&iter, &entry)) {
+		snprintf(subpath, sizeof(subpath), "%s%s%s", path,
+		    path[0] ? "/" : "", entry.name);
+
+		if (entry.type == OBJ_COMMIT)
+			;
+		else if (entry.type == OBJ_TREE)
+			rev_list_walk_tree(rev_list, entry.sha, subpath, print);
+		else if (oidset_insert(&rev_list->seen, entry.sha) && print)
+			rev_list_print(rev_list, entry.sha, subpath);
+	}
+	tree_iter_finish(&iter);
+}
+
+/*
+ * Walks the queued commits and their ancestors, newest first, marking them
+ * seen. If print is set the commits are listed and their trees remembered
+ * for the object walk, otherwise with --objects their trees are marked.
+ */
+static void
+rev_list_walk_commits(struct rev_list *rev_list, bool print)
+{
+	struct rev_commit *commit;
+	int n;
+
+	while ((commit = rev_list->queue) != NULL) {
+		rev_list->queue = commit->next;
+
+		if (print) {
+			rev_list_print(rev_list, commit->sha, NULL);
+			rev_list->trees = realloc(rev_list->trees,
+			    sizeof(*rev_list->trees) * (rev_list->ntrees + 1));
+			memcpy(rev_list->trees[rev_list->ntrees++],
+			    commit->tree, 20);
+		}
+		else if (rev_list->flags & REV_LIST_OBJECTS)
+			rev_list_walk_tree(rev_list, commit->tree, "", false);
+
+		for (n = 0; n < commit->nparents; n++)
+			rev_list_push(rev_list, commit->parents[n]);
+		free(commit->parents);
+		free(commit);
+	}
+}
+
+static void
+rev_list_bitmap_cb(uint8_t *sha_bin, int type, void *arg)
+{
+	rev_list_print(arg, sha_bin, NULL);
+}
+
+/*
+ * Answers the query with the pack's reachability bitmaps. Returns -1 if
+ * there are none or they do not cover every object involved.
+ */
+static int
+rev_list_bitmap(struct rev_list *rev_list, uint8_t (*wants)[20],
+    int nwants, uint8_t (*haves)[20], int nhaves)
+{
+	struct pack_bitmap *pb;
+	struct bitmap *result, *exclude;
+	int type;
+
+	pb = bitmap_open();
+	if (pb == NULL)
+		return (-1);
+
+	result = bitmap_reachable(pb, wants, nwants);
+	if (result == NULL) {
+		bitmap_close(pb);
+		return (-1);
+	}
+	if (nhaves > 0) {
+		exclude = bitmap_reachable(pb, haves, nhaves);
+		if (exclude == NULL) {
+			bitmap_free(result);
+			bitmap_close(pb);
+			return (-1);
+		}
+		bitmap_and_not(result, exclude);
+		bitmap_free(exclude);
+	}
+
+	for (type = OBJ_COMMIT; type <= OBJ_TAG; type++) {
+		if (type != OBJ_COMMIT &&
+		    (rev_list->flags & REV_LIST_OBJECTS) == 0)
+			break;
+		if (rev_list->flags & REV_LIST_COUNT)
+			rev_list->count += bitmap_count_type(pb, result, type);
+		else
+			bitmap_each(pb, result, type, rev_list_bitmap_cb,
+			    rev_list);
+	}
+
+	bitmap_free(result);
+	bitmap_close(pb);
+	return (0);
+}
+
+int
+rev_list_main(int argc, char *argv[])
+{
+	struct rev_list rev_list;
+	uint8_t (*wants)[20], (*haves)[20];
+	uint8_t peeled[20];
+	char **wantnames;
+	int nwants, nhaves;
+	int ret = 0;
+	int ch;
+	int n;
+
+	bzero(&rev_list, sizeof(struct rev_list));
+	argc--; argv++;
+
+	while((ch = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+		switch(ch) {
+		case 'o':
+			rev_list.flags |= REV_LIST_OBJECTS;
+			break;
+		case 'c':
+			rev_list.flags |= REV_LIST_COUNT;
+			break;
+		case 'b':
+			rev_list.flags |= REV_LIST_BITMAP;
+			break;
+		default:
+			rev_list_usage(0);
+		}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0)
+		rev_list_usage(0);
+
+	if (git_repository_path() == -1) {
+		fprintf(stderr, "fatal: not a git repository (or any of the parent directories): .git");
+		exit(128);
+	}
+	config_parser();
+
+	wants = malloc(sizeof(*wants) * argc);
+	haves = malloc(sizeof(*haves) * argc);
+	nwants = nhaves = 0;
+	wantnames = malloc(sizeof(char *) * argc);
+	for (n = 0; n < argc; n++) {
+		if (argv[n][0] == '^')
+			rev_list_resolve(argv[n] + 1, haves[nhaves++]);
+		else {
+			wantnames[nwants] = argv[n];
+			rev_list_resolve(argv[n], wants[nwants++]);
+		}
+	}
+
+	if ((rev_list.flags & REV_LIST_BITMAP) == 0 ||
+	    rev_list_bitmap(&rev_list, wants, nwants, haves, nhaves)) {
+		rev_list.graph = graph_open();
+
+		/* Mark everything reachable from the excluded commits */
+		for (n = 0; n < nhaves; n++) {
+			rev_list_peel(haves[n], peeled, "");
+			rev_list_push(&rev_list, peeled);
+			/* A tag naming the commit is excluded with it */
+			oidset_insert(&rev_list.seen, haves[n]);
+		}
+		rev_list_walk_commits(&rev_list, false);
+
+		for (n = 0; n < nwants; n++) {
+			if (rev_list_peel(wants[n], peeled, "") != OBJ_TAG)
+				memcpy(wants[n], peeled, 20);
+			rev_list_push(&rev_list, peeled);
+		}
+		rev_list_walk_commits(&rev_list, true);
+
+		/* Then the tags named on the command line and the trees */
+		if (rev_list.flags & REV_LIST_OBJECTS) {
+			for (n = 0; n < nwants; n++)
+				if (oidset_insert(&rev_list.seen, wants[n]))
+					rev_list_print(&rev_list, wants[n],
+					    wantnames[n]);
+			for (n = 0; n < rev_list.ntrees; n++)
+				rev_list_walk_tree(&rev_list,
+				    rev_list.trees[n], "", true);
+		}
+		graph_close(rev_list.graph);
+	}
+
+	if (rev_list.flags & REV_LIST_COUNT)
+		printf("%zu\n", rev_list.count);
+
+	free(rev_list.trees);
+	free(rev_list.seen.shas);
+	free(rev_list.seen.used);
+	free(wants);
+	free(wantnames);
+	free(haves);
+
+	return (ret);
+}
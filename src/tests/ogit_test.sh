@@ -28,6 +28,31 @@
 
 : ${OGIT:=$(realpath $(atf_get_srcdir)/../ogit)}
 
+# Creates the repository src with a few commits that each change a line of
+# a large file and a file in a nested directory, so its packs have delta
+# chains and subtrees.
+make_repo()
+{
+
+	export GIT_AUTHOR_NAME=ogit GIT_AUTHOR_EMAIL=ogit@example.org
+	export GIT_COMMITTER_NAME=ogit GIT_COMMITTER_EMAIL=ogit@example.org
+	git init -q src
+	cd src
+	seq 1 1000 > big
+	for i in 1 2 3 4 5 6 7 8; do
+		mkdir -p dir$((i % 3))/sub
+		sed -e "$((i * 97))s/.*/change $i/" big > big.new
+		mv big.new big
+		echo $i > dir$((i % 3))/sub/file
+		git add -A
+		git commit -q -m "Commit $i"
+		if [ $((i % 3)) -eq 0 ]; then
+			git repack -q -d
+		fi
+	done
+	cd ..
+}
+
 atf_test_case log
 log_head()
 {
@@ -70,10 +95,436 @@ log_body()
 	atf_check -x "head -4 ${wrkdir}/.log | tail -1 | grep -qe '^$'"
 }
 
+atf_test_case index_pack_fix_thin
+index_pack_fix_thin_head()
+{
+	atf_set "descr" "index-pack --fix-thin appends the bases git does"
+}
+
+index_pack_fix_thin_body()
+{
+
+	make_repo
+	cd src
+	base=$(git rev-parse HEAD~4)
+	printf 'HEAD\n^%s\n' ${base} | \
+	    git pack-objects --revs --thin --stdout > ../thin.pack
+	git index-pack --stdin --fix-thin ../git.pack < ../thin.pack > /dev/null
+
+	atf_check -s exit:128 \
+	    -e inline:"fatal: --fix-thin cannot be used without --stdin\n" \
+	    ${OGIT} index-pack --fix-thin ../thin.pack
+	atf_check -o ignore ${OGIT} index-pack --stdin --fix-thin \
+	    ../ogit.pack < ../thin.pack
+	mv packout.idx ../ogit.idx
+	atf_check -o ignore git verify-pack ../ogit.idx
+	git show-index < ../git.idx | cut -d' ' -f2 | sort > ../expected
+	atf_check -o file:../expected -x \
+	    "git show-index < ../ogit.idx | cut -d' ' -f2 | sort"
+}
+
+atf_test_case multi_pack_index
+multi_pack_index_head()
+{
+	atf_set "descr" "multi-pack-index write matches git"
+}
+
+multi_pack_index_body()
+{
+
+	make_repo
+	cd src
+	midx=.git/objects/pack/multi-pack-index
+	git multi-pack-index write
+	mv ${midx} ../expected
+
+	atf_check ${OGIT} multi-pack-index write
+	atf_check cmp ${midx} ../expected
+	atf_check ${OGIT} multi-pack-index verify
+}
+
+atf_test_case index_pack_rev_index
+index_pack_rev_index_head()
+{
+	atf_set "descr" "index-pack --rev-index writes the rev file git does"
+}
+
+index_pack_rev_index_body()
+{
+
+	make_repo
+	cd src
+	git repack -q -a -d
+	pack=$(ls .git/objects/pack/*.pack)
+	git index-pack --rev-index -o ../git.idx ${pack}
+
+	atf_check -o ignore ${OGIT} index-pack --rev-index ${pack}
+	atf_check cmp packout.rev ../git.rev
+}
+
+atf_test_case rev_list
+rev_list_head()
+{
+	atf_set "descr" "rev-list, with and without bitmaps, matches git"
+}
+
+rev_list_body()
+{
+
+	make_repo
+	cd src
+	git repack -q -a -d -b
+	head=$(git rev-parse HEAD)
+	base=$(git rev-parse HEAD~3)
+
+	for revs in "${head}" "${head} ^${base}"; do
+		git rev-list --objects ${revs} > ../expected
+		atf_check -o file:../expected ${OGIT} rev-list --objects ${revs}
+		git rev-list --count ${revs} > ../expected
+		atf_check -o file:../expected ${OGIT} rev-list --count ${revs}
+
+		git rev-list --objects --use-bitmap-index ${revs} | \
+		    sort > ../expected
+		atf_check -o file:../expected -x "${OGIT} rev-list --objects \
+		    --use-bitmap-index ${revs} | sort"
+		git rev-list --count --objects --use-bitmap-index ${revs} \
+		    > ../expected
+		atf_check -o file:../expected ${OGIT} rev-list --count \
+		    --objects --use-bitmap-index ${revs}
+	done
+}
+
+atf_test_case commit_graph
+commit_graph_head()
+{
+	atf_set "descr" "commit-graph write matches git"
+}
+
+commit_graph_body()
+{
+
+	make_repo
+	cd src
+	graph=.git/objects/info/commit-graph
+	git commit-graph write 2> /dev/null
+	mv ${graph} ../expected
+
+	atf_check ${OGIT} commit-graph write
+	atf_check cmp ${graph} ../expected
+}
+
+atf_test_case log_commit_graph
+log_commit_graph_head()
+{
+	atf_set "descr" "log walks the commits git does, with or without a commit-graph"
+}
+
+log_commit_graph_body()
+{
+
+	make_repo
+	cd src
+	git log --format='commit %H' > ../expected
+	git log -3 --format='commit %H' > ../expected3
+	${OGIT} log --color=never > ../nograph
+	atf_check -o file:../expected -x \
+	    "${OGIT} log --color=never | grep '^commit '"
+
+	git commit-graph write 2> /dev/null
+	atf_check -o file:../nograph ${OGIT} log --color=never
+	atf_check -o file:../expected3 -x \
+	    "${OGIT} log --color=never -3 | grep '^commit '"
+}
+
+atf_test_case cat_file_loose
+cat_file_loose_head()
+{
+	atf_set "descr" "cat-file reads the type and size of loose objects as git does"
+}
+
+cat_file_loose_body()
+{
+
+	export GIT_AUTHOR_NAME=ogit GIT_AUTHOR_EMAIL=ogit@example.org
+	export GIT_COMMITTER_NAME=ogit GIT_COMMITTER_EMAIL=ogit@example.org
+	git init -q src
+	cd src
+	seq 1 100000 > large
+	: > empty
+	echo small > small
+	git add large empty small
+	git commit -q -m "Loose objects"
+
+	git rev-list --objects --all | cut -c1-40 > ../objects
+	for object in $(cat ../objects); do
+		for opt in -t -s; do
+			git cat-file ${opt} ${object} > ../expected
+			atf_check -o file:../expected \
+			    ${OGIT} cat-file ${opt} ${object}
+		done
+	done
+	git cat-file --batch-check < ../objects > ../expected
+	atf_check -o file:../expected ${OGIT} cat-file --batch-check < ../objects
+}
+
+atf_test_case cat_file_batch
+cat_file_batch_head()
+{
+	atf_set "descr" "cat-file --batch modes match git"
+}
+
+cat_file_batch_body()
+{
+
+	make_repo
+	cd src
+	git repack -q -a -d
+	echo loose > loose
+	git add loose
+	git commit -q -m "Loose objects"
+
+	git rev-list --objects --all | cut -c1-40 > ../objects
+	echo 0123456789012345678901234567890123456789 >> ../objects
+	git cat-file --batch < ../objects > ../batch
+	atf_check -o file:../batch ${OGIT} cat-file --batch < ../objects
+
+	format='%(objectname) %(objecttype) %(objectsize) %(objectsize:disk)'
+	git cat-file --batch-check="${format}" < ../objects > ../check
+	atf_check -o file:../check \
+	    ${OGIT} cat-file --batch-check="${format}" < ../objects
+
+	git cat-file --batch-all-objects --batch-check > ../all
+	atf_check -o file:../all ${OGIT} cat-file --batch-all-objects --batch-check
+	git cat-file --batch-all-objects --batch > ../all
+	atf_check -o file:../all ${OGIT} cat-file --batch-all-objects --batch
+}
+
+atf_test_case index_pack
+index_pack_head()
+{
+	atf_set "descr" "index-pack writes the idx git does with any number of threads"
+}
+
+index_pack_body()
+{
+
+	make_repo
+	cd src
+	git repack -q -a -d
+	pack=$(ls .git/objects/pack/*.pack)
+
+	for threads in 1 4; do
+		rm -f packout.idx
+		atf_check -o ignore ${OGIT} index-pack --threads=${threads} \
+		    ${pack}
+		atf_check cmp packout.idx ${pack%.pack}.idx
+	done
+}
+
+atf_test_case index_pack_stdin
+index_pack_stdin_head()
+{
+	atf_set "descr" "index-pack --stdin stores the pack as git does"
+}
+
+index_pack_stdin_body()
+{
+
+	make_repo
+	git -C src pack-objects --all --stdout < /dev/null > all.pack
+	git init -q ogit
+	git init -q gpl
+
+	git -C gpl index-pack --stdin < all.pack > expected
+	cd ogit
+	atf_check -o file:../expected ${OGIT} index-pack --stdin < ../all.pack
+	for f in ../gpl/.git/objects/pack/*; do
+		atf_check cmp ${f} .git/objects/pack/${f##*/}
+	done
+}
+
+atf_test_case hash_object
+hash_object_head()
+{
+	atf_set "descr" "hash-object hashes and writes files as git does"
+}
+
+hash_object_body()
+{
+
+	# Sizes in and around a SHA-1 block and its length padding
+	for size in 0 1 55 56 63 64 65 119 120 128 4096 1048583; do
+		head -c ${size} /dev/urandom > file${size}
+	done
+	git hash-object file* > expected
+	atf_check -o file:expected ${OGIT} hash-object file*
+
+	git init -q repo
+	cd repo
+	atf_check -o file:../expected ${OGIT} hash-object -w ../file*
+	atf_check -o file:../expected \
+	    git cat-file --batch-check='%(objectname)' < ../expected
+}
+
+atf_test_case hash_object_stdin_paths
+hash_object_stdin_paths_head()
+{
+	atf_set "descr" "hash-object --stdin-paths hashes batches as git does"
+}
+
+hash_object_stdin_paths_body()
+{
+
+	# More files than SHA1_LANES, of sizes in and around a block
+	for size in $(seq 0 37); do
+		head -c $((size * 13)) /dev/urandom > file${size}
+	done
+	ls file* > paths
+	git hash-object --stdin-paths < paths > expected
+	atf_check -o file:expected ${OGIT} hash-object --stdin-paths < paths
+
+	git hash-object file2 > expected
+	atf_check -o file:expected -x \
+	    "printf file2 | ${OGIT} hash-object --stdin-paths"
+
+	# Each answer comes back before the input is closed
+	mkfifo input
+	${OGIT} hash-object --stdin-paths < input > answer &
+	exec 3> input
+	echo file1 >&3
+	n=0
+	while [ ! -s answer ] && [ ${n} -lt 100 ]; do
+		sleep 0.1
+		n=$((n + 1))
+	done
+	git hash-object file1 > expected
+	atf_check -o file:expected cat answer
+	exec 3>&-
+	wait
+}
+
+atf_test_case index_pack_crc
+index_pack_crc_head()
+{
+	atf_set "descr" "index-pack writes the object CRCs git does"
+}
+
+index_pack_crc_body()
+{
+
+	export GIT_AUTHOR_NAME=ogit GIT_AUTHOR_EMAIL=ogit@example.org
+	export GIT_COMMITTER_NAME=ogit GIT_COMMITTER_EMAIL=ogit@example.org
+	git init -q src
+	cd src
+	# Incompressible objects in and around the CRC folding widths
+	for size in 1 15 16 17 63 64 65 255 256 257 4095 4096 4097 100003; do
+		head -c ${size} /dev/urandom > file${size}
+	done
+	git add file*
+	git commit -q -m "Random objects"
+	git repack -q -a -d
+	pack=$(ls .git/objects/pack/*.pack)
+
+	atf_check -o ignore ${OGIT} index-pack ${pack}
+	atf_check cmp packout.idx ${pack%.pack}.idx
+}
+
+atf_test_case clone_jobs
+clone_jobs_head()
+{
+	atf_set "descr" "clone with checkout.workers or --jobs checks out what git does"
+	atf_set "require.progs" "python3"
+	atf_set "has.cleanup" "true"
+}
+
+clone_jobs_body()
+{
+
+	make_repo
+	git clone -q --bare src srv/src.git
+
+	# A smart HTTP server for the repositories under srv
+	cat > server.py <<'EOF'
+import http.server, os, subprocess, sys
+class Handler(http.server.BaseHTTPRequestHandler):
+	def repo(self, suffix):
+		path = self.path.split('?')[0]
+		return os.path.join('srv', path[1:-len(suffix)].strip('/'))
+	def reply(self, kind, body):
+		self.send_response(200)
+		self.send_header('Content-Type', 'application/x-git-upload-pack-' + kind)
+		self.send_header('Content-Length', str(len(body)))
+		self.end_headers()
+		self.wfile.write(body)
+	def do_GET(self):
+		out = subprocess.run(['git', 'upload-pack', '--stateless-rpc',
+		    '--advertise-refs', self.repo('/info/refs')],
+		    capture_output=True).stdout
+		hdr = b'# service=git-upload-pack\n'
+		self.reply('advertisement', b'%04x' % (len(hdr) + 4) + hdr + b'0000' + out)
+	def do_POST(self):
+		data = self.rfile.read(int(self.headers['Content-Length']))
+		self.reply('result', subprocess.run(['git', 'upload-pack',
+		    '--stateless-rpc', self.repo('/git-upload-pack')],
+		    input=data, capture_output=True).stdout)
+	def log_message(self, *args):
+		pass
+server = http.server.HTTPServer(('127.0.0.1', 0), Handler)
+open('port', 'w').write(str(server.server_port))
+server.serve_forever()
+EOF
+	python3 server.py &
+	echo $! > server.pid
+	while [ ! -s port ]; do
+		sleep 0.1
+	done
+	url=http://127.0.0.1:$(cat port)/src.git
+
+	# checkout.workers is read from the user's config, --jobs overrides it
+	mkdir home
+	printf '[checkout]\n\tworkers = 4\n' > home/.gitconfig
+
+	git -C src ls-files -s > expected
+	for jobs in "" "--jobs=2" "-j 1"; do
+		rm -rf clone
+		mkdir clone
+		cd clone
+		atf_check -o ignore -e ignore env HOME=../home ${OGIT} clone \
+		    ${jobs} ${url}
+		cd src
+		atf_check -o file:../../expected git ls-files -s
+		atf_check git status --porcelain
+		atf_check git diff --quiet
+		cd ../..
+	done
+}
+
+clone_jobs_cleanup()
+{
+
+	if [ -s server.pid ]; then
+		kill $(cat server.pid)
+	fi
+}
+
 atf_init_test_cases()
 {
 	# We'll use GPL-licensed git to create our repos for sanity checking
 	atf_require_prog git
 
 	atf_add_test_case log
+	atf_add_test_case index_pack_fix_thin
+	atf_add_test_case multi_pack_index
+	atf_add_test_case index_pack_rev_index
+	atf_add_test_case rev_list
+	atf_add_test_case commit_graph
+	atf_add_test_case log_commit_graph
+	atf_add_test_case cat_file_loose
+	atf_add_test_case cat_file_batch
+	atf_add_test_case index_pack
+	atf_add_test_case index_pack_stdin
+	atf_add_test_case hash_object
+	atf_add_test_case hash_object_stdin_paths
+	atf_add_test_case index_pack_crc
+	atf_add_test_case clone_jobs
 }